@@ -0,0 +1,454 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "solver/backend.hpp"
+#include "solver/kernels.hpp"
+#include "solver/solver.hpp"
+
+using namespace std;
+
+// Times the solver kernels one call at a time on fixed inputs. Every
+// repetition starts from the same fields, restored outside the timed region,
+// so runs on the same machine are comparable across commits and backends.
+
+struct BenchParams {
+  vector<uint64_t> sizes{64, 128, 256, 512};
+  uint32_t warmup = 3;
+  uint32_t reps = 20;
+  SolverConfig solver;
+  const char *backend = nullptr;
+  const char *json = nullptr;
+  const char *csv = nullptr;
+  // Free form tag stored with every result, a commit hash for instance
+  const char *label = "";
+};
+
+struct BenchResult {
+  string kernel;
+  uint64_t n;
+  double medianNs;
+  double p99Ns;
+  double nsPerCell;
+  double gbPerS;
+};
+
+static constexpr float DT = .1f;
+static constexpr float DIFF = 1e-4f;
+
+// Smooth swirl plus a little deterministic noise, far from denormals so no
+// kernel hits slow paths
+static void fillField(const uint64_t n, float *x, const uint32_t seed) {
+  uint32_t state = seed * 2654435761u + 1;
+  for (uint64_t j = 0; j < n + 2; j++)
+    for (uint64_t i = 0; i < n + 2; i++) {
+      state = state * 1664525u + 1013904223u;
+      const float noise = (state >> 8) * 0x1p-24f - .5f;
+      x[idx(i, j, n)] = sinf(6.2831853f * (i + seed) / (n + 2)) *
+                            cosf(6.2831853f * j / (n + 2)) +
+                        .01f * noise;
+    }
+}
+
+// Nearest rank percentile of sorted samples
+static double percentile(const vector<double> &sorted, const double p) {
+  const size_t rank = size_t(ceil(p * sorted.size()));
+  return sorted[min(max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+// reset runs before every call and isn't timed. bytes is the least traffic a
+// call needs, every field it reads and writes streamed once, which turns the
+// time into an achieved bandwidth.
+static BenchResult measure(const BenchParams &p, const string &kernel,
+                           const uint64_t n, const double bytes,
+                           const function<void()> &reset,
+                           const function<void()> &run) {
+  vector<double> samples;
+  for (uint32_t k = 0; k < p.warmup + p.reps; k++) {
+    reset();
+    const auto begin = chrono::steady_clock::now();
+    run();
+    const auto end = chrono::steady_clock::now();
+    if (k >= p.warmup)
+      samples.push_back(chrono::duration<double, nano>(end - begin).count());
+  }
+
+  sort(samples.begin(), samples.end());
+  const double median = percentile(samples, .5);
+  return {kernel,
+          n,
+          median,
+          percentile(samples, .99),
+          median / (double(n) * n),
+          bytes / median};
+}
+
+// advect on copies of the inputs stored as T, as the 16 bit steps run it.
+// It only writes d, so there is nothing to reset.
+template <typename T>
+static BenchResult measureCompactAdvect(const BenchParams &p,
+                                        const CompactKernels<T> &k,
+                                        const string &kernel, const uint64_t n,
+                                        const vector<float> &vx0,
+                                        const vector<float> &vy0,
+                                        const vector<float> &d0) {
+  const uint64_t cells = (n + 2) * (n + 2);
+  vector<T> vx(cells), vy(cells), d(cells), dPrev(cells);
+  for (uint64_t c = 0; c < cells; c++) {
+    vx[c] = T(vx0[c]);
+    vy[c] = T(vy0[c]);
+    dPrev[c] = T(d0[c]);
+  }
+  return measure(p, kernel, n, 4.0 * cells * sizeof(T), [] {}, [&] {
+    k.advect(n, Boundary::NONE, d.data(), dPrev.data(), vx.data(), vy.data(),
+             DT);
+  });
+}
+
+static void benchSize(const BenchParams &p, const uint64_t n,
+                      vector<BenchResult> &results) {
+  const SolverBackend &k = solverBackend();
+  const SolverConfig &cfg = p.solver;
+  const uint64_t cells = (n + 2) * (n + 2);
+  const double field = cells * sizeof(float);
+  const double sweeps = cfg.maxIterations;
+
+  vector<float> vx0(cells), vy0(cells), d0(cells);
+  fillField(n, vx0.data(), 1);
+  fillField(n, vy0.data(), 2);
+  fillField(n, d0.data(), 3);
+  vector<float> vx(cells), vy(cells), d(cells), dPrev(cells);
+  vector<float> pressure(cells), divergence(cells);
+  const auto reset = [&] {
+    copy(vx0.begin(), vx0.end(), vx.begin());
+    copy(vy0.begin(), vy0.end(), vy.begin());
+    copy(d0.begin(), d0.end(), d.begin());
+    copy(d0.begin(), d0.end(), dPrev.begin());
+  };
+  const auto add = [&](BenchResult r) {
+    println("{:>19} {:>5} {:>12.0f} {:>12.0f} {:>9.3f} {:>8.2f}", r.kernel,
+            r.n, r.medianNs, r.p99Ns, r.nsPerCell, r.gbPerS);
+    results.push_back(move(r));
+  };
+
+  // Walls only, 2 floats moved per boundary cell
+  add(measure(p, "set_boundary", n, 4.0 * n * 2 * sizeof(float), reset,
+              [&] { setBoundary(n, Boundary::VERTICAL, d.data()); }));
+
+  add(measure(p, "add_source", n, 3 * field, reset,
+              [&] { k.addSource(n, d.data(), dPrev.data(), DT); }));
+
+  // Every sweep reads x and xPrev and writes x
+  const float a = DT * DIFF * n * n;
+  add(measure(p, "linear_solve", n, 3 * field * sweeps, reset, [&] {
+    linearSolve(n, Boundary::NONE, d.data(), dPrev.data(), a, 1 + 4 * a,
+                cfg);
+  }));
+
+  // Same solve with the grid size only known at runtime
+  SolverConfig runtimeGrid = cfg;
+  runtimeGrid.fixedGrid = false;
+  add(measure(p, "linear_solve_rt", n, 3 * field * sweeps, reset, [&] {
+    linearSolve(n, Boundary::NONE, d.data(), dPrev.data(), a, 1 + 4 * a,
+                runtimeGrid);
+  }));
+
+  add(measure(p, "diffuse", n, 3 * field * sweeps, reset, [&] {
+    diffuse(n, Boundary::NONE, d.data(), dPrev.data(), DIFF, DT, cfg);
+  }));
+
+  // An iteration applies the operator (2 fields), takes 3 dot products (5),
+  // updates x, r and p (9) and preconditions (3), plus a setup of about 10
+  const double cgSolve = (19 * sweeps + 10) * field;
+  SolverConfig cgCfg = cfg;
+  cgCfg.diffusionSolver = DiffusionSolver::CONJUGATE_GRADIENT;
+  cgCfg.pressureSolver = PressureSolver::CONJUGATE_GRADIENT;
+  add(measure(p, "diffuse_cg", n, cgSolve, reset, [&] {
+    diffuse(n, Boundary::NONE, d.data(), dPrev.data(), DIFF, DT, cgCfg);
+  }));
+
+  add(measure(p, "advect", n, 4 * field, reset, [&] {
+    k.advect(n, Boundary::NONE, d.data(), dPrev.data(), vx.data(), vy.data(),
+             DT);
+  }));
+
+  // Divergence pass, the pressure sweeps and the gradient pass
+  add(measure(p, "project", n, (4 + 3 * sweeps + 5) * field, reset, [&] {
+    project(k, n, vx.data(), vy.data(), pressure.data(), divergence.data(),
+            cfg);
+  }));
+
+  // A V-cycle smooths 4 times (3 fields each), takes 2 residuals (3 each)
+  // and restricts and prolongs (3) on the fine grid, the coarser levels add
+  // a third of that
+  SolverConfig mgCfg = cfg;
+  mgCfg.pressureSolver = PressureSolver::MULTIGRID;
+  add(measure(p, "project_mg", n, (9 + 28.0 * cfg.maxCycles) * field, reset,
+              [&] {
+                project(k, n, vx.data(), vy.data(), pressure.data(),
+                        divergence.data(), mgCfg);
+              }));
+  add(measure(p, "project_cg", n, 9 * field + cgSolve, reset, [&] {
+    project(k, n, vx.data(), vy.data(), pressure.data(), divergence.data(),
+            cgCfg);
+  }));
+
+  FluidSolver fluid(n, cfg);
+  SolverStats solverStats;
+  const auto load = [&](FluidSolver &f) {
+    copy(vx0.begin(), vx0.end(), f.field(Field::VX));
+    copy(vy0.begin(), vy0.end(), f.field(Field::VY));
+    copy(d0.begin(), d0.end(), f.field(Field::DENSITY));
+    copy(d0.begin(), d0.end(), f.source(Field::VX));
+    copy(d0.begin(), d0.end(), f.source(Field::VY));
+    copy(d0.begin(), d0.end(), f.source(Field::DENSITY));
+  };
+  const auto resetFluid = [&] { load(fluid); };
+  // 2 add_source, 2 diffuse, 2 advect and 2 project
+  const double velocityStep =
+      (2 * 3 + 2 * 3 * sweeps + 2 * 4 + 2 * (9 + 3 * sweeps)) * field;
+  const double densityStep = (3 + 3 * sweeps + 4) * field;
+  add(measure(p, "velocity_step", n, velocityStep, resetFluid,
+              [&] { fluid.velocityStep(DIFF, DT, solverStats); }));
+  add(measure(p, "density_step", n, densityStep, resetFluid,
+              [&] { fluid.densityStep(DIFF, DT, solverStats); }));
+
+  // Both steps as a task graph, against the same traffic as the two steps
+  SolverConfig tasksCfg = cfg;
+  tasksCfg.tasks = true;
+  FluidSolver tasks(n, tasksCfg);
+  add(measure(p, "step_tasks", n, velocityStep + densityStep,
+              [&] { load(tasks); },
+              [&] { tasks.step(DIFF, DIFF, DT, solverStats); }));
+
+  // Density and its source only in a disc of radius n / 8 around (n / 4,
+  // n / 4), the rest of the grid stays at 0 as a localized plume would. The
+  // traffic is still the dense step's, so GB/s reads as the bandwidth the
+  // dense step would need.
+  SolverConfig sparseCfg = cfg;
+  sparseCfg.sparse = true;
+  FluidSolver sparse(n, sparseCfg);
+  const auto resetSparse = [&] {
+    load(sparse);
+    float *density = sparse.field(Field::DENSITY);
+    float *source = sparse.source(Field::DENSITY);
+    const float r = n / 8.f;
+    for (uint64_t j = 0; j < n + 2; j++)
+      for (uint64_t i = 0; i < n + 2; i++) {
+        const float x = i - n / 4.f, y = j - n / 4.f;
+        if (x * x + y * y > r * r)
+          density[idx(i, j, n)] = source[idx(i, j, n)] = 0;
+      }
+  };
+  add(measure(p, "density_step_sparse", n, densityStep, resetSparse,
+              [&] { sparse.densityStep(DIFF, DT, solverStats); }));
+
+  // The sources ride along the first diffusion sweeps and the second
+  // divergence along the advections, which read (vx0, vy0) once and write
+  // (vx, vy), divergence and pressure
+  SolverConfig fusedCfg = cfg;
+  fusedCfg.fused = true;
+  FluidSolver fused(n, fusedCfg);
+  const auto resetFused = [&] { load(fused); };
+  add(measure(p, "velocity_step_fused", n,
+              (2 * 3 * sweeps + 6 + 2 * (3 * sweeps + 5) + 4) * field,
+              resetFused, [&] { fused.velocityStep(DIFF, DT, solverStats); }));
+  add(measure(p, "density_step_fused", n, (3 * sweeps + 4) * field,
+              resetFused, [&] { fused.densityStep(DIFF, DT, solverStats); }));
+
+  // The unfused steps with vx, vy and density stored in 16 bit, pressure
+  // and divergence stay fp32
+  add(measureCompactAdvect(p, k.half, "advect_fp16", n, vx0, vy0, d0));
+  add(measureCompactAdvect(p, k.bfloat16, "advect_bf16", n, vx0, vy0, d0));
+  const double compactField = cells * sizeof(uint16_t);
+  const double compactProject = 6 * compactField + (3 + 3 * sweeps) * field;
+  for (const auto &[storage, name] :
+       {pair{Storage::FP16, "fp16"}, pair{Storage::BF16, "bf16"}}) {
+    SolverConfig compactCfg = cfg;
+    compactCfg.storage = storage;
+    FluidSolver compact(n, compactCfg);
+    const auto resetCompact = [&] {
+      compact.setValues(Field::VX, vx0.data());
+      compact.setValues(Field::VY, vy0.data());
+      compact.setValues(Field::DENSITY, d0.data());
+      compact.setSourceValues(Field::VX, d0.data());
+      compact.setSourceValues(Field::VY, d0.data());
+      compact.setSourceValues(Field::DENSITY, d0.data());
+    };
+    add(measure(p, format("velocity_step_{}", name), n,
+                (2 * 3 + 2 * 3 * sweeps + 2 * 4) * compactField +
+                    2 * compactProject,
+                resetCompact,
+                [&] { compact.velocityStep(DIFF, DT, solverStats); }));
+    add(measure(p, format("density_step_{}", name), n,
+                (3 + 3 * sweeps + 4) * compactField, resetCompact,
+                [&] { compact.densityStep(DIFF, DT, solverStats); }));
+  }
+}
+
+// value as a JSON string literal, quotes included
+static string jsonString(const string_view value) {
+  string out = "\"";
+  for (const char c : value)
+    if (c == '"' || c == '\\')
+      out += {'\\', c};
+    else if (uint8_t(c) < 0x20)
+      out += format("\\u{:04x}", uint8_t(c));
+    else
+      out += c;
+  return out + '"';
+}
+
+// value as a CSV field, quoted only when it has to be
+static string csvField(const string_view value) {
+  if (value.find_first_of(",\"\r\n") == string_view::npos)
+    return string(value);
+  string out = "\"";
+  for (const char c : value)
+    out += c == '"' ? "\"\"" : string(1, c);
+  return out + '"';
+}
+
+static void writeJson(const BenchParams &p, const char *backend,
+                      const vector<BenchResult> &results) {
+  FILE *f = fopen(p.json, "w");
+  if (!f) {
+    println(stderr, "cannot write {}", p.json);
+    return;
+  }
+  println(f, "[");
+  for (size_t k = 0; k < results.size(); k++) {
+    const BenchResult &r = results[k];
+    println(f,
+            R"(  {{"label": {}, "backend": "{}", "kernel": "{}", "n": {}, )"
+            R"("threads": {}, "iterations": {}, "reps": {}, )"
+            R"("median_ns": {:.1f}, "p99_ns": {:.1f}, "ns_per_cell": {:.4f}, )"
+            R"("gb_per_s": {:.3f}}}{})",
+            jsonString(p.label), backend, r.kernel, r.n, p.solver.threads,
+            p.solver.maxIterations, p.reps, r.medianNs, r.p99Ns, r.nsPerCell,
+            r.gbPerS, k + 1 < results.size() ? "," : "");
+  }
+  println(f, "]");
+  fclose(f);
+}
+
+static void writeCsv(const BenchParams &p, const char *backend,
+                     const vector<BenchResult> &results) {
+  FILE *f = fopen(p.csv, "w");
+  if (!f) {
+    println(stderr, "cannot write {}", p.csv);
+    return;
+  }
+  println(f, "label,backend,kernel,n,threads,iterations,reps,median_ns,"
+             "p99_ns,ns_per_cell,gb_per_s");
+  for (const BenchResult &r : results)
+    println(f, "{},{},{},{},{},{},{},{:.1f},{:.1f},{:.4f},{:.3f}",
+            csvField(p.label), backend, r.kernel, r.n, p.solver.threads, p.solver.maxIterations,
+            p.reps, r.medianNs, r.p99Ns, r.nsPerCell, r.gbPerS);
+  fclose(f);
+}
+
+static bool parseSizes(string_view value, vector<uint64_t> &sizes) {
+  sizes.clear();
+  while (!value.empty()) {
+    const auto comma = value.find(',');
+    const uint64_t n = atoll(string(value.substr(0, comma)).c_str());
+    if (n < 2)
+      return false;
+    sizes.push_back(n);
+    value = comma == string_view::npos ? "" : value.substr(comma + 1);
+  }
+  return !sizes.empty();
+}
+
+static bool parseOption(const string_view opt, BenchParams &params) {
+  const auto eq = opt.find('=');
+  if (eq == string_view::npos)
+    return false;
+
+  SolverConfig &cfg = params.solver;
+  const string_view key = opt.substr(0, eq);
+  const string_view value = opt.substr(eq + 1);
+  if (key == "--backend")
+    params.backend = value.data();
+  else if (key == "--sizes")
+    return parseSizes(value, params.sizes);
+  else if (key == "--warmup")
+    params.warmup = atoi(value.data());
+  else if (key == "--reps")
+    params.reps = max(atoi(value.data()), 1);
+  else if (key == "--json")
+    params.json = value.data();
+  else if (key == "--csv")
+    params.csv = value.data();
+  else if (key == "--label")
+    params.label = value.data();
+  else if (key == "--threads") {
+    cfg.threads = atoi(value.data());
+    if (cfg.threads == 0)
+      cfg.threads = thread::hardware_concurrency();
+  } else if (key == "--iterations")
+    cfg.maxIterations = atoi(value.data());
+  else if (key == "--solver") {
+    if (value == "gs")
+      cfg.linearSolver = LinearSolver::GAUSS_SEIDEL;
+    else if (value == "rb")
+      cfg.linearSolver = LinearSolver::RED_BLACK;
+    else if (value == "tiled")
+      cfg.linearSolver = LinearSolver::TILED;
+    else
+      return false;
+  } else
+    return false;
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  BenchParams params;
+  for (int i = 1; i < argc; i++)
+    if (!parseOption(argv[i], params)) {
+      println(R"(usage: {} [options]
+            Options
+                --backend=NAME: auto, generic, avx2, avx512 or simd
+                --sizes=N,N,...: Grid resolutions, 64,128,256,512 by default
+                --warmup=K: Untimed calls per kernel, 3 by default
+                --reps=K: Timed calls per kernel, 20 by default
+                --solver=gs|rb|tiled: Linear solver, gs by default
+                --threads=K: Threads for the parallel solvers, 0 uses all
+                --iterations=K: Sweeps per linear solve, 20 by default
+                --json=PATH: Write the results as JSON
+                --csv=PATH: Write the results as CSV
+                --label=TEXT: Tag stored with every result)",
+              argv[0]);
+      return 1;
+    }
+
+  const char *backend = selectSolverBackend(params.backend);
+  println("Backend: {}, threads = {}, iterations = {}, warmup = {}, "
+          "reps = {}",
+          backend, params.solver.threads, params.solver.maxIterations,
+          params.warmup, params.reps);
+  println("{:>19} {:>5} {:>12} {:>12} {:>9} {:>8}", "kernel", "n",
+          "median ns", "p99 ns", "ns/cell", "GB/s");
+
+  vector<BenchResult> results;
+  for (const uint64_t n : params.sizes)
+    benchSize(params, n, results);
+
+  if (params.json)
+    writeJson(params, backend, results);
+  if (params.csv)
+    writeCsv(params, backend, results);
+
+  return 0;
+}
@@ -1,9 +1,31 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <csignal>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
 #include <print>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
+#include "pipeline.hpp"
+#include "snapshot.hpp"
+#include "solver/obstacles.hpp"
+#include "solver/profile.hpp"
 #include "solver/solver.hpp"
+#include "solver/spectral.hpp"
+#include "solver/tasks.hpp"
+#include "solver/volume.hpp"
+#include "stream.hpp"
 
 using namespace std;
 
@@ -15,79 +37,615 @@ struct NavierStokesParams {
   float visc;
   float force;
   float source;
-};
-
-struct NavierStokesState {
-  uint64_t gridSize;
-  float *vx;
-  float *vy;
-  float *vxPrev;
-  float *vyPrev;
-  float *density;
-  float *density_prev;
+  // Force and density go in as splats of this radius around the center
+  float splatRadius;
+  // With cfl set every step after the first picks dt so the fastest cell of
+  // the previous one moves cfl cells, within [dtMin, dtMax]. dt is the first
+  // step and, without dtMax, the largest.
+  float cfl;
+  float dtMin;
+  float dtMax;
+  SolverConfig solver;
+  const char *backend;
+  bool hugePages;
+  // Batch mode runs every line of this file as its own simulation, jobs of
+  // them at a time
+  const char *batch;
+  uint32_t jobs;
+  // Snapshot written every checkpointEvery steps and when the run ends or
+  // is interrupted, restart resumes from one
+  const char *checkpoint;
+  uint32_t checkpointEvery = 1000;
+  const char *restart;
+  // Frames of every streamEvery steps are appended to stream
+  const char *stream;
+  uint32_t streamEvery = 10;
+  StreamOptions streamOptions;
+  // Per zone report with every interval, hardware counters in it and a
+  // trace of every zone written when the run ends
+  bool profile;
+  bool perfCounters;
+  const char *trace;
+  uint64_t traceEvents = 1 << 20;
+  // Runs an unfused, dense and sequential fp32 twin of the simulation and
+  // reports how far the fields drift from it, to judge sparse and 16 bit
+  // steps and check fused and task ones
+  bool reference;
+  // Analyses the fields on a consumer thread from frames the solver
+  // publishes after every step, overlapped with the steps that follow
+  bool async;
+  // Timeline of the tasks of the last --tasks step, in Chrome trace format
+  const char *taskTimeline;
+  // PBM or PGM bitmap of the solid cells, scaled to the grid. main loads
+  // it once into bitmap for every simulation.
+  const char *obstacles;
+  const Bitmap *bitmap;
+  // 3 runs a VolumeSolver on an N^3 grid instead
+  uint32_t dimensions = 2;
 };
 
 struct StepStats {
   chrono::duration<double, nano> reactNsPerCell;
   chrono::duration<double, nano> velocityNsPerCell;
   chrono::duration<double, nano> densityNsPerCell;
+  SolverStats solver;
+};
+
+static constexpr const char *SOLVE_NAMES[] = {
+    "viscosity x", "viscosity y", "project", "reproject", "density",
 };
+static_assert(size(SOLVE_NAMES) == static_cast<size_t>(Solve::COUNT));
 
-static void react(const uint64_t N, const float force, const float source,
-                  float *__restrict d, float *__restrict vx,
-                  float *__restrict vy) {
-  uint64_t size = (N + 2) * (N + 2);
-  float maxVelocity2 = 0.0f;
-  float maxDensity = 0.0f;
+// Splats of the next step: a push once the flow has died down and more
+// density once it has spread out, judged on the maxima the previous step
+// tracked so nothing scans the grid. Returns how many it wrote to splats.
+static uint32_t react(const NavierStokesParams &p, const FluidSolver &fluid,
+                      Splat *splats) {
+  uint32_t count = 0;
+  const float center = p.N / 2;
+  const float speed = fluid.lastMaxSpeed();
+  if (speed * speed < 0.0000005f)
+    splats[count++] = {center, center, p.splatRadius, p.force * 10, 0, 0};
+  if (fluid.lastMaxDensity() < 1.0f)
+    splats[count++] = {center, center, p.splatRadius, 0, 0, p.source * 10};
+  return count;
+}
+
+// Duration of fn per cell of the grid
+template <typename Fn>
+static chrono::duration<double, nano> timePerCell(const uint64_t cells,
+                                                  Fn &&fn) {
+  const auto begin = chrono::steady_clock::now();
+  fn();
+  return (chrono::steady_clock::now() - begin) / double(cells);
+}
 
-  for (uint64_t i = 0; i < size; i++) {
-    if (maxVelocity2 < vx[i] * vx[i] + vy[i] * vy[i]) {
-      maxVelocity2 = vx[i] * vx[i] + vy[i] * vy[i];
+// dt of the step after one that left maxSpeed behind
+static float adaptDt(const NavierStokesParams &p, const float dt,
+                     const float maxSpeed) {
+  if (p.cfl <= 0)
+    return dt;
+  const float dtMax = p.dtMax > 0 ? p.dtMax : p.dt;
+  if (maxSpeed <= 0)
+    return dtMax;
+  // Advection moves a cell dt * N * |v| cells
+  return max(min(p.cfl / (p.N * maxSpeed), dtMax), p.dtMin);
+}
+
+static StepStats step(const NavierStokesParams &p, FluidSolver &fluid,
+                      const float dt) {
+  PROFILE_ZONE("step");
+  StepStats stats{};
+
+  const uint64_t cells = uint64_t(p.N) * p.N;
+  stats.reactNsPerCell = timePerCell(cells, [&] {
+    PROFILE_ZONE("react");
+    Splat splats[2];
+    const uint32_t count = react(p, fluid, splats);
+    if (!fluid.config().sources) {
+      fluid.inject(span(splats, count), dt);
+      return;
     }
-    if (maxDensity < d[i]) {
-      maxDensity = d[i];
+    // The sources take the splats unscaled, injecting into the back buffers
+    // writes them there, the step then adds dt times them
+    for (const Field f : {Field::VX, Field::VY, Field::DENSITY}) {
+      fluid.clearSource(f);
+      fluid.swap(f);
+    }
+    fluid.inject(span(splats, count), 1);
+    for (const Field f : {Field::VX, Field::VY, Field::DENSITY})
+      fluid.swap(f);
+  });
+  // Task steps overlap both, so they are timed as one under velocity
+  if (fluid.config().tasks) {
+    stats.velocityNsPerCell = timePerCell(
+        cells, [&] { fluid.step(p.visc, p.diff, dt, stats.solver); });
+    return stats;
+  }
+  stats.velocityNsPerCell = timePerCell(
+      cells, [&] { fluid.velocityStep(p.visc, dt, stats.solver); });
+  stats.densityNsPerCell = timePerCell(
+      cells, [&] { fluid.densityStep(p.diff, dt, stats.solver); });
+
+  return stats;
+}
+
+// Error of every field against the same simulation run in fp32, unfused and
+// dense
+static void printReferenceError(const FluidSolver &fluid,
+                                const FluidSolver &reference) {
+  static constexpr const char *FIELD_NAMES[] = {"vx", "vy", "density"};
+  static_assert(size(FIELD_NAMES) == static_cast<size_t>(Field::COUNT));
+
+  vector<float> widened;
+  for (size_t f = 0; f < size(FIELD_NAMES); f++) {
+    const float *x = fluid.values(static_cast<Field>(f), widened);
+    const float *r = reference.field(static_cast<Field>(f));
+    double maxError = 0, error2 = 0, reference2 = 0;
+    for (uint64_t k = 0; k < fluid.cells(); k++) {
+      const double e = double(x[k]) - r[k];
+      maxError = max(maxError, abs(e));
+      error2 += e * e;
+      reference2 += double(r[k]) * r[k];
+    }
+    println("  {} vs reference: max error {:.3e}, relative L2 error {:.3e}",
+            FIELD_NAMES[f], maxError,
+            reference2 > 0 ? sqrt(error2 / reference2) : sqrt(error2));
+  }
+}
+
+// What the consumer of --async makes of a frame
+struct FieldSummary {
+  uint64_t step;
+  double time;
+  // Density summed over the interior and its peak
+  double mass;
+  float maxDensity;
+  // Mean of |v|^2 / 2 over the interior
+  double kineticEnergy;
+  // Largest |div v| left by the projection
+  float maxDivergence;
+};
+
+static FieldSummary summarize(const Frame &frame) {
+  PROFILE_ZONE("summarize");
+  const uint64_t N = frame.n;
+  const float *d = frame.field(Field::DENSITY);
+  const float *vx = frame.field(Field::VX);
+  const float *vy = frame.field(Field::VY);
+
+  FieldSummary s{frame.step, frame.time, 0, 0, 0, 0};
+  for (uint64_t j = 1; j <= N; j++)
+    for (uint64_t i = 1; i <= N; i++) {
+      const uint64_t k = i + (N + 2) * j;
+      s.mass += d[k];
+      s.maxDensity = max(s.maxDensity, d[k]);
+      s.kineticEnergy += 0.5 * (vx[k] * vx[k] + vy[k] * vy[k]);
+      const float div = 0.5f * N *
+                        (vx[k + 1] - vx[k - 1] + vy[k + N + 2] -
+                         vy[k - N - 2]);
+      s.maxDivergence = max(s.maxDivergence, abs(div));
+    }
+  s.kineticEnergy /= double(N) * N;
+  return s;
+}
+
+static void printTasks(const TaskStats &ts) {
+  println("  tasks: {} steps, {} tasks, {} bands, {} stolen, parallelism "
+          "{:.2f}",
+          ts.runs, ts.tasks, ts.bands, ts.steals,
+          ts.wall.count() > 0 ? ts.busy / ts.wall : 0);
+}
+
+static void printPipeline(const FramePipeline &pipeline,
+                          TripleBuffer<FieldSummary> &summaries) {
+  const PipelineStats ps = pipeline.stats();
+  println("  async: {} frames published, {} analysed, {} skipped, lag "
+          "{:.2f} steps and {:.3f} ms on average, {} steps and {:.3f} ms at "
+          "worst",
+          ps.published, ps.consumed, ps.dropped, ps.meanLag,
+          ps.meanLatency.count(), ps.maxLag, ps.maxLatency.count());
+  summaries.take();
+  const FieldSummary &s = summaries.front();
+  if (ps.consumed)
+    println("  step {} at t = {:.4g}: mass {:.6g}, max density {:.4g}, "
+            "kinetic energy {:.4g}, max |div v| {:.3e}",
+            s.step, s.time, s.mass, s.maxDensity, s.kineticEnergy,
+            s.maxDivergence);
+}
+
+// Zones since the previous report, time per call is inclusive of the zones
+// nested in it
+static void printZones(const bool counters) {
+  for (const profile::ZoneStats &z : profile::collect()) {
+    const auto perCall = z.time / z.count;
+    if (counters && z.cycles)
+      println("  {:>18}: {:>7} calls, {:>10.1f} us/call, IPC {:.2f}, "
+              "{:.0f} LLC misses/call",
+              z.name, z.count, perCall.count() / 1e3,
+              double(z.instructions) / z.cycles,
+              double(z.llcMisses) / z.count);
+    else
+      println("  {:>18}: {:>7} calls, {:>10.1f} us/call", z.name, z.count,
+              perCall.count() / 1e3);
+  }
+}
+
+// Outcome of one simulation of a batch
+struct BatchResult {
+  chrono::duration<double, nano> nsPerCell;
+  double density;
+  // Simulated time covered by the steps
+  double time;
+  SolverStats solver;
+};
+
+// One simulation per line as N dt diff visc force source steps, the solver
+// options are shared. Empty lines and lines starting with # are skipped.
+static bool loadBatch(const char *path, const NavierStokesParams &base,
+                      vector<NavierStokesParams> &sims) {
+  ifstream in(path);
+  if (!in) {
+    println("cannot open batch file {}", path);
+    return false;
+  }
+
+  string line;
+  for (uint32_t lineNo = 1; getline(in, line); lineNo++) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    NavierStokesParams p = base;
+    istringstream fields(line);
+    if (!(fields >> p.N >> p.dt >> p.diff >> p.visc >> p.force >> p.source >>
+          p.steps)) {
+      println("{}:{}: expected N dt diff visc force source steps", path,
+              lineNo);
+      return false;
     }
+    sims.push_back(p);
   }
+  return true;
+}
+
+// Places the obstacles of p in fluid, if it has any
+static void placeObstacles(const NavierStokesParams &p, FluidSolver &fluid) {
+  if (p.bitmap)
+    fluid.setObstacles(
+        make_unique<Obstacles>(p.N, scaleBitmap(*p.bitmap, p.N)));
+}
 
-  fill(vx, vx + size, 0);
-  fill(vy, vy + size, 0);
-  fill(d, d + size, 0);
+static BatchResult simulate(const NavierStokesParams &p) {
+  FluidSolver fluid(p.N, p.solver, p.hugePages);
+  BatchResult result{};
+  placeObstacles(p, fluid);
 
-  const uint64_t centerIdx = N / 2 + (N + 2) * (N / 2);
-  if (maxVelocity2 < 0.0000005f) {
-    vx[centerIdx] = force * 10;
-    vx[centerIdx] = force * 10;
+  float dt = p.dt;
+  const auto begin = chrono::steady_clock::now();
+  for (uint32_t i = 0; i < p.steps; i++) {
+    result.solver = step(p, fluid, dt).solver;
+    result.time += dt;
+    dt = adaptDt(p, dt, result.solver.maxSpeed);
   }
-  if (maxDensity < 1.0f) {
-    d[centerIdx] = source * 10;
+  const auto end = chrono::steady_clock::now();
+  result.nsPerCell = (end - begin) / (double(p.steps) * p.N * p.N);
+
+  vector<float> widened;
+  const float *d = fluid.values(Field::DENSITY, widened);
+  for (uint64_t k = 0; k < fluid.cells(); k++)
+    result.density += d[k];
+  return result;
+}
+
+// Simulations are independent and small, so instead of splitting each one
+// across threads every worker runs whole simulations, taking the next one
+// from a shared counter as soon as it finishes. Uneven sizes balance out.
+static void runBatch(const vector<NavierStokesParams> &sims,
+                     const uint32_t jobs, vector<BatchResult> &results) {
+  results.resize(sims.size());
+  atomic<size_t> next = 0;
+  const auto work = [&] {
+    for (size_t k; (k = next.fetch_add(1)) < sims.size();)
+      results[k] = simulate(sims[k]);
+  };
+
+  vector<jthread> workers;
+  for (uint32_t w = 1; w < min<size_t>(jobs, sims.size()); w++)
+    workers.emplace_back(work);
+  work();
+}
+
+static SnapshotHeader snapshotHeader(const NavierStokesParams &p,
+                                     const uint64_t step, const float dt,
+                                     const double time) {
+  SnapshotHeader h{};
+  copy(begin(SNAPSHOT_MAGIC), end(SNAPSHOT_MAGIC), h.magic);
+  h.version = SNAPSHOT_VERSION;
+  h.n = p.N;
+  h.step = step;
+  h.steps = p.steps;
+  h.dt = p.dt;
+  h.diff = p.diff;
+  h.visc = p.visc;
+  h.force = p.force;
+  h.source = p.source;
+  h.stepDt = dt;
+  h.time = time;
+  return h;
+}
+
+// Set by SIGINT and SIGTERM, the run stops after the current step so it can
+// leave a snapshot behind
+static volatile sig_atomic_t interrupted = 0;
+
+static void onInterrupt(int) { interrupted = 1; }
+
+static constexpr const char *VOLUME_SOLVE_NAMES[] = {
+    "viscosity x", "viscosity y", "viscosity z",
+    "project",     "reproject",   "density",
+};
+static_assert(size(VOLUME_SOLVE_NAMES) ==
+              static_cast<size_t>(VolumeSolve::COUNT));
+
+// react for the 3D runs, the splats go in the middle of the volume
+static uint32_t reactVolume(const NavierStokesParams &p,
+                            const VolumeSolver &fluid, VolumeSplat *splats) {
+  uint32_t count = 0;
+  const float center = p.N / 2;
+  const float speed = fluid.lastMaxSpeed();
+  if (speed * speed < 0.0000005f)
+    splats[count++] = {center, center, center, p.splatRadius,
+                       p.force * 10, 0,      0,      0};
+  if (fluid.lastMaxDensity() < 1.0f)
+    splats[count++] = {center, center, center, p.splatRadius,
+                       0,      0,      0,      p.source * 10};
+  return count;
+}
+
+// The main loop for an N^3 grid, timed per cell like the 2D one so both
+// report on the same scale
+static int runVolume(const NavierStokesParams &params) {
+  if (params.batch || params.restart || params.checkpoint || params.stream ||
+      params.reference || params.async || params.obstacles ||
+      params.solver.sources)
+    println("3D runs ignore --batch, --restart, --checkpoint, --stream, "
+            "--reference, --async, --obstacles and --sources");
+
+  SolverConfig cfg = params.solver;
+  cfg.sources = false;
+  VolumeSolver fluid(params.N, cfg);
+  const BrickLayout &g = fluid.bricks();
+  println("Solver: rb over bricks, threads = {}, tolerance = {}, "
+          "max iterations = {}",
+          cfg.threads, cfg.tolerance, cfg.maxIterations);
+  println("Volume: {}^3 cells in {}^3 bricks of {}^3, {:.1f} MiB", params.N,
+          g.side, BrickLayout::BRICK, fluid.bytes() / double(1 << 20));
+  if (params.perfCounters && !profile::enableCounters())
+    println("perf_event counters are not available on this host");
+  if (params.trace)
+    profile::enableTrace(params.traceEvents);
+
+  const uint64_t cells = uint64_t(params.N) * params.N * params.N;
+  VolumeStats stats{};
+  StepStats aggStats{};
+  uint32_t avgCounter = 0;
+  uint64_t solveIterations[size(VOLUME_SOLVE_NAMES)]{};
+  float dt = params.dt;
+  double time = 0, aggSimulated = 0;
+  const auto runBegin = chrono::steady_clock::now();
+  auto aggBegin = runBegin;
+  uint32_t i = 0;
+  while (i < params.steps && !interrupted) {
+    PROFILE_ZONE("step");
+    aggStats.reactNsPerCell += timePerCell(cells, [&] {
+      PROFILE_ZONE("react");
+      VolumeSplat splats[2];
+      const uint32_t count = reactVolume(params, fluid, splats);
+      fluid.inject(span(splats, count), dt);
+    });
+    aggStats.velocityNsPerCell += timePerCell(
+        cells, [&] { fluid.velocityStep(params.visc, dt, stats); });
+    aggStats.densityNsPerCell += timePerCell(
+        cells, [&] { fluid.densityStep(params.diff, dt, stats); });
+    i++;
+    time += dt;
+    aggSimulated += dt;
+    dt = adaptDt(params, dt, stats.maxSpeed);
+    for (uint32_t s = 0; s < size(VOLUME_SOLVE_NAMES); s++)
+      solveIterations[s] += stats.solves[s].iterations;
+    avgCounter++;
+
+    const auto aggEnd = chrono::steady_clock::now();
+    if (aggEnd - aggBegin > 1s) {
+      const chrono::duration<double> wall = aggEnd - aggBegin;
+      println("Simulated {:.4g} s per second, t = {:.4g}, dt = {:.3g}, "
+              "max |v| = {:.3g}",
+              aggSimulated / wall.count(), time, dt, stats.maxSpeed);
+      println(R"(Total Avg: {}
+React Avg: {}
+Velocity Avg: {}
+Density Avg: {})",
+              (aggStats.reactNsPerCell + aggStats.velocityNsPerCell +
+               aggStats.densityNsPerCell) /
+                  avgCounter,
+              aggStats.reactNsPerCell / avgCounter,
+              aggStats.velocityNsPerCell / avgCounter,
+              aggStats.densityNsPerCell / avgCounter);
+      for (uint32_t s = 0; s < size(VOLUME_SOLVE_NAMES); s++) {
+        println("  {}: {:.1f} iterations, residual {:.3e}",
+                VOLUME_SOLVE_NAMES[s],
+                double(solveIterations[s]) / avgCounter,
+                stats.solves[s].residual);
+        solveIterations[s] = 0;
+      }
+      if (params.profile || params.perfCounters)
+        printZones(params.perfCounters);
+
+      aggBegin = chrono::steady_clock::now();
+      aggStats = StepStats{};
+      aggSimulated = 0;
+      avgCounter = 0;
+    }
   }
+
+  const chrono::duration<double> wall = chrono::steady_clock::now() - runBegin;
+  println("Simulated {:.4g} s in {} steps, {:.4g} s per second", time, i,
+          time / wall.count());
+  if (params.trace && !profile::writeTrace(params.trace))
+    println("cannot write trace {}: {}", params.trace, strerror(errno));
+  return 0;
 }
 
-static StepStats step(const NavierStokesParams &p,
-                      const NavierStokesState &st) {
-  // TODO: Add a macro or a mechanism to simplify this
-  const auto reactBegin = chrono::steady_clock::now();
-  react(p.N, p.force, p.source, st.density, st.vx, st.vy);
-  const auto reactEnd = chrono::steady_clock::now();
-  const chrono::duration<double, nano> reactTime = reactEnd - reactBegin;
+// Option values, indexed by the enum they select
+static constexpr const char *LINEAR_SOLVERS[] = {"gs", "rb", "tiled"};
+static constexpr const char *PRESSURE_SOLVERS[] = {"linear", "mg", "cg"};
+static constexpr const char *DIFFUSION_SOLVERS[] = {"linear", "cg"};
+static constexpr const char *PRECONDITIONERS[] = {"none", "jacobi", "ssor"};
+static constexpr const char *STREAM_CODECS[] = {"raw", "half", "delta"};
+static constexpr const char *STORAGES[] = {"fp32", "fp16", "bf16"};
 
-  const auto velocityBegin = chrono::steady_clock::now();
-  velocityStep(p.N, st.vx, st.vy, st.vxPrev, st.vyPrev, p.visc, p.dt);
-  const auto velocityEnd = chrono::steady_clock::now();
-  const chrono::duration<double, nano> velocityTime =
-      velocityEnd - velocityBegin;
+template <typename E, size_t K>
+static bool parseEnum(const string_view value, const char *const (&names)[K],
+                      E &out) {
+  for (size_t k = 0; k < K; k++)
+    if (value == names[k]) {
+      out = static_cast<E>(k);
+      return true;
+    }
+  return false;
+}
+
+static bool parseOption(const string_view opt, NavierStokesParams &params) {
+  const auto eq = opt.find('=');
+  if (eq == string_view::npos) {
+    if (opt == "--huge-pages")
+      params.hugePages = true;
+    else if (opt == "--stream-velocity")
+      params.streamOptions.velocity = true;
+    else if (opt == "--stream-interior")
+      params.streamOptions.interior = true;
+    else if (opt == "--profile")
+      params.profile = true;
+    else if (opt == "--perf-counters")
+      params.perfCounters = true;
+    else if (opt == "--reference")
+      params.reference = true;
+    else if (opt == "--fused")
+      params.solver.fused = true;
+    else if (opt == "--sparse")
+      params.solver.sparse = true;
+    else if (opt == "--async")
+      params.async = true;
+    else if (opt == "--tasks")
+      params.solver.tasks = true;
+    else if (opt == "--periodic")
+      params.solver.periodic = true;
+    else if (opt == "--sources")
+      params.solver.sources = true;
+    else if (opt == "--compact-pressure")
+      params.solver.compactPressure = true;
+    else
+      return false;
+    return true;
+  }
 
-  const auto densityBegin = chrono::steady_clock::now();
-  densityStep(p.N, st.density, st.density_prev, st.vx, st.vy, p.diff, p.dt);
-  const auto densityEnd = chrono::steady_clock::now();
-  const chrono::duration<double, nano> densityTime = densityEnd - densityBegin;
+  SolverConfig &cfg = params.solver;
+  const string_view key = opt.substr(0, eq);
+  const string_view value = opt.substr(eq + 1);
+  if (key == "--backend")
+    params.backend = value.data();
+  else if (key == "--solver")
+    return parseEnum(value, LINEAR_SOLVERS, cfg.linearSolver);
+  else if (key == "--pressure")
+    return parseEnum(value, PRESSURE_SOLVERS, cfg.pressureSolver);
+  else if (key == "--diffusion")
+    return parseEnum(value, DIFFUSION_SOLVERS, cfg.diffusionSolver);
+  else if (key == "--preconditioner")
+    return parseEnum(value, PRECONDITIONERS, cfg.preconditioner);
+  else if (key == "--storage")
+    return parseEnum(value, STORAGES, cfg.storage);
+  else if (key == "--threads") {
+    cfg.threads = atoi(value.data());
+    if (cfg.threads == 0)
+      cfg.threads = thread::hardware_concurrency();
+  } else if (key == "--tolerance")
+    cfg.tolerance = atof(value.data());
+  else if (key == "--cfl")
+    params.cfl = atof(value.data());
+  else if (key == "--dt-min")
+    params.dtMin = atof(value.data());
+  else if (key == "--dt-max")
+    params.dtMax = atof(value.data());
+  else if (key == "--max-iterations")
+    cfg.maxIterations = atoi(value.data());
+  else if (key == "--max-cycles")
+    cfg.maxCycles = atoi(value.data());
+  else if (key == "--brick")
+    cfg.sparseBrick = atoi(value.data());
+  else if (key == "--splat-radius")
+    params.splatRadius = atof(value.data());
+  else if (key == "--sparse-threshold")
+    cfg.sparseThreshold = atof(value.data());
+  else if (key == "--batch")
+    params.batch = value.data();
+  else if (key == "--jobs") {
+    params.jobs = atoi(value.data());
+    if (params.jobs == 0)
+      params.jobs = thread::hardware_concurrency();
+  } else if (key == "--checkpoint")
+    params.checkpoint = value.data();
+  else if (key == "--checkpoint-every")
+    params.checkpointEvery = atoi(value.data());
+  else if (key == "--restart")
+    params.restart = value.data();
+  else if (key == "--trace")
+    params.trace = value.data();
+  else if (key == "--trace-events")
+    params.traceEvents = atoll(value.data());
+  else if (key == "--task-timeline")
+    params.taskTimeline = value.data();
+  else if (key == "--obstacles")
+    params.obstacles = value.data();
+  else if (key == "--stream")
+    params.stream = value.data();
+  else if (key == "--stream-every")
+    params.streamEvery = atoi(value.data());
+  else if (key == "--stream-codec")
+    return parseEnum(value, STREAM_CODECS, params.streamOptions.codec);
+  else if (key == "--stream-downsample")
+    params.streamOptions.downsample = atoi(value.data());
+  else if (key == "--stream-ring")
+    params.streamOptions.ring = atoi(value.data());
+  else if (key == "--tile-depth")
+    cfg.tileDepth = atoi(value.data());
+  else if (key == "--dimensions") {
+    params.dimensions = atoi(value.data());
+    return params.dimensions == 2 || params.dimensions == 3;
+  } else
+    return false;
 
-  return {reactTime, velocityTime, densityTime};
+  return true;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 1 && argc != 8)
-    println(R"(usage: {} N dt diff visc force source
+  NavierStokesParams params{};
+  // Forces and density go in as splats unless --sources
+  params.solver.sources = false;
+  vector<const char *> args;
+  for (int i = 1; i < argc; i++) {
+    if (string_view(argv[i]).starts_with("--")) {
+      if (!parseOption(argv[i], params)) {
+        println("unknown option: {}", argv[i]);
+        return 1;
+      }
+    } else
+      args.push_back(argv[i]);
+  }
+
+  if (args.size() != 0 &&
+      (args.size() != 7 || params.batch || params.restart)) {
+    println(R"(usage: {} [options] N dt diff visc force source steps
+       {} [options] --batch=FILE
+       {} [options] --restart=SNAPSHOT
             Where
                 N: Grid resolution
                 dt: Time step
@@ -95,11 +653,127 @@ int main(int argc, char **argv) {
                 visc: Viscocity coefficient
                 force: Scales the mouse movement that generate a force
                 source: Amount of density that will be deposited
-                steps: Amount of steps to perform)",
-            argv[0]);
+                steps: Amount of steps to perform
+            Options
+                --backend=NAME: auto, generic, avx2, avx512 or simd,
+                  NAVIER_STOKES_BACKEND is used when not given
+                --huge-pages: Back the fields with huge pages
+                --batch=FILE: Run one simulation per line of FILE, given as
+                  N dt diff visc force source steps
+                --jobs=K: Simulations run at once in batch mode, 0 or
+                  unset uses all cores
+                --checkpoint=PATH: Keep a snapshot of the run at PATH
+                --checkpoint-every=K: Steps between snapshots, 1000 by
+                  default
+                --restart=SNAPSHOT: Resume the run saved in SNAPSHOT
+                --splat-radius=R: Radius in cells of the force and density
+                  splats, 0 by default: only the center cell
+                --cfl=C: Adapt dt so the fastest cell moves C cells per
+                  step, dt is only the first step
+                --dt-min=T: Smallest adapted dt, 0 by default
+                --dt-max=T: Largest adapted dt, dt by default
+                --profile: Report the time spent in every zone
+                --perf-counters: Add cycles, instructions and last level
+                  cache misses to the zone report
+                --trace=PATH: Write a Chrome trace of every zone to PATH
+                --trace-events=K: Zones traced at most, 2^20 by default
+                --stream=PATH: Append density frames to PATH
+                --stream-every=K: Steps between frames, 10 by default
+                --stream-codec=raw|half|delta: Frame encoding, delta
+                  coded half floats by default
+                --stream-velocity: Stream vx and vy as well
+                --stream-interior: Leave the ghost cells out
+                --stream-downsample=F: Average F x F blocks per cell
+                --stream-ring=K: Frames buffered before the solver waits
+                  for the writer, 4 by default
+                --solver=gs|rb|tiled: Serial Gauss-Seidel, parallel
+                  red-black or cache tiled Gauss-Seidel
+                --tile-depth=K: Sweeps fused per tiled pass, 4 by default
+                --threads=K: Threads for the parallel solvers, 0 uses all
+                --tolerance=T: Stop each solve at relative residual T
+                --max-iterations=K: Sweeps cap per solve, 20 by default
+                --pressure=linear|mg|cg: Pressure solve with sweeps,
+                  multigrid or conjugate gradient
+                --max-cycles=K: V-cycles per multigrid solve, 8 by default
+                --diffusion=linear|cg: Diffusion solve with sweeps or
+                  conjugate gradient
+                --preconditioner=none|jacobi|ssor: Conjugate gradient
+                  preconditioner, jacobi by default
+                --sources: Write the splats to the source buffers the
+                  steps add, through the fused fold with --fused and only
+                  over active bricks with --sparse, instead of injecting
+                  them into the fields
+                --fused: Merge passes of the steps, same results
+                --sparse: Only step the density where there is some
+                --brick=K: Cells per side of the bricks --sparse tracks,
+                  32 by default
+                --sparse-threshold=T: Density below which a brick is
+                  quiet, 1e-4 by default
+                --storage=fp32|fp16|bf16: Keep vx, vy and density in
+                  half or bfloat16 floats, widened in registers by the
+                  kernels; --fused, --sparse, --tasks, --periodic and
+                  --obstacles are then ignored
+                --compact-pressure: Keep pressure and divergence in the
+                  --storage format as well, relaxed with --solver,
+                  instead of fp32
+                --reference: Also run the simulation in fp32 without
+                  --fused, --sparse or --tasks and report the error of
+                  every field against it
+                --async: Summarize the fields on a second thread from
+                  copies published every step, skipping the ones it can't
+                  keep up with, and report how far it lags
+                --tasks: Run each step as a graph of tasks on a work
+                  stealing scheduler of --threads workers, same results
+                --task-timeline=PATH: Write the tasks of the last --tasks
+                  step to PATH as a Chrome trace
+                --obstacles=PATH: Solid cells from a PBM or PGM bitmap,
+                  black or dark pixels, scaled to the grid. The solves
+                  then relax over the fluid cells with --solver, in fp32,
+                  and --fused and --sparse are ignored
+                --periodic: Wrap the grid around instead of walls, with
+                  diffusion and projection solved exactly by FFT. N must
+                  be a power of two from 4 on; --solver, --fused,
+                  --sparse, --tasks and --obstacles are then ignored
+                --dimensions=2|3: Simulate an N x N grid, the default, or
+                  an N x N x N one stored in 8^3 bricks. 3D solves relax
+                  in red-black order and only take --threads,
+                  --tolerance and --max-iterations)",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
 
-  NavierStokesParams params{};
-  if (argc == 1) {
+  Bitmap bitmap;
+  if (params.obstacles) {
+    string error;
+    if (!loadBitmap(params.obstacles, bitmap, error)) {
+      println("cannot load obstacles {}: {}", params.obstacles, error);
+      return 1;
+    }
+    params.bitmap = &bitmap;
+  }
+
+  vector<NavierStokesParams> sims;
+  Snapshot snapshot;
+  if (params.batch) {
+    if (!loadBatch(params.batch, params, sims))
+      return 1;
+  } else if (params.restart) {
+    string error;
+    if (!snapshot.open(params.restart, error)) {
+      println("cannot restart from {}: {}", params.restart, error);
+      return 1;
+    }
+    const SnapshotHeader &h = snapshot.header();
+    params.N = h.n;
+    params.steps = h.steps;
+    params.dt = h.dt;
+    params.diff = h.diff;
+    params.visc = h.visc;
+    params.force = h.force;
+    params.source = h.source;
+    println("Restarting from {} at step {} of {}, N = {}", params.restart,
+            h.step, h.steps, h.n);
+  } else if (args.size() == 0) {
     params.N = 128;
     params.dt = .1;
     params.diff = 0;
@@ -117,60 +791,273 @@ int main(int argc, char **argv) {
             params.N, params.dt, params.diff, params.visc, params.force,
             params.source);
   } else {
-    params.N = atoi(argv[1]);
-    params.dt = atof(argv[2]);
-    params.diff = atof(argv[3]);
-    params.visc = atof(argv[4]);
-    params.force = atof(argv[5]);
-    params.source = atof(argv[6]);
-    params.steps = atof(argv[7]);
-  }
-
-  NavierStokesState state{};
-  state.gridSize =
-      (params.N + 2) * (params.N + 2); // Allocate extra space for boundaries
-  state.vx = new float[state.gridSize]{};
-  state.vy = new float[state.gridSize]{};
-  state.vxPrev = new float[state.gridSize]{};
-  state.vyPrev = new float[state.gridSize]{};
-  state.density = new float[state.gridSize]{};
-  state.density_prev = new float[state.gridSize]{};
+    params.N = atoi(args[0]);
+    params.dt = atof(args[1]);
+    params.diff = atof(args[2]);
+    params.visc = atof(args[3]);
+    params.force = atof(args[4]);
+    params.source = atof(args[5]);
+    params.steps = atof(args[6]);
+  }
+  const char *backend = selectSolverBackend(params.backend);
+  if (params.backend && string_view(params.backend) != "auto" &&
+      string_view(params.backend) != backend)
+    println("Backend {} is not available on this host", params.backend);
+  println("Backend: {}", backend);
+  if (params.dimensions == 3)
+    return runVolume(params);
+
+  const SolverConfig &cfg = params.solver;
+  println("Solver: {}, pressure: {}, diffusion: {}, preconditioner: {}, "
+          "threads = {}, tolerance = {}, max iterations = {}, max cycles = {}, "
+          "tile depth = {}, fused: {}, sparse: {}, tasks: {}, periodic: {}, "
+          "sources: {}, storage: {}, compact pressure: {}",
+          LINEAR_SOLVERS[static_cast<size_t>(cfg.linearSolver)],
+          PRESSURE_SOLVERS[static_cast<size_t>(cfg.pressureSolver)],
+          DIFFUSION_SOLVERS[static_cast<size_t>(cfg.diffusionSolver)],
+          PRECONDITIONERS[static_cast<size_t>(cfg.preconditioner)],
+          cfg.threads, cfg.tolerance, cfg.maxIterations, cfg.maxCycles,
+          cfg.tileDepth, cfg.fused, cfg.sparse, cfg.tasks, cfg.periodic,
+          cfg.sources, STORAGES[static_cast<size_t>(cfg.storage)],
+          cfg.compactPressure);
+  if (cfg.periodic && !SpectralSolver::supports(params.N))
+    println("--periodic needs N to be a power of two from 4 on, keeping "
+            "the walls");
+  if (cfg.storage != Storage::FP32 &&
+      (cfg.fused || cfg.sparse || cfg.tasks || cfg.periodic ||
+       params.obstacles))
+    println("16 bit steps ignore --fused, --sparse, --tasks, --periodic and "
+            "--obstacles");
+
+  if (params.batch) {
+    const uint32_t jobs =
+        params.jobs ? params.jobs : thread::hardware_concurrency();
+    println("Batch: {} simulations, {} jobs", sims.size(), jobs);
+
+    vector<BatchResult> results;
+    const auto begin = chrono::steady_clock::now();
+    runBatch(sims, jobs, results);
+    const chrono::duration<double> elapsed =
+        chrono::steady_clock::now() - begin;
 
+    uint64_t cellSteps = 0;
+    for (size_t k = 0; k < sims.size(); k++) {
+      const NavierStokesParams &p = sims[k];
+      const BatchResult &r = results[k];
+      println("#{} N = {} dt = {} diff = {} visc = {} force = {} "
+              "source = {} steps = {}: {:.2f} ns/cell, t = {:.4g}, "
+              "density {:.6g}, project residual {:.3e}",
+              k, p.N, p.dt, p.diff, p.visc, p.force, p.source, p.steps,
+              r.nsPerCell.count(), r.time, r.density,
+              r.solver.solves[static_cast<size_t>(Solve::PROJECT)].residual);
+      cellSteps += uint64_t(p.N) * p.N * p.steps;
+    }
+    println("Batch done in {:.3f} s, {:.3e} cell steps/s", elapsed.count(),
+            cellSteps / elapsed.count());
+    return 0;
+  }
+
+  // Every field has an extra ring of cells for the boundaries
+  FluidSolver fluid(params.N, params.solver, params.hugePages);
+  if (params.hugePages && !fluid.hugePages())
+    println("Huge pages are not available, using regular pages");
+  placeObstacles(params, fluid);
+  if (const Obstacles *o = fluid.obstacles())
+    println("Obstacles: {:.1f}% of the grid is fluid, {} boundary cells",
+            100 * o->fraction(), o->boundaryCells());
+
+  optional<FluidSolver> reference;
+  if (params.reference) {
+    SolverConfig plain = params.solver;
+    plain.fused = false;
+    plain.sparse = false;
+    plain.tasks = false;
+    plain.storage = Storage::FP32;
+    plain.compactPressure = false;
+    reference.emplace(params.N, plain);
+    placeObstacles(params, *reference);
+  }
+
+  uint32_t firstStep = 0;
+  float dt = params.dt;
+  double firstTime = 0;
+  if (params.restart) {
+    snapshot.restore(fluid);
+    if (reference)
+      snapshot.restore(*reference);
+    firstStep = snapshot.header().step;
+    // Older snapshots leave it 0, they always ran at dt
+    if (snapshot.header().stepDt > 0)
+      dt = snapshot.header().stepDt;
+    // Adapted dts can't be told from the step, older snapshots leave it 0
+    firstTime = snapshot.header().time;
+  }
+
+#ifndef NAVIER_STOKES_PROFILE
+  if (params.profile || params.perfCounters || params.trace)
+    println("Profiling zones are compiled out, build with "
+            "NAVIER_STOKES_PROFILE to use them");
+#endif
+  if (params.perfCounters && !profile::enableCounters())
+    println("perf_event counters are not available on this host");
+  if (params.trace)
+    profile::enableTrace(params.traceEvents);
+
+  optional<FrameStream> stream;
+  if (params.stream) {
+    FILE *file = fopen(params.stream, "wb");
+    if (!file) {
+      println("cannot open stream {}: {}", params.stream, strerror(errno));
+      return 1;
+    }
+    stream.emplace(file, params.N, params.streamOptions);
+  }
+
+  optional<SnapshotWriter> snapshots;
+  if (params.checkpoint) {
+    snapshots.emplace();
+    signal(SIGINT, onInterrupt);
+    signal(SIGTERM, onInterrupt);
+  }
+
+  // Consumer summaries go back to this thread the way frames came in
+  TripleBuffer<FieldSummary> summaries;
+  optional<FramePipeline> pipeline;
+  if (params.async)
+    pipeline.emplace(params.N, [&](const Frame &frame) {
+      summaries.back() = summarize(frame);
+      summaries.publish();
+    });
+
+  // Per step stats summed since the last report
   StepStats stepStats;
+  StepStats aggStats{};
   uint32_t avgCounter = 0;
-  auto aggBegin = chrono::steady_clock::now();
-  for (uint32_t i = 0; i < params.steps; i++) {
+  uint64_t solveIterations[size(SOLVE_NAMES)]{};
+  // Simulated time of the run and since the last report
+  double time = firstTime, aggSimulated = 0;
+  double aggActive = 0;
+  const auto runBegin = chrono::steady_clock::now();
+  auto aggBegin = runBegin;
+  uint32_t i = firstStep;
+  while (i < params.steps && !interrupted) {
 
-    stepStats = step(params, state);
+    stepStats = step(params, fluid, dt);
+    if (reference)
+      step(params, *reference, dt);
+    i++;
+    time += dt;
+    aggSimulated += dt;
+    if (pipeline)
+      pipeline->publish(i, time, dt, stepStats.solver, fluid);
+    dt = adaptDt(params, dt, stepStats.solver.maxSpeed);
+    if (stream && params.streamEvery && i % params.streamEvery == 0)
+      stream->push(i, fluid);
+    if (snapshots && params.checkpointEvery &&
+        i % params.checkpointEvery == 0 && i < params.steps)
+      snapshots->write(params.checkpoint, snapshotHeader(params, i, dt, time),
+                       fluid);
+
+    aggStats.reactNsPerCell += stepStats.reactNsPerCell;
+    aggStats.velocityNsPerCell += stepStats.velocityNsPerCell;
+    aggStats.densityNsPerCell += stepStats.densityNsPerCell;
+    for (uint32_t s = 0; s < size(SOLVE_NAMES); s++)
+      solveIterations[s] += stepStats.solver.solves[s].iterations;
+    aggActive += stepStats.solver.activeFraction;
+    avgCounter++;
 
     const auto aggEnd = chrono::steady_clock::now();
     const auto aggTime = duration_cast<chrono::seconds>(aggEnd - aggBegin);
     if (aggTime > 1s) {
-      println(R"(Total Avg: {}
+      const chrono::duration<double> wall = aggEnd - aggBegin;
+      println("Simulated {:.4g} s per second, t = {:.4g}, dt = {:.3g}, "
+              "max |v| = {:.3g}",
+              aggSimulated / wall.count(), time, dt,
+              stepStats.solver.maxSpeed);
+      if (cfg.tasks)
+        println(R"(Total Avg: {}
+React Avg: {}
+Step Avg: {})",
+                (aggStats.reactNsPerCell + aggStats.velocityNsPerCell) /
+                    avgCounter,
+                aggStats.reactNsPerCell / avgCounter,
+                aggStats.velocityNsPerCell / avgCounter);
+      else
+        println(R"(Total Avg: {}
 React Avg: {}
 Velocity Avg: {}
 Density Avg: {})",
-              (stepStats.reactNsPerCell + stepStats.velocityNsPerCell +
-               stepStats.densityNsPerCell) /
-                  avgCounter,
-              stepStats.reactNsPerCell / avgCounter,
-              stepStats.velocityNsPerCell / avgCounter,
-              stepStats.densityNsPerCell / avgCounter);
+                (aggStats.reactNsPerCell + aggStats.velocityNsPerCell +
+                 aggStats.densityNsPerCell) /
+                    avgCounter,
+                aggStats.reactNsPerCell / avgCounter,
+                aggStats.velocityNsPerCell / avgCounter,
+                aggStats.densityNsPerCell / avgCounter);
+      if (TaskScheduler *tasks = fluid.taskScheduler())
+        printTasks(tasks->collect());
+      if (cfg.sparse)
+        println("  active: {:.1f}% of the grid",
+                100.0 * aggActive / avgCounter);
+      for (uint32_t s = 0; s < size(SOLVE_NAMES); s++) {
+        println("  {}: {:.1f} iterations, residual {:.3e}", SOLVE_NAMES[s],
+                double(solveIterations[s]) / avgCounter,
+                stepStats.solver.solves[s].residual);
+        solveIterations[s] = 0;
+      }
+      if (params.profile || params.perfCounters)
+        printZones(params.perfCounters);
+      if (reference)
+        printReferenceError(fluid, *reference);
+      if (pipeline)
+        printPipeline(*pipeline, summaries);
+      if (stream) {
+        const StreamStats ss = stream->stats();
+        println("  stream: {} frames, {} bytes, {} stalls ({:.1f} ms)",
+                ss.frames, ss.bytes, ss.stalls, ss.stallTime.count());
+        if (ss.error)
+          println("  stream stopped: {}", strerror(ss.error));
+      }
 
       aggBegin = chrono::steady_clock::now();
-      stepStats.reactNsPerCell = chrono::nanoseconds::zero();
-      stepStats.velocityNsPerCell = chrono::nanoseconds::zero();
-      stepStats.densityNsPerCell = chrono::nanoseconds::zero();
-    } else
-      avgCounter++;
+      aggStats = StepStats{};
+      aggSimulated = 0;
+      aggActive = 0;
+      avgCounter = 0;
+    }
+  }
+
+  const chrono::duration<double> wall = chrono::steady_clock::now() - runBegin;
+  println("Simulated {:.4g} s in {} steps, {:.4g} s per second", time,
+          i - firstStep, (time - firstTime) / wall.count());
+
+  if (reference) {
+    println("Error after {} steps:", i);
+    printReferenceError(fluid, *reference);
+  }
+
+  if (pipeline) {
+    pipeline->finish();
+    println("Summary after {} steps:", i);
+    printPipeline(*pipeline, summaries);
   }
 
-  delete[] state.vx;
-  delete[] state.vy;
-  delete[] state.vxPrev;
-  delete[] state.vyPrev;
-  delete[] state.density;
-  delete[] state.density_prev;
+  if (params.trace && !profile::writeTrace(params.trace))
+    println("cannot write trace {}: {}", params.trace, strerror(errno));
+  if (params.taskTimeline) {
+    const TaskScheduler *tasks = fluid.taskScheduler();
+    if (!tasks)
+      println("--task-timeline needs --tasks");
+    else if (!tasks->writeTimeline(params.taskTimeline))
+      println("cannot write task timeline {}: {}", params.taskTimeline,
+              strerror(errno));
+  }
+
+  if (snapshots) {
+    snapshots->write(params.checkpoint, snapshotHeader(params, i, dt, time),
+                     fluid);
+    if (interrupted)
+      println("Interrupted at step {}, saved to {}", i, params.checkpoint);
+  }
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mpi.h>
+#include <print>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "solver/distributed.hpp"
+#include "solver/solver.hpp"
+
+using namespace std;
+
+// The headless simulation split across MPI ranks, run it with
+// mpirun -np K navier-stokes-mpi [options] N dt diff visc force source steps
+
+struct MpiParams {
+  uint32_t N;
+  uint32_t steps;
+  float dt;
+  float diff;
+  float visc;
+  float force;
+  float source;
+  SolverConfig solver;
+  uint32_t halo = 4;
+  float splatRadius;
+  // Rank 0 also runs the single process solver and compares the fields
+  bool verify;
+};
+
+static constexpr const char *FIELD_NAMES[] = {"vx", "vy", "density"};
+
+// Largest v^2 and density over the interior cells owned by this rank, then
+// over every rank. Both runs judge on these scans so they take the same
+// decisions.
+static void maxima(const DistributedSolver &fluid, float out[2]) {
+  const Tile &t = fluid.tile();
+  const float *d = fluid.field(Field::DENSITY);
+  const float *vx = fluid.field(Field::VX);
+  const float *vy = fluid.field(Field::VY);
+
+  out[0] = out[1] = 0;
+  for (int64_t j = t.jBegin; j < t.jEnd; j++)
+    for (int64_t i = t.iBegin; i < t.iEnd; i++) {
+      const uint64_t k = fluid.at(i, j);
+      out[0] = max(out[0], vx[k] * vx[k] + vy[k] * vy[k]);
+      out[1] = max(out[1], d[k]);
+    }
+  MPI_Allreduce(MPI_IN_PLACE, out, 2, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+}
+
+static void maxima(const FluidSolver &fluid, float out[2]) {
+  const uint64_t n = fluid.resolution();
+  const float *d = fluid.field(Field::DENSITY);
+  const float *vx = fluid.field(Field::VX);
+  const float *vy = fluid.field(Field::VY);
+
+  out[0] = out[1] = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++) {
+      const uint64_t k = idx(i, j, n);
+      out[0] = max(out[0], vx[k] * vx[k] + vy[k] * vy[k]);
+      out[1] = max(out[1], d[k]);
+    }
+}
+
+// react of headless: the fields carry over between steps and get a push
+// once the flow has died down and more density once it has spread out, as
+// splats around the center
+template <typename Solver>
+static void react(const MpiParams &p, Solver &fluid) {
+  float m[2];
+  maxima(fluid, m);
+
+  Splat splats[2];
+  uint32_t count = 0;
+  const float center = p.N / 2;
+  if (m[0] < 0.0000005f)
+    splats[count++] = {center, center, p.splatRadius, p.force * 10, 0, 0};
+  if (m[1] < 1.0f)
+    splats[count++] = {center, center, p.splatRadius, 0, 0, p.source * 10};
+  fluid.inject(span(splats, count), p.dt);
+}
+
+static bool parseOption(const string_view opt, MpiParams &params) {
+  if (opt == "--verify") {
+    params.verify = true;
+    return true;
+  }
+
+  const auto eq = opt.find('=');
+  if (eq == string_view::npos)
+    return false;
+  const string_view key = opt.substr(0, eq);
+  const string_view value = opt.substr(eq + 1);
+  if (key == "--halo")
+    params.halo = atoi(value.data());
+  else if (key == "--splat-radius")
+    params.splatRadius = atof(value.data());
+  else if (key == "--tolerance")
+    params.solver.tolerance = atof(value.data());
+  else if (key == "--max-iterations")
+    params.solver.maxIterations = atoi(value.data());
+  else
+    return false;
+  return true;
+}
+
+// Scoped so the solver frees its communicator before MPI_Finalize
+static void run(const MpiParams &params, const int rank, const int ranks) {
+  DistributedSolver fluid(MPI_COMM_WORLD, params.N, params.solver,
+                          params.halo);
+  if (rank == 0)
+    println("Ranks: {} as {} x {} tiles, N = {}, halo = {}", ranks,
+            fluid.dims()[1], fluid.dims()[0], params.N, fluid.halo());
+
+  // The reference runs the same red-black sweeps with the generic kernels
+  unique_ptr<FluidSolver> reference;
+  if (params.verify && rank == 0) {
+    selectSolverBackend("generic");
+    reference = make_unique<FluidSolver>(params.N, params.solver);
+  }
+
+  SolverStats stats{};
+  MPI_Barrier(MPI_COMM_WORLD);
+  const auto begin = chrono::steady_clock::now();
+  for (uint32_t i = 0; i < params.steps; i++) {
+    react(params, fluid);
+    fluid.velocityStep(params.visc, params.dt, stats);
+    fluid.densityStep(params.diff, params.dt, stats);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  const chrono::duration<double, nano> elapsed =
+      chrono::steady_clock::now() - begin;
+
+  if (rank == 0) {
+    println("{} steps: {:.2f} ns/cell per step, {} advections reached past "
+            "the halo, project residual {:.3e}",
+            params.steps,
+            elapsed.count() / (double(params.N) * params.N * params.steps),
+            fluid.wideAdvections(),
+            stats.solves[static_cast<size_t>(Solve::PROJECT)].residual);
+  }
+
+  if (params.verify) {
+    SolverStats referenceStats;
+    if (reference)
+      for (uint32_t i = 0; i < params.steps; i++) {
+        react(params, *reference);
+        reference->velocityStep(params.visc, params.dt, referenceStats);
+        reference->densityStep(params.diff, params.dt, referenceStats);
+      }
+
+    vector<float> gathered((params.N + 2) * (params.N + 2));
+    for (size_t f = 0; f < size(FIELD_NAMES); f++) {
+      fluid.gather(static_cast<Field>(f), gathered.data(), 0);
+      if (!reference)
+        continue;
+      const float *r = reference->field(static_cast<Field>(f));
+      float maxError = 0;
+      uint64_t different = 0;
+      for (uint64_t k = 0; k < gathered.size(); k++) {
+        maxError = max(maxError, abs(gathered[k] - r[k]));
+        different += gathered[k] != r[k];
+      }
+      println("  {} vs single process: {} cells differ, max error {:.3e}",
+              FIELD_NAMES[f], different, maxError);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  MPI_Init(&argc, &argv);
+  int rank, ranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+  MpiParams params{};
+  vector<const char *> args;
+  bool ok = true;
+  for (int i = 1; i < argc; i++) {
+    if (string_view(argv[i]).starts_with("--"))
+      ok = ok && parseOption(argv[i], params);
+    else
+      args.push_back(argv[i]);
+  }
+
+  if (!ok || args.size() != 7) {
+    if (rank == 0)
+      println(R"(usage: mpirun -np K {} [options]
+              N dt diff visc force source steps
+            Options
+                --halo=K: Widest halo exchange, advections reaching
+                  further fetch a window that wide from every rank
+                  owning part of it, 4 by default
+                --splat-radius=R: Radius in cells of the force and density
+                  splats, 0 by default: only the center cell
+                --tolerance=T: Stop each solve at relative residual T
+                --max-iterations=K: Sweeps cap per solve, 20 by default
+                --verify: Also run the single process solver on rank 0
+                  and compare the fields when done)",
+              argv[0]);
+    MPI_Finalize();
+    return 1;
+  }
+  params.N = atoi(args[0]);
+  params.dt = atof(args[1]);
+  params.diff = atof(args[2]);
+  params.visc = atof(args[3]);
+  params.force = atof(args[4]);
+  params.source = atof(args[5]);
+  params.steps = atoi(args[6]);
+  params.solver.linearSolver = LinearSolver::RED_BLACK;
+  // Forces and density go in as splats, as in headless
+  params.solver.sources = false;
+
+  run(params, rank, ranks);
+  MPI_Finalize();
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include "pipeline.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+static Frame emptyFrame(const uint64_t n) {
+  Frame f{};
+  f.n = n;
+  f.cells.resize(static_cast<size_t>(Field::COUNT) * (n + 2) * (n + 2));
+  return f;
+}
+
+FramePipeline::FramePipeline(const uint64_t n, Consumer consumer)
+    : n(n), consumer(std::move(consumer)), frames(emptyFrame(n)),
+      worker(&FramePipeline::work, this) {}
+
+FramePipeline::~FramePipeline() { finish(); }
+
+void FramePipeline::finish() {
+  if (!worker.joinable())
+    return;
+  stop.store(true, memory_order_release);
+  epoch.fetch_add(1, memory_order_release);
+  epoch.notify_one();
+  worker.join();
+}
+
+void FramePipeline::publish(const uint64_t step, const double time,
+                            const float dt, const SolverStats &solver,
+                            const FluidSolver &fluid) {
+  Frame &f = frames.back();
+  f.step = step;
+  f.time = time;
+  f.dt = dt;
+  f.solver = solver;
+  f.sequence = published.load(memory_order_relaxed);
+  for (const Field field : {Field::VX, Field::VY, Field::DENSITY})
+    copy_n(fluid.values(field, widened), fluid.cells(), f.field(field));
+  f.published = chrono::steady_clock::now();
+
+  // Counted first so the consumer never sees a frame newer than the count
+  published.fetch_add(1, memory_order_relaxed);
+  if (frames.publish())
+    dropped.fetch_add(1, memory_order_relaxed);
+  epoch.fetch_add(1, memory_order_release);
+  epoch.notify_one();
+}
+
+void FramePipeline::work() {
+  uint64_t seen = 0;
+  for (;;) {
+    epoch.wait(seen, memory_order_acquire);
+    seen = epoch.load(memory_order_acquire);
+    // The last publish comes before stop, so it is taken below
+    const bool last = stop.load(memory_order_acquire);
+
+    if (frames.take()) {
+      const Frame &f = frames.front();
+      const uint64_t lag =
+          published.load(memory_order_relaxed) - f.sequence - 1;
+      consumer(f);
+      const int64_t latency = chrono::nanoseconds(
+                                  chrono::steady_clock::now() - f.published)
+                                  .count();
+
+      // Single writer, plain stores are enough for the maxima
+      lagSum.fetch_add(lag, memory_order_relaxed);
+      lagMax.store(max(lagMax.load(memory_order_relaxed), lag),
+                   memory_order_relaxed);
+      latencySum.fetch_add(latency, memory_order_relaxed);
+      latencyMax.store(max(latencyMax.load(memory_order_relaxed), latency),
+                       memory_order_relaxed);
+      consumed.fetch_add(1, memory_order_release);
+    }
+
+    if (last)
+      return;
+  }
+}
+
+PipelineStats FramePipeline::stats() const {
+  PipelineStats s{};
+  s.consumed = consumed.load(memory_order_acquire);
+  s.published = published.load(memory_order_relaxed);
+  s.dropped = dropped.load(memory_order_relaxed);
+  s.maxLag = lagMax.load(memory_order_relaxed);
+  s.maxLatency = chrono::nanoseconds(latencyMax.load(memory_order_relaxed));
+  if (s.consumed) {
+    s.meanLag = double(lagSum.load(memory_order_relaxed)) / s.consumed;
+    s.meanLatency = chrono::nanoseconds(latencySum.load(memory_order_relaxed)) /
+                    double(s.consumed);
+  }
+  return s;
+}
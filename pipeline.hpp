@@ -0,0 +1,138 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "solver/solver.hpp"
+
+// Hands the latest value from one writer thread to one reader thread without
+// locks. Each side owns a slot and a third one sits between them: publishing
+// swaps the writer's slot in, taking swaps the reader's slot out, so neither
+// ever waits and the reader always gets the newest complete value.
+template <typename T> class TripleBuffer {
+public:
+  explicit TripleBuffer(const T &init = T{}) : slots{init, init, init} {}
+
+  TripleBuffer(const TripleBuffer &) = delete;
+  TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+  // Writer side, the slot to fill before publishing it
+  T &back() { return slots[backSlot]; }
+  // Returns whether it replaced a value the reader never took
+  bool publish() {
+    const uint32_t old =
+        middle.exchange(backSlot | FRESH, std::memory_order_acq_rel);
+    backSlot = old & INDEX;
+    return old & FRESH;
+  }
+
+  // Reader side, moves the latest value into front() if there is a new one
+  bool take() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    frontSlot = middle.exchange(frontSlot, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+  const T &front() const { return slots[frontSlot]; }
+
+private:
+  static constexpr uint32_t INDEX = 3;
+  static constexpr uint32_t FRESH = 4;
+
+  T slots[3];
+  uint32_t backSlot = 0;
+  uint32_t frontSlot = 1;
+  std::atomic<uint32_t> middle{2};
+};
+
+// Immutable copy of the fields after a step
+struct Frame {
+  uint64_t n;
+  uint64_t step;
+  // Simulated time at the end of the step and the dt it ran with
+  double time;
+  float dt;
+  SolverStats solver;
+  // Frames published before this one
+  uint64_t sequence;
+  std::chrono::steady_clock::time_point published;
+  // vx, vy and density, (n + 2) * (n + 2) cells each
+  std::vector<float> cells;
+
+  float *field(const Field f) {
+    return cells.data() + static_cast<size_t>(f) * (n + 2) * (n + 2);
+  }
+  const float *field(const Field f) const {
+    return cells.data() + static_cast<size_t>(f) * (n + 2) * (n + 2);
+  }
+};
+
+struct PipelineStats {
+  uint64_t published;
+  uint64_t consumed;
+  // Frames replaced by a newer one before the consumer got to them
+  uint64_t dropped;
+  // Steps the solver was ahead when a frame was taken
+  double meanLag;
+  uint64_t maxLag;
+  // From publishing a frame to the consumer being done with it
+  std::chrono::duration<double, std::milli> meanLatency;
+  std::chrono::duration<double, std::milli> maxLatency;
+};
+
+// Runs a consumer of the fields on its own thread while the solver keeps
+// stepping. Every step is published as a Frame, the consumer works on the
+// newest one and skips whatever was published while it was busy, so the
+// solver only pays for the copy and never waits on analysis or I/O.
+class FramePipeline {
+public:
+  using Consumer = std::function<void(const Frame &)>;
+
+  FramePipeline(const uint64_t n, Consumer consumer);
+  ~FramePipeline();
+
+  FramePipeline(const FramePipeline &) = delete;
+  FramePipeline &operator=(const FramePipeline &) = delete;
+
+  // Copies the current fields of fluid as the frame of step, never blocks
+  void publish(const uint64_t step, const double time, const float dt,
+               const SolverStats &solver, const FluidSolver &fluid);
+
+  // Waits for the consumer to be done with the last frame published, no
+  // publish may follow
+  void finish();
+
+  PipelineStats stats() const;
+
+private:
+  void work();
+
+  uint64_t n;
+  Consumer consumer;
+  TripleBuffer<Frame> frames;
+  // Fields of 16 bit solvers widened by publish, on the solver thread
+  std::vector<float> widened;
+
+  // Bumped by every publish and by the destructor, the consumer sleeps on it
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<bool> stop{false};
+
+  // Only written by the solver thread
+  std::atomic<uint64_t> published{0};
+  std::atomic<uint64_t> dropped{0};
+  // Only written by the consumer thread
+  std::atomic<uint64_t> consumed{0};
+  std::atomic<uint64_t> lagSum{0};
+  std::atomic<uint64_t> lagMax{0};
+  std::atomic<int64_t> latencySum{0};
+  std::atomic<int64_t> latencyMax{0};
+
+  std::thread worker;
+};
+
+#endif
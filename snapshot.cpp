@@ -0,0 +1,175 @@
+#include "snapshot.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <print>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static constexpr Field SNAPSHOT_FIELDS[] = {Field::VX, Field::VY,
+                                            Field::DENSITY};
+
+static bool writeAll(const int fd, const void *data, size_t bytes) {
+  const char *p = static_cast<const char *>(data);
+  while (bytes > 0) {
+    const ssize_t w = ::write(fd, p, bytes);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += w;
+    bytes -= w;
+  }
+  return true;
+}
+
+SnapshotWriter::SnapshotWriter() : worker(&SnapshotWriter::work, this) {}
+
+SnapshotWriter::~SnapshotWriter() {
+  {
+    lock_guard lk(m);
+    stop = true;
+  }
+  wake.notify_one();
+  worker.join();
+}
+
+void SnapshotWriter::write(const string &path, const SnapshotHeader &header,
+                           const FluidSolver &fluid) {
+  unique_lock lk(m);
+  idle.wait(lk, [&] { return !pending; });
+
+  this->path = path;
+  this->header = header;
+  const uint64_t cells = fluid.cells();
+  const size_t count = size(SNAPSHOT_FIELDS);
+  fields.resize(2 * count * cells);
+  // Snapshots are fp32 whatever the solver stores
+  vector<float> widened;
+  for (size_t f = 0; f < count; f++) {
+    copy_n(fluid.values(SNAPSHOT_FIELDS[f], widened), cells,
+           fields.data() + f * cells);
+    copy_n(fluid.sourceValues(SNAPSHOT_FIELDS[f], widened), cells,
+           fields.data() + (count + f) * cells);
+  }
+
+  pending = true;
+  lk.unlock();
+  wake.notify_one();
+}
+
+void SnapshotWriter::work() {
+  unique_lock lk(m);
+  for (;;) {
+    wake.wait(lk, [&] { return stop || pending; });
+    if (!pending)
+      return;
+
+    // The buffers are only touched again once pending is cleared
+    lk.unlock();
+    const string tmp = path + ".tmp";
+    const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && writeAll(fd, &header, sizeof(header)) &&
+              writeAll(fd, fields.data(), fields.size() * sizeof(float)) &&
+              fdatasync(fd) == 0;
+    if (fd >= 0)
+      ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok)
+      println(stderr, "snapshot {}: {}", path, strerror(errno));
+    lk.lock();
+
+    pending = false;
+    idle.notify_all();
+  }
+}
+
+Snapshot::~Snapshot() {
+  if (data)
+    munmap(data, bytes);
+}
+
+bool Snapshot::open(const char *path, string &error) {
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    error = strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    error = strerror(errno);
+    close(fd);
+    return false;
+  }
+  if (size_t(st.st_size) < offsetof(SnapshotHeader, time)) {
+    error = "too short for a snapshot header";
+    close(fd);
+    return false;
+  }
+
+  bytes = st.st_size;
+  data = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    data = nullptr;
+    error = strerror(errno);
+    return false;
+  }
+
+  SnapshotHeader &h = head;
+  memcpy(&h, data, offsetof(SnapshotHeader, time));
+  if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+    error = "not a snapshot";
+    return false;
+  }
+  if (h.version < 1 || h.version > SNAPSHOT_VERSION) {
+    error = "unsupported snapshot version";
+    return false;
+  }
+  headBytes =
+      h.version < 3 ? offsetof(SnapshotHeader, time) : sizeof(SnapshotHeader);
+  const uint64_t cells = (uint64_t(h.n) + 2) * (h.n + 2);
+  const uint64_t buffers = (h.version == 1 ? 1 : 2) * size(SNAPSHOT_FIELDS);
+  if (bytes != headBytes + buffers * cells * sizeof(float)) {
+    error = "size doesn't match its resolution";
+    return false;
+  }
+  memcpy(&h, data, headBytes);
+
+  // Restart reads every page right away, start reading them in now
+  madvise(data, bytes, MADV_WILLNEED);
+  return true;
+}
+
+const float *Snapshot::field(const Field f) const {
+  const uint64_t cells = (uint64_t(header().n) + 2) * (header().n + 2);
+  const float *fields = reinterpret_cast<const float *>(
+      static_cast<const char *>(data) + headBytes);
+  const size_t k = find(begin(SNAPSHOT_FIELDS), end(SNAPSHOT_FIELDS), f) -
+                   begin(SNAPSHOT_FIELDS);
+  return fields + k * cells;
+}
+
+const float *Snapshot::previous(const Field f) const {
+  if (header().version == 1)
+    return nullptr;
+  const uint64_t cells = (uint64_t(header().n) + 2) * (header().n + 2);
+  return field(f) + size(SNAPSHOT_FIELDS) * cells;
+}
+
+void Snapshot::restore(FluidSolver &fluid) const {
+  for (const Field f : SNAPSHOT_FIELDS) {
+    fluid.setValues(f, field(f));
+    if (const float *p = previous(f))
+      fluid.setSourceValues(f, p);
+  }
+  fluid.measure();
+}
@@ -0,0 +1,106 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "solver/solver.hpp"
+
+// A snapshot file is this header followed by the current vx, vy and density
+// buffers, then their back buffers, (n + 2) * (n + 2) native floats each with
+// the ghost cells. Steps without sources start their solves from the back
+// buffers, so together that is all the state a step reads and resuming from
+// one is bit exact. Version 1 snapshots only hold the current buffers and
+// headers before version 3 end before time.
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n;
+  // Steps already run and steps the run was asked for
+  uint64_t step;
+  uint64_t steps;
+  float dt;
+  float diff;
+  float visc;
+  float force;
+  float source;
+  // dt of the next step, which differs from dt once a run adapts it
+  float stepDt;
+  // Simulated time of the steps already run, adapted dts included
+  double time;
+};
+
+static constexpr char SNAPSHOT_MAGIC[8] = "NSSNAP";
+static constexpr uint32_t SNAPSHOT_VERSION = 3;
+
+// Snapshots written by the simulation must not stall it: write copies the
+// fields and returns, a background thread puts them on disk. The file is
+// written next to its path and renamed over it once synced, so a run killed
+// mid write still leaves the previous snapshot intact.
+class SnapshotWriter {
+public:
+  SnapshotWriter();
+  // Waits for the snapshot in flight
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter &) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+  // Blocks only if the previous snapshot is still being written
+  void write(const std::string &path, const SnapshotHeader &header,
+             const FluidSolver &fluid);
+
+private:
+  void work();
+
+  std::mutex m;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  bool pending = false;
+  bool stop = false;
+
+  std::string path;
+  SnapshotHeader header;
+  std::vector<float> fields;
+
+  std::thread worker;
+};
+
+// Read only mapping of a snapshot, fields are paged in on first access so
+// opening is immediate whatever the grid size
+class Snapshot {
+public:
+  Snapshot() = default;
+  ~Snapshot();
+
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+
+  // Returns false, with a message in error, if the file can't be mapped or
+  // isn't a snapshot of this version
+  bool open(const char *path, std::string &error);
+
+  // Older headers are shorter, the fields they lack read as 0
+  const SnapshotHeader &header() const { return head; }
+  const float *field(const Field f) const;
+  // Back buffer of f, null in version 1 snapshots
+  const float *previous(const Field f) const;
+
+  // Copies the fields into fluid, which must have the snapshot resolution,
+  // and has it measure them for the next step
+  void restore(FluidSolver &fluid) const;
+
+private:
+  void *data = nullptr;
+  size_t bytes = 0;
+  SnapshotHeader head{};
+  // Bytes of the header in the file
+  size_t headBytes = 0;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef BACKEND_HPP
+#define BACKEND_HPP
+
+#include "kernels.hpp"
+#include "precision.hpp"
+#include "solver.hpp"
+#include "sparse.hpp"
+
+#include <cstdint>
+
+// x += dt * s over the whole padded grid
+using AddSourceFn = void (*)(const uint64_t n, float *__restrict x,
+                             float *__restrict s, const float dt);
+// Semi-Lagrangian transport of dPrev along (vx, vy) into d, returns the
+// largest interior value of d or 0 if there is none above
+using AdvectFn = float (*)(const uint64_t n, const Boundary b,
+                           float *__restrict d, float *__restrict dPrev,
+                           float *__restrict vx, float *__restrict vy,
+                           const float dt);
+// Right hand side of the pressure equation, also zeroes the pressure
+using DivergenceFn = void (*)(const uint64_t n, float *__restrict vx,
+                              float *__restrict vy, float *__restrict pressure,
+                              float *__restrict divergence);
+// Subtracts the pressure gradient from (vx, vy) and returns the largest
+// vx^2 + vy^2 of the result, what an adaptive step size needs
+using SubtractGradientFn = float (*)(const uint64_t n, float *__restrict vx,
+                                     float *__restrict vy,
+                                     float *__restrict pressure);
+// advect over the active cells only, the walls are still set everywhere
+using AdvectActiveFn = float (*)(const uint64_t n, const Boundary b,
+                                 float *__restrict d, float *__restrict dPrev,
+                                 float *__restrict vx, float *__restrict vy,
+                                 const float dt, const ActiveBricks &active);
+// Both velocity advections of a step and the divergence of their result in
+// one pass, the same as advect twice and divergence
+using AdvectVelocityFn = void (*)(const uint64_t n, float *__restrict vx,
+                                  float *__restrict vy, float *__restrict vx0,
+                                  float *__restrict vy0,
+                                  float *__restrict pressure,
+                                  float *__restrict divergence, const float dt);
+
+// The kernels of an unfused step on fields stored as T, see
+// SolverConfig::storage. They load T, compute in float and round on store.
+// The pressure is float or, for the Compact ones, T as well.
+template <typename T> struct CompactKernels {
+  void (*addSource)(const uint64_t n, T *__restrict x, T *__restrict s,
+                    const float dt);
+  float (*advect)(const uint64_t n, const Boundary b, T *__restrict d,
+                  T *__restrict dPrev, T *__restrict vx, T *__restrict vy,
+                  const float dt);
+  void (*divergence)(const uint64_t n, T *__restrict vx, T *__restrict vy,
+                     float *__restrict pressure, float *__restrict divergence);
+  void (*divergenceCompact)(const uint64_t n, T *__restrict vx,
+                            T *__restrict vy, T *__restrict pressure,
+                            T *__restrict divergence);
+  float (*subtractGradient)(const uint64_t n, T *__restrict vx,
+                            T *__restrict vy, float *__restrict pressure);
+  float (*subtractGradientCompact)(const uint64_t n, T *__restrict vx,
+                                   T *__restrict vy, T *__restrict pressure);
+};
+
+// Kernels every solver variant hands to the dispatcher, FluidSolver chains
+// them into steps. The linear solves are shared by every variant and run
+// from the executable, between divergence and subtractGradient.
+struct SolverBackend {
+  const char *name;
+  AddSourceFn addSource;
+  AdvectFn advect;
+  DivergenceFn divergence;
+  SubtractGradientFn subtractGradient;
+  AdvectVelocityFn advectVelocity;
+  AdvectActiveFn advectActive;
+  CompactKernels<Half> half;
+  CompactKernels<BFloat16> bfloat16;
+};
+
+// Always linked in, used when no faster variant can be loaded
+extern const SolverBackend genericBackend;
+
+// The selected backend, picked on first use if selectSolverBackend was never
+// called
+const SolverBackend &solverBackend();
+
+// Makes (vx, vy) divergence free, pressure and divergence are scratch
+SolveStats project(const SolverBackend &k, const uint64_t n,
+                   float *__restrict vx, float *__restrict vy,
+                   float *__restrict pressure, float *__restrict divergence,
+                   const SolverConfig &cfg);
+
+// Loadable variants are built as modules named libsolver_<name>.so next to
+// the executable, each exporting this function
+#define SOLVER_BACKEND_ENTRY "navierStokesSolverBackend"
+
+#endif
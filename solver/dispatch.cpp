@@ -0,0 +1,93 @@
+#include "backend.hpp"
+#include "solver.hpp"
+
+#include <cstdlib>
+#include <dlfcn.h>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+using namespace std;
+
+// Loadable variants, fastest first
+#if defined(__x86_64__) || defined(__i386__)
+static constexpr const char *VARIANTS[] = {"avx512", "avx2"};
+#else
+static constexpr const char *VARIANTS[] = {"simd"};
+#endif
+
+static const SolverBackend *active = nullptr;
+static mutex activeMutex;
+
+static bool hostSupports(const string_view name) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (name == "avx512")
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512vl") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512dq");
+  if (name == "avx2")
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+           __builtin_cpu_supports("f16c");
+#endif
+  return name == "simd";
+}
+
+static const SolverBackend *load(const string_view name) {
+  error_code ec;
+  const filesystem::path exe = filesystem::read_symlink("/proc/self/exe", ec);
+  if (ec)
+    return nullptr;
+  const string path =
+      exe.parent_path() / ("libsolver_" + string(name) + ".so");
+
+  // Modules stay loaded until exit, so switching backends is always safe
+  void *module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!module)
+    return nullptr;
+
+  using EntryFn = const SolverBackend *(*)();
+  const auto entry =
+      reinterpret_cast<EntryFn>(dlsym(module, SOLVER_BACKEND_ENTRY));
+  if (!entry) {
+    dlclose(module);
+    return nullptr;
+  }
+  return entry();
+}
+
+static const SolverBackend *pick(const char *name) {
+  if (!name || !*name)
+    name = getenv("NAVIER_STOKES_BACKEND");
+  const string_view requested = name && *name ? name : "auto";
+
+  if (requested == "generic")
+    return &genericBackend;
+
+  for (const char *variant : VARIANTS) {
+    if (requested != "auto" && requested != variant)
+      continue;
+    if (!hostSupports(variant))
+      continue;
+    if (const SolverBackend *b = load(variant))
+      return b;
+  }
+
+  return &genericBackend;
+}
+
+const char *selectSolverBackend(const char *name) {
+  lock_guard lk(activeMutex);
+  active = pick(name);
+  return active->name;
+}
+
+const SolverBackend &solverBackend() {
+  lock_guard lk(activeMutex);
+  if (!active)
+    active = pick(nullptr);
+  return *active;
+}
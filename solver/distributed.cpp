@@ -0,0 +1,566 @@
+#include "distributed.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+// Halo directions, data sent towards direction d is tagged d
+enum { LEFT = 0, RIGHT = 1, DOWN = 2, UP = 3 };
+
+// Current and previous buffer per field plus pressure and divergence
+static constexpr size_t BUFFERS = 2 * static_cast<size_t>(Field::COUNT) + 2;
+
+DistributedSolver::DistributedSolver(MPI_Comm comm, const uint64_t n,
+                                     const SolverConfig &cfg,
+                                     const uint32_t halo)
+    : n(n), cfg(cfg) {
+  int size;
+  MPI_Comm_size(comm, &size);
+  rankDims[0] = rankDims[1] = 0;
+  MPI_Dims_create(size, 2, rankDims);
+  if (n < uint64_t(max(rankDims[0], rankDims[1])))
+    throw invalid_argument("grid smaller than the rank grid");
+
+  const int periods[2] = {0, 0};
+  MPI_Cart_create(comm, 2, rankDims, periods, 1, &cart);
+  MPI_Comm_rank(cart, &cartRank);
+  int coords[2];
+  MPI_Cart_coords(cart, cartRank, 2, coords);
+  MPI_Cart_shift(cart, 1, 1, &left, &right);
+  MPI_Cart_shift(cart, 0, 1, &down, &up);
+  own = tileAt(coords[1], coords[0]);
+  tiles.resize(size);
+  for (int r = 0; r < size; r++) {
+    MPI_Cart_coords(cart, r, 2, coords);
+    tiles[r] = tileAt(coords[1], coords[0]);
+  }
+
+  // Exchanges only reach the next tile, which is at least this wide
+  const uint64_t narrowest = n / max(rankDims[0], rankDims[1]);
+  haloWidth = uint32_t(clamp<uint64_t>(halo, 1, narrowest));
+  stride = (own.iEnd - own.iBegin) + 2 * haloWidth;
+  const uint64_t cells = stride * ((own.jEnd - own.jBegin) + 2 * haloWidth);
+
+  storage.assign(BUFFERS * cells, 0);
+  float *next = storage.data();
+  for (size_t f = 0; f < FIELDS; f++) {
+    buffers[f][0] = next;
+    buffers[f][1] = next + cells;
+    next += 2 * cells;
+  }
+  pressure = next;
+  divergence = next + cells;
+}
+
+DistributedSolver::~DistributedSolver() { MPI_Comm_free(&cart); }
+
+Tile DistributedSolver::tileAt(const int ci, const int cj) const {
+  const int64_t m = n;
+  Tile t;
+  t.iBegin = 1 + m * ci / rankDims[1];
+  t.iEnd = 1 + m * (ci + 1) / rankDims[1];
+  t.jBegin = 1 + m * cj / rankDims[0];
+  t.jEnd = 1 + m * (cj + 1) / rankDims[0];
+  t.iOwnedBegin = ci == 0 ? 0 : t.iBegin;
+  t.iOwnedEnd = ci == rankDims[1] - 1 ? m + 2 : t.iEnd;
+  t.jOwnedBegin = cj == 0 ? 0 : t.jBegin;
+  t.jOwnedEnd = cj == rankDims[0] - 1 ? m + 2 : t.jEnd;
+  return t;
+}
+
+// Axis 0 trades columns with the left and right neighbours, over rows
+// [begin, end), axis 1 rows with the ones below and above, over columns
+// [begin, end). Both sides pack j outer and i inner.
+void DistributedSolver::postExchange(float *x, const uint32_t axis,
+                                     const uint32_t width,
+                                     const int64_t begin,
+                                     const int64_t end) {
+  const uint64_t count = width * (end - begin);
+  const int neighbours[2] = {axis ? down : left, axis ? up : right};
+  const int64_t edges[2] = {axis ? own.jBegin : own.iBegin,
+                            (axis ? own.jEnd : own.iEnd) - width};
+
+  for (uint32_t side = 0; side < 2; side++) {
+    const int dir = 2 * axis + side;
+    if (neighbours[side] == MPI_PROC_NULL)
+      continue;
+
+    vector<float> &send = sendBuffers[dir];
+    send.resize(count);
+    uint64_t k = 0;
+    for (int64_t l = begin; l < end; l++)
+      for (int64_t w = 0; w < width; w++)
+        send[k++] = axis ? x[at(l, edges[side] + w)]
+                         : x[at(edges[side] + w, l)];
+    recvBuffers[dir].resize(count);
+
+    // What the neighbour on this side sends comes towards the other side
+    requests.emplace_back();
+    MPI_Irecv(recvBuffers[dir].data(), count, MPI_FLOAT, neighbours[side],
+              2 * axis + (1 - side), cart, &requests.back());
+    requests.emplace_back();
+    MPI_Isend(send.data(), count, MPI_FLOAT, neighbours[side], dir, cart,
+              &requests.back());
+  }
+}
+
+// Waits for every exchange in flight and unpacks the one of axis
+void DistributedSolver::finishExchange(float *x, const uint32_t axis,
+                                       const uint32_t width,
+                                       const int64_t begin,
+                                       const int64_t end) {
+  {
+    PROFILE_ZONE("halo_wait");
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    requests.clear();
+  }
+
+  const int neighbours[2] = {axis ? down : left, axis ? up : right};
+  const int64_t halos[2] = {(axis ? own.jBegin : own.iBegin) - width,
+                            axis ? own.jEnd : own.iEnd};
+  for (uint32_t side = 0; side < 2; side++) {
+    if (neighbours[side] == MPI_PROC_NULL)
+      continue;
+
+    const vector<float> &recv = recvBuffers[2 * axis + side];
+    uint64_t k = 0;
+    for (int64_t l = begin; l < end; l++)
+      for (int64_t w = 0; w < width; w++)
+        (axis ? x[at(l, halos[side] + w)] : x[at(halos[side] + w, l)]) =
+            recv[k++];
+  }
+}
+
+// The four edge neighbours of every interior cell, all a stencil reads
+void DistributedSolver::exchangeFaces(float *x) {
+  PROFILE_ZONE("halo_exchange");
+  postExchange(x, 0, 1, own.jBegin, own.jEnd);
+  postExchange(x, 1, 1, own.iBegin, own.iEnd);
+  finishExchange(x, 0, 1, own.jBegin, own.jEnd);
+  finishExchange(x, 1, 1, own.iBegin, own.iEnd);
+}
+
+// Every cell within width of the tile, corners included: the rows are sent
+// once the columns arrived, carrying the diagonal neighbours along
+void DistributedSolver::exchangeHalo(float *x, const uint32_t width) {
+  PROFILE_ZONE("halo_exchange");
+  postExchange(x, 0, width, own.jOwnedBegin, own.jOwnedEnd);
+  finishExchange(x, 0, width, own.jOwnedBegin, own.jOwnedEnd);
+  postExchange(x, 1, width, own.iBegin - width, own.iEnd + width);
+  finishExchange(x, 1, width, own.iBegin - width, own.iEnd + width);
+}
+
+// Cells within reach of the tile, ghosts included, from every rank owning
+// some of them into windowCells. Every rank knows all the tiles, so both
+// sides of each transfer work out its block on their own and a single
+// all to all moves them.
+void DistributedSolver::exchangeWindow(const float *x, const uint32_t reach) {
+  PROFILE_ZONE("window_exchange");
+  const int64_t last = n + 2;
+  const auto around = [&](const Tile &t) {
+    return Window{max<int64_t>(t.iBegin - reach, 0),
+                  min<int64_t>(t.iEnd + reach, last),
+                  max<int64_t>(t.jBegin - reach, 0),
+                  min<int64_t>(t.jEnd + reach, last)};
+  };
+  // Part of w that t owns, the ranges are empty when they miss
+  const auto overlap = [](const Window &w, const Tile &t) {
+    return Window{max(w.iBegin, t.iOwnedBegin), min(w.iEnd, t.iOwnedEnd),
+                  max(w.jBegin, t.jOwnedBegin), min(w.jEnd, t.jOwnedEnd)};
+  };
+  const auto cells = [](const Window &w) -> int64_t {
+    return w.iEnd > w.iBegin && w.jEnd > w.jBegin
+               ? (w.iEnd - w.iBegin) * (w.jEnd - w.jBegin)
+               : 0;
+  };
+
+  const int size = tiles.size();
+  vector<int> sendCounts(size), sendOffsets(size);
+  vector<int> recvCounts(size), recvOffsets(size);
+  window = around(own);
+  windowSend.clear();
+  int received = 0;
+  for (int r = 0; r < size; r++) {
+    const Window out = overlap(around(tiles[r]), own);
+    sendOffsets[r] = windowSend.size();
+    sendCounts[r] = cells(out);
+    if (sendCounts[r] > 0)
+      for (int64_t j = out.jBegin; j < out.jEnd; j++)
+        for (int64_t i = out.iBegin; i < out.iEnd; i++)
+          windowSend.push_back(x[at(i, j)]);
+    recvOffsets[r] = received;
+    recvCounts[r] = cells(overlap(window, tiles[r]));
+    received += recvCounts[r];
+  }
+
+  windowRecv.resize(received);
+  MPI_Alltoallv(windowSend.data(), sendCounts.data(), sendOffsets.data(),
+                MPI_FLOAT, windowRecv.data(), recvCounts.data(),
+                recvOffsets.data(), MPI_FLOAT, cart);
+
+  const int64_t width = window.iEnd - window.iBegin;
+  windowCells.resize(cells(window));
+  for (int r = 0; r < size; r++) {
+    if (recvCounts[r] == 0)
+      continue;
+    const Window in = overlap(window, tiles[r]);
+    uint64_t k = recvOffsets[r];
+    for (int64_t j = in.jBegin; j < in.jEnd; j++)
+      for (int64_t i = in.iBegin; i < in.iEnd; i++)
+        windowCells[(i - window.iBegin) + width * (j - window.jBegin)] =
+            windowRecv[k++];
+  }
+}
+
+// Owned cells of every rank into full, laid out as idx()
+void DistributedSolver::gatherAll(const float *x, vector<float> &full) {
+  PROFILE_ZONE("gather_all");
+  const int size = tiles.size();
+  vector<int> counts(size), offsets(size);
+  for (int r = 0, offset = 0; r < size; r++) {
+    const Tile &t = tiles[r];
+    counts[r] = (t.iOwnedEnd - t.iOwnedBegin) * (t.jOwnedEnd - t.jOwnedBegin);
+    offsets[r] = offset;
+    offset += counts[r];
+  }
+
+  vector<float> mine;
+  mine.reserve(counts[cartRank]);
+  for (int64_t j = own.jOwnedBegin; j < own.jOwnedEnd; j++)
+    for (int64_t i = own.iOwnedBegin; i < own.iOwnedEnd; i++)
+      mine.push_back(x[at(i, j)]);
+
+  vector<float> packed((n + 2) * (n + 2));
+  MPI_Allgatherv(mine.data(), mine.size(), MPI_FLOAT, packed.data(),
+                 counts.data(), offsets.data(), MPI_FLOAT, cart);
+
+  full.resize((n + 2) * (n + 2));
+  for (int r = 0; r < size; r++) {
+    const Tile &t = tiles[r];
+    uint64_t k = offsets[r];
+    for (int64_t j = t.jOwnedBegin; j < t.jOwnedEnd; j++)
+      for (int64_t i = t.iOwnedBegin; i < t.iOwnedEnd; i++)
+        full[idx(i, j, n)] = packed[k++];
+  }
+}
+
+void DistributedSolver::gather(const Field f, float *out, const int root) {
+  vector<float> all;
+  gatherAll(field(f), all);
+  if (cartRank == root)
+    copy(all.begin(), all.end(), out);
+}
+
+// setBoundary on the ghost cells this tile owns, in the same order so the
+// corners see the same, partly stale, neighbours
+void DistributedSolver::setWalls(const Boundary b, float *x) {
+  const int64_t m = n;
+  const bool first = own.iOwnedBegin == 0, last = own.iOwnedEnd == m + 2;
+  const bool bottom = own.jOwnedBegin == 0, top = own.jOwnedEnd == m + 2;
+
+  if (first && bottom)
+    x[at(0, 0)] = .5 * (x[at(1, 0)] + x[at(0, 1)]);
+  if (first)
+    for (int64_t j = own.jBegin; j < own.jEnd; j++)
+      x[at(0, j)] = (b == Boundary::VERTICAL) ? -x[at(1, j)] : x[at(1, j)];
+  if (first && top)
+    x[at(0, m + 1)] = .5 * (x[at(1, m + 1)] + x[at(0, m)]);
+
+  for (int64_t i = own.iBegin; i < own.iEnd; i++) {
+    if (bottom)
+      x[at(i, 0)] = b == Boundary::HORIZONTAL ? -x[at(i, 1)] : x[at(i, 1)];
+    if (top)
+      x[at(i, m + 1)] =
+          b == Boundary::HORIZONTAL ? -x[at(i, m)] : x[at(i, m)];
+  }
+
+  if (last && bottom)
+    x[at(m + 1, 0)] = .5 * (x[at(m, 0)] + x[at(m + 1, 1)]);
+  if (last)
+    for (int64_t j = own.jBegin; j < own.jEnd; j++)
+      x[at(m + 1, j)] =
+          (b == Boundary::VERTICAL) ? -x[at(m, j)] : x[at(m, j)];
+  if (last && top)
+    x[at(m + 1, m + 1)] = .5 * (x[at(m, m + 1)] + x[at(m + 1, m)]);
+}
+
+// setColumnWalls of every column then setBoundaryRows, as the fused passes
+// do, the corners see the new walls
+void DistributedSolver::setWallsFused(const Boundary b, float *x) {
+  const int64_t m = n;
+  const bool first = own.iOwnedBegin == 0, last = own.iOwnedEnd == m + 2;
+  const bool bottom = own.jOwnedBegin == 0, top = own.jOwnedEnd == m + 2;
+
+  const float si = b == Boundary::VERTICAL ? -1 : 1;
+  for (int64_t j = own.jBegin; j < own.jEnd; j++) {
+    if (first)
+      x[at(0, j)] = si * x[at(1, j)];
+    if (last)
+      x[at(m + 1, j)] = si * x[at(m, j)];
+  }
+
+  const float sj = b == Boundary::HORIZONTAL ? -1 : 1;
+  for (int64_t i = own.iBegin; i < own.iEnd; i++) {
+    if (bottom)
+      x[at(i, 0)] = sj * x[at(i, 1)];
+    if (top)
+      x[at(i, m + 1)] = sj * x[at(i, m)];
+  }
+
+  if (first && bottom)
+    x[at(0, 0)] = .5 * (x[at(1, 0)] + x[at(0, 1)]);
+  if (first && top)
+    x[at(0, m + 1)] = .5 * (x[at(1, m + 1)] + x[at(0, m)]);
+  if (last && bottom)
+    x[at(m + 1, 0)] = .5 * (x[at(m, 0)] + x[at(m + 1, 1)]);
+  if (last && top)
+    x[at(m + 1, m + 1)] = .5 * (x[at(m, m + 1)] + x[at(m + 1, m)]);
+}
+
+// One red-black sweep of the tile. The halo of each colour is exchanged
+// while the cells one away from the tile edge, which never read it, are
+// relaxed; the rim follows once it arrived. Colours are global, cell (i, j)
+// has colour c when i + j + c is odd, as in the single process sweep.
+template <bool track>
+double DistributedSolver::sweep(float *x, const float *xPrev, const float a,
+                                const float c) {
+  double r2 = 0;
+  const auto relaxCell = [&](const int64_t i, const int64_t j) {
+    const float v = (xPrev[at(i, j)] +
+                     a * (x[at(i - 1, j)] + x[at(i + 1, j)] +
+                          x[at(i, j - 1)] + x[at(i, j + 1)])) /
+                    c;
+    if constexpr (track) {
+      const float r = c * (v - x[at(i, j)]);
+      r2 += r * r;
+    }
+    x[at(i, j)] = v;
+  };
+  const auto relaxRow = [&](const int64_t j, const int64_t begin,
+                            const int64_t end, const int64_t color) {
+    for (int64_t i = begin + ((begin + j + color + 1) & 1); i < end; i += 2)
+      relaxCell(i, j);
+  };
+
+  const int64_t i0 = own.iBegin, i1 = own.iEnd;
+  const int64_t j0 = own.jBegin, j1 = own.jEnd;
+  for (int64_t color = 0; color < 2; color++) {
+    postExchange(x, 0, 1, j0, j1);
+    postExchange(x, 1, 1, i0, i1);
+
+    for (int64_t j = j0 + 1; j < j1 - 1; j++)
+      relaxRow(j, i0 + 1, i1 - 1, color);
+
+    finishExchange(x, 0, 1, j0, j1);
+    finishExchange(x, 1, 1, i0, i1);
+
+    relaxRow(j0, i0, i1, color);
+    if (j1 - 1 > j0)
+      relaxRow(j1 - 1, i0, i1, color);
+    for (int64_t j = j0 + 1; j < j1 - 1; j++) {
+      relaxRow(j, i0, i0 + 1, color);
+      if (i1 - 1 > i0)
+        relaxRow(j, i1 - 1, i1, color);
+    }
+  }
+  return r2;
+}
+
+// linearSolve with red-black sweeps, the residual of a sweep is summed
+// across ranks
+SolveStats DistributedSolver::linearSolve(const Boundary b, float *x,
+                                          float *xPrev, const float a,
+                                          const float c) {
+  PROFILE_ZONE("linear_solve");
+  const bool converge = cfg.tolerance > 0;
+
+  double b2 = 0;
+  for (int64_t j = own.jBegin; j < own.jEnd; j++)
+    for (int64_t i = own.iBegin; i < own.iEnd; i++)
+      b2 += xPrev[at(i, j)] * xPrev[at(i, j)];
+  MPI_Allreduce(MPI_IN_PLACE, &b2, 1, MPI_DOUBLE, MPI_SUM, cart);
+  const double scale = b2 > 0 ? 1 / sqrt(b2) : 1;
+
+  SolveStats stats{0, NAN};
+  while (stats.iterations < cfg.maxIterations) {
+    const bool track =
+        converge || stats.iterations + 1 == cfg.maxIterations;
+    double r2 = track ? sweep<true>(x, xPrev, a, c)
+                      : sweep<false>(x, xPrev, a, c);
+    setWalls(b, x);
+    stats.iterations++;
+
+    if (track) {
+      MPI_Allreduce(MPI_IN_PLACE, &r2, 1, MPI_DOUBLE, MPI_SUM, cart);
+      stats.residual = sqrt(r2) * scale;
+      if (converge && stats.residual <= cfg.tolerance)
+        break;
+    }
+  }
+
+  return stats;
+}
+
+void DistributedSolver::inject(const span<const Splat> splats,
+                               const float dt) {
+  PROFILE_ZONE("inject");
+  float *vx = field(Field::VX);
+  float *vy = field(Field::VY);
+  float *d = field(Field::DENSITY);
+
+  for (const Splat &s : splats) {
+    const int64_t iBegin = max<int64_t>(ceil(s.x - s.radius), own.iBegin);
+    const int64_t iEnd = min<int64_t>(floor(s.x + s.radius) + 1, own.iEnd);
+    const int64_t jBegin = max<int64_t>(ceil(s.y - s.radius), own.jBegin);
+    const int64_t jEnd = min<int64_t>(floor(s.y + s.radius) + 1, own.jEnd);
+    for (int64_t j = jBegin; j < jEnd; j++)
+      for (int64_t i = iBegin; i < iEnd; i++) {
+        const float dx = i - s.x;
+        const float dy = j - s.y;
+        if (dx * dx + dy * dy > s.radius * s.radius)
+          continue;
+        vx[at(i, j)] += dt * s.fx;
+        vy[at(i, j)] += dt * s.fy;
+        d[at(i, j)] += dt * s.density;
+      }
+  }
+}
+
+void DistributedSolver::addSource(float *x, const float *s, const float dt) {
+  PROFILE_ZONE("add_source");
+  for (int64_t j = own.jOwnedBegin; j < own.jOwnedEnd; j++)
+    for (int64_t i = own.iOwnedBegin; i < own.iOwnedEnd; i++)
+      x[at(i, j)] += dt * s[at(i, j)];
+}
+
+void DistributedSolver::advect(const Boundary b, float *d, float *dPrev,
+                               const float *vx, const float *vy,
+                               const float dt) {
+  PROFILE_ZONE("advect");
+  const float dt0 = dt * n;
+
+  float speed = 0;
+  for (int64_t j = own.jBegin; j < own.jEnd; j++)
+    for (int64_t i = own.iBegin; i < own.iEnd; i++)
+      speed = max({speed, abs(vx[at(i, j)]), abs(vy[at(i, j)])});
+  MPI_Allreduce(MPI_IN_PLACE, &speed, 1, MPI_FLOAT, MPI_MAX, cart);
+
+  // The bilinear stencil reads one cell past the back traced point
+  const double reach = ceil(double(dt0) * speed) + 1;
+  const auto trace = [&](const auto &sample) {
+    for (int64_t j = own.jBegin; j < own.jEnd; j++)
+      for (int64_t i = own.iBegin; i < own.iEnd; i++) {
+        float x = i - dt0 * vx[at(i, j)];
+        float y = j - dt0 * vy[at(i, j)];
+
+        x = clamp(x, 0.5f, n + .5f);
+        y = clamp(y, 0.5f, n + .5f);
+
+        const uint32_t i0 = (uint32_t)x;
+        const uint32_t i1 = i0 + 1;
+        const uint32_t j0 = (uint32_t)y;
+        const uint32_t j1 = j0 + 1;
+
+        const float s1 = x - i0;
+        const float s0 = 1.f - s1;
+        const float t1 = y - j0;
+        const float t0 = 1.f - t1;
+
+        d[at(i, j)] = s0 * (t0 * sample(i0, j0) + t1 * sample(i0, j1)) +
+                      s1 * (t0 * sample(i1, j0) + t1 * sample(i1, j1));
+      }
+  };
+
+  if (reach <= haloWidth) {
+    exchangeHalo(dPrev, uint32_t(reach));
+    trace([&](const int64_t i, const int64_t j) { return dPrev[at(i, j)]; });
+  } else {
+    exchangeWindow(dPrev, uint32_t(min<double>(reach, n + 2)));
+    wides++;
+    const int64_t width = window.iEnd - window.iBegin;
+    trace([&](const int64_t i, const int64_t j) {
+      return windowCells[(i - window.iBegin) + width * (j - window.jBegin)];
+    });
+  }
+
+  setWalls(b, d);
+}
+
+SolveStats DistributedSolver::project(float *vx, float *vy) {
+  PROFILE_ZONE("project");
+  exchangeFaces(vx);
+  exchangeFaces(vy);
+  for (int64_t j = own.jBegin; j < own.jEnd; j++)
+    for (int64_t i = own.iBegin; i < own.iEnd; i++) {
+      divergence[at(i, j)] = -.5 *
+                             (vx[at(i + 1, j)] - vx[at(i - 1, j)] +
+                              vy[at(i, j + 1)] - vy[at(i, j - 1)]) /
+                             n;
+      pressure[at(i, j)] = 0;
+    }
+  setWallsFused(Boundary::NONE, divergence);
+  setWallsFused(Boundary::NONE, pressure);
+
+  const SolveStats stats =
+      linearSolve(Boundary::NONE, pressure, divergence, 1, 4);
+
+  exchangeFaces(pressure);
+  for (int64_t j = own.jBegin; j < own.jEnd; j++)
+    for (int64_t i = own.iBegin; i < own.iEnd; i++) {
+      vx[at(i, j)] -=
+          .5 * n * (pressure[at(i + 1, j)] - pressure[at(i - 1, j)]);
+      vy[at(i, j)] -=
+          .5 * n * (pressure[at(i, j + 1)] - pressure[at(i, j - 1)]);
+    }
+  setWalls(Boundary::VERTICAL, vx);
+  setWalls(Boundary::HORIZONTAL, vy);
+  return stats;
+}
+
+void DistributedSolver::velocityStep(const float visc, const float dt,
+                                     SolverStats &stats) {
+  PROFILE_ZONE("velocity_step");
+  if (cfg.sources) {
+    addSource(field(Field::VX), source(Field::VX), dt);
+    addSource(field(Field::VY), source(Field::VY), dt);
+  }
+
+  const float a = dt * visc * n * n;
+  swap(Field::VX);
+  stats.solve(Solve::VISCOSITY_X) =
+      linearSolve(Boundary::VERTICAL, field(Field::VX), source(Field::VX), a,
+                  1 + 4 * a);
+  swap(Field::VY);
+  stats.solve(Solve::VISCOSITY_Y) =
+      linearSolve(Boundary::HORIZONTAL, field(Field::VY), source(Field::VY),
+                  a, 1 + 4 * a);
+  stats.solve(Solve::PROJECT) = project(field(Field::VX), field(Field::VY));
+
+  swap(Field::VX);
+  swap(Field::VY);
+  advect(Boundary::VERTICAL, field(Field::VX), source(Field::VX),
+         source(Field::VX), source(Field::VY), dt);
+  advect(Boundary::HORIZONTAL, field(Field::VY), source(Field::VY),
+         source(Field::VX), source(Field::VY), dt);
+  stats.solve(Solve::REPROJECT) = project(field(Field::VX), field(Field::VY));
+}
+
+void DistributedSolver::densityStep(const float diff, const float dt,
+                                    SolverStats &stats) {
+  PROFILE_ZONE("density_step");
+  if (cfg.sources)
+    addSource(field(Field::DENSITY), source(Field::DENSITY), dt);
+
+  const float a = dt * diff * n * n;
+  swap(Field::DENSITY);
+  stats.solve(Solve::DENSITY) =
+      linearSolve(Boundary::NONE, field(Field::DENSITY),
+                  source(Field::DENSITY), a, 1 + 4 * a);
+
+  swap(Field::DENSITY);
+  advect(Boundary::NONE, field(Field::DENSITY), source(Field::DENSITY),
+         field(Field::VX), field(Field::VY), dt);
+}
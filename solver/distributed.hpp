@@ -0,0 +1,153 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include <cstdint>
+#include <mpi.h>
+#include <span>
+#include <vector>
+
+#include "kernels.hpp"
+#include "solver.hpp"
+
+// Block of the global (n + 2) * (n + 2) grid a rank owns, in global cell
+// coordinates. The interior cells 1 to n are split evenly along both axes,
+// tiles on the edge of the grid also own the ghost cells next to them.
+struct Tile {
+  int64_t iBegin, iEnd;
+  int64_t jBegin, jEnd;
+  // The interior range widened to the ghost ring on the grid edges
+  int64_t iOwnedBegin, iOwnedEnd;
+  int64_t jOwnedBegin, jOwnedEnd;
+};
+
+// FluidSolver split across the ranks of an MPI communicator in 2D tiles.
+// Every rank keeps its tile plus a halo of cells owned by its neighbours,
+// refreshed by halo exchanges, so a step only ever moves tile edges.
+//
+// The linear solves always run red-black sweeps: each half sweep only reads
+// the other colour, so exchanging the halo between them gives exactly the
+// single process red-black result while the exchange overlaps the sweep of
+// the cells that don't touch the halo. Advection back traces up to
+// dt * n * max |v| cells. When that fits in the halo the exchange is widened
+// to it, otherwise every rank fetches the cells within that reach of its
+// tile from whichever ranks own them into a window of its own, so memory
+// grows with the reach rather than the grid. Results are bit identical to
+// FluidSolver with the generic backend and LinearSolver::RED_BLACK;
+// residuals are summed in a different order, so with a tolerance a solve
+// may stop one sweep apart.
+class DistributedSolver {
+public:
+  // Collective over comm. halo is the widest exchange, at least 1 and at
+  // most the narrowest tile.
+  DistributedSolver(MPI_Comm comm, const uint64_t n, const SolverConfig &cfg,
+                    const uint32_t halo);
+  ~DistributedSolver();
+
+  DistributedSolver(const DistributedSolver &) = delete;
+  DistributedSolver &operator=(const DistributedSolver &) = delete;
+
+  uint64_t resolution() const { return n; }
+  const Tile &tile() const { return own; }
+  int rank() const { return cartRank; }
+  // Grid of ranks, along j and i
+  const int *dims() const { return rankDims; }
+  uint32_t halo() const { return haloWidth; }
+  // Advections that reached past the halo and fetched a wider window
+  uint64_t wideAdvections() const { return wides; }
+
+  // Local buffers of the current and previous values, index them with at()
+  float *field(const Field f) { return buffers[index(f)][current[index(f)]]; }
+  const float *field(const Field f) const {
+    return buffers[index(f)][current[index(f)]];
+  }
+  float *source(const Field f) {
+    return buffers[index(f)][1 - current[index(f)]];
+  }
+  void swap(const Field f) { current[index(f)] ^= 1; }
+
+  // Local offset of global cell (i, j), valid within the tile and its halo
+  uint64_t at(const int64_t i, const int64_t j) const {
+    return (i - own.iBegin + haloWidth) + stride * (j - own.jBegin + haloWidth);
+  }
+  bool owns(const int64_t i, const int64_t j) const {
+    return i >= own.iOwnedBegin && i < own.iOwnedEnd && j >= own.jOwnedBegin &&
+           j < own.jOwnedEnd;
+  }
+
+  // Same contract as FluidSolver, over the interior cells this rank owns
+  void inject(std::span<const Splat> splats, const float dt);
+
+  // Collective, same contract as FluidSolver
+  void velocityStep(const float visc, const float dt, SolverStats &stats);
+  void densityStep(const float diff, const float dt, SolverStats &stats);
+
+  // Collective, assembles field f as a (n + 2) * (n + 2) grid in out on root
+  void gather(const Field f, float *out, const int root);
+
+private:
+  static constexpr size_t FIELDS = static_cast<size_t>(Field::COUNT);
+
+  static size_t index(const Field f) { return static_cast<size_t>(f); }
+
+  Tile tileAt(const int ci, const int cj) const;
+
+  void postExchange(float *x, const uint32_t axis, const uint32_t width,
+                    const int64_t begin, const int64_t end);
+  void finishExchange(float *x, const uint32_t axis, const uint32_t width,
+                      const int64_t begin, const int64_t end);
+  void exchangeFaces(float *x);
+  void exchangeHalo(float *x, const uint32_t width);
+  void exchangeWindow(const float *x, const uint32_t reach);
+  void gatherAll(const float *x, std::vector<float> &full);
+
+  void setWalls(const Boundary b, float *x);
+  void setWallsFused(const Boundary b, float *x);
+
+  template <bool track>
+  double sweep(float *x, const float *xPrev, const float a, const float c);
+  SolveStats linearSolve(const Boundary b, float *x, float *xPrev,
+                         const float a, const float c);
+  void addSource(float *x, const float *s, const float dt);
+  void advect(const Boundary b, float *d, float *dPrev, const float *vx,
+              const float *vy, const float dt);
+  SolveStats project(float *vx, float *vy);
+
+  MPI_Comm cart;
+  int cartRank;
+  int rankDims[2];
+  // Neighbour ranks, MPI_PROC_NULL past the grid edges
+  int left, right, down, up;
+
+  uint64_t n;
+  SolverConfig cfg;
+  Tile own;
+  // Tile of every rank of cart
+  std::vector<Tile> tiles;
+  uint32_t haloWidth;
+  uint64_t stride;
+  uint64_t wides = 0;
+
+  std::vector<float> storage;
+  float *buffers[FIELDS][2];
+  uint8_t current[FIELDS]{};
+  float *pressure;
+  float *divergence;
+
+  // Packed edges per direction: left, right, down, up
+  std::vector<float> sendBuffers[4];
+  std::vector<float> recvBuffers[4];
+  std::vector<MPI_Request> requests;
+
+  // Cells [iBegin, iEnd) x [jBegin, jEnd) of the last exchangeWindow, i
+  // fastest
+  struct Window {
+    int64_t iBegin, iEnd;
+    int64_t jBegin, jEnd;
+  };
+  Window window;
+  std::vector<float> windowCells;
+  std::vector<float> windowSend;
+  std::vector<float> windowRecv;
+};
+
+#endif
@@ -0,0 +1,795 @@
+#include "backend.hpp"
+#include "kernels.hpp"
+#include "obstacles.hpp"
+#include "parallel.hpp"
+#include "precision.hpp"
+#include "profile.hpp"
+#include "solver.hpp"
+#include "sparse.hpp"
+#include "spectral.hpp"
+#include "tasks.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <sys/mman.h>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+// Buffers start on cache line boundaries, also the widest vector load
+static constexpr size_t ALIGNMENT = 64;
+static constexpr size_t HUGE_PAGE = 2 << 20;
+
+// Current and previous buffer per field plus pressure and divergence
+static constexpr size_t BUFFERS = 2 * static_cast<size_t>(Field::COUNT) + 2;
+
+static size_t roundUp(const size_t x, const size_t to) {
+  return (x + to - 1) / to * to;
+}
+
+// Bytes of a cell stored as s
+static size_t elementSize(const Storage s) {
+  return s == Storage::FP32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+// Calls fn with the std::type_identity of the element type of s
+template <typename Fn>
+static inline decltype(auto) withStorage(const Storage s, Fn &&fn) {
+  switch (s) {
+  case Storage::FP16:
+    return fn(type_identity<Half>{});
+  case Storage::BF16:
+    return fn(type_identity<BFloat16>{});
+  default:
+    return fn(type_identity<float>{});
+  }
+}
+
+// cells of buffer b stored as s to and from floats
+static void widen(const Storage s, const float *b, float *__restrict out,
+                  const size_t cells) {
+  withStorage(s, [&](auto type) {
+    using T = typename decltype(type)::type;
+    const T *x = reinterpret_cast<const T *>(b);
+    for (size_t k = 0; k < cells; k++)
+      out[k] = x[k];
+  });
+}
+
+static void narrow(const Storage s, const float *__restrict in, float *b,
+                   const size_t cells) {
+  withStorage(s, [&](auto type) {
+    using T = typename decltype(type)::type;
+    T *x = reinterpret_cast<T *>(b);
+    for (size_t k = 0; k < cells; k++)
+      x[k] = T(in[k]);
+  });
+}
+
+// Explicit huge pages need a reserved pool (vm.nr_hugepages), without one the
+// mapping falls back to regular pages aligned so transparent huge pages can
+// back it
+static void *mapArena(size_t &bytes, const bool hugePages, bool &huge) {
+  huge = false;
+  if (!hugePages) {
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  bytes = roundUp(bytes, HUGE_PAGE);
+  void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    huge = true;
+    return p;
+  }
+
+  // Over map by a huge page and trim both ends to get an aligned range
+  const size_t padded = bytes + HUGE_PAGE;
+  p = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+  const uintptr_t aligned = roundUp(begin, HUGE_PAGE);
+  if (aligned != begin)
+    munmap(p, aligned - begin);
+  if (aligned + bytes != begin + padded)
+    munmap(reinterpret_cast<void *>(aligned + bytes),
+           begin + padded - aligned - bytes);
+
+  p = reinterpret_cast<void *>(aligned);
+  huge = madvise(p, bytes, MADV_HUGEPAGE) == 0;
+  return p;
+}
+
+FluidSolver::FluidSolver(const uint64_t n, const SolverConfig &cfg,
+                         const bool hugePages)
+    : n(n), cfg(cfg), format(cfg.storage),
+      compactPressure(cfg.storage != Storage::FP32 && cfg.compactPressure) {
+  const size_t element = elementSize(format);
+  const size_t pressureElement = compactPressure ? element : sizeof(float);
+  const size_t slab = roundUp(cells() * element, ALIGNMENT);
+  const size_t pressureSlab = roundUp(cells() * pressureElement, ALIGNMENT);
+  arenaBytes = 2 * FIELDS * slab + 2 * pressureSlab;
+  arena = mapArena(arenaBytes, hugePages, huge);
+  if (!arena)
+    throw bad_alloc();
+
+  char *next = static_cast<char *>(arena);
+  const auto carve = [&](const size_t bytes) {
+    float *b = reinterpret_cast<float *>(next);
+    next += bytes;
+    return b;
+  };
+  for (size_t f = 0; f < FIELDS; f++) {
+    buffers[f][0] = carve(slab);
+    buffers[f][1] = carve(slab);
+  }
+  pressure = carve(pressureSlab);
+  divergence = carve(pressureSlab);
+
+  // Fresh anonymous pages are only placed when first written. Zeroing splits
+  // the columns the same way the parallel sweeps do, so every thread touches
+  // the part of each buffer it will later work on. Task steps hand bands to
+  // whichever worker is idle, so they have no split to match.
+  ThreadPool &pool = threadPool(cfg.tasks ? 1 : cfg.threads);
+  const pair<float *, size_t> all[] = {
+      {buffers[0][0], element}, {buffers[0][1], element},
+      {buffers[1][0], element}, {buffers[1][1], element},
+      {buffers[2][0], element}, {buffers[2][1], element},
+      {pressure, pressureElement}, {divergence, pressureElement}};
+  static_assert(size(all) == BUFFERS);
+  pool.parallelFor(0, n + 2, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (const auto &[b, cellBytes] : all)
+      memset(reinterpret_cast<char *>(b) + idx(0, jBegin, n) * cellBytes, 0,
+             (jEnd - jBegin) * (n + 2) * cellBytes);
+  });
+}
+
+FluidSolver::~FluidSolver() { munmap(arena, arenaBytes); }
+
+static void addSource(const SolverBackend &k, const uint64_t n,
+                      float *__restrict x, float *__restrict s,
+                      const float dt) {
+  PROFILE_ZONE("add_source");
+  k.addSource(n, x, s, dt);
+}
+
+// Obstacle cells after a kernel that wrote the whole grid, and the walls
+// again since they may copy from them. Without solid cells that would only
+// move the corners.
+static void obstacleBoundary(const uint64_t n, const Boundary b,
+                             float *__restrict x, const Obstacles *solids) {
+  if (!solids || solids->fraction() == 1)
+    return;
+  solids->apply(b, x);
+  setBoundary(n, b, x);
+}
+
+// Velocity advections pass the previous field of the component they advect
+// as dPrev and as vx or vy, the backend only reads both
+static float advect(const SolverBackend &k, const uint64_t n, const Boundary b,
+                    float *__restrict d, float *dPrev, float *vx, float *vy,
+                    const float dt, const Obstacles *solids) {
+  PROFILE_ZONE("advect");
+  const float peak = k.advect(n, b, d, dPrev, vx, vy, dt);
+  obstacleBoundary(n, b, d, solids);
+  return peak;
+}
+
+static SolveStats diffuse(const uint64_t n, const Boundary b,
+                          float *__restrict x, float *__restrict xPrev,
+                          const float diff, const float dt,
+                          const SolverConfig &cfg, const SourceFold fold,
+                          const Obstacles *solids) {
+  // Steps never fold the sources with obstacles
+  if (solids)
+    return diffuseActive(n, b, x, xPrev, diff, dt, cfg, *solids);
+  return diffuse(n, b, x, xPrev, diff, dt, cfg, fold);
+}
+
+// The rest of project once divergence holds the right hand side, speed2 is
+// the largest vx^2 + vy^2 of the result
+static SolveStats solvePressure(const SolverBackend &k, const uint64_t n,
+                                float *__restrict vx, float *__restrict vy,
+                                float *__restrict pressure,
+                                float *__restrict divergence,
+                                const SolverConfig &cfg, float &speed2,
+                                const Obstacles *solids) {
+  SolveStats stats;
+  if (solids) {
+    PROFILE_ZONE("pressure_solve");
+    stats = linearSolveActive(n, Boundary::NONE, pressure, divergence, 1, 4,
+                              cfg, *solids);
+  } else
+    stats = pressureSolve(n, pressure, divergence, cfg);
+  {
+    PROFILE_ZONE("subtract_gradient");
+    speed2 = k.subtractGradient(n, vx, vy, pressure);
+  }
+  obstacleBoundary(n, Boundary::VERTICAL, vx, solids);
+  obstacleBoundary(n, Boundary::HORIZONTAL, vy, solids);
+  return stats;
+}
+
+static SolveStats project(const SolverBackend &k, const uint64_t n,
+                          float *__restrict vx, float *__restrict vy,
+                          float *__restrict pressure,
+                          float *__restrict divergence,
+                          const SolverConfig &cfg, float &speed2,
+                          const Obstacles *solids) {
+  PROFILE_ZONE("project");
+  {
+    PROFILE_ZONE("divergence");
+    k.divergence(n, vx, vy, pressure, divergence);
+  }
+  return solvePressure(k, n, vx, vy, pressure, divergence, cfg, speed2,
+                       solids);
+}
+
+SolveStats project(const SolverBackend &k, const uint64_t n,
+                   float *__restrict vx, float *__restrict vy,
+                   float *__restrict pressure, float *__restrict divergence,
+                   const SolverConfig &cfg) {
+  float speed2;
+  return project(k, n, vx, vy, pressure, divergence, cfg, speed2, nullptr);
+}
+
+template <typename T>
+static void injectSplats(const uint64_t n, const span<const Splat> splats,
+                         const float dt, T *__restrict vx, T *__restrict vy,
+                         T *__restrict d) {
+  const int64_t last = n;
+  for (const Splat &s : splats) {
+    const int64_t iBegin = max<int64_t>(ceil(s.x - s.radius), 1);
+    const int64_t iEnd = min<int64_t>(floor(s.x + s.radius), last);
+    const int64_t jBegin = max<int64_t>(ceil(s.y - s.radius), 1);
+    const int64_t jEnd = min<int64_t>(floor(s.y + s.radius), last);
+    for (int64_t j = jBegin; j <= jEnd; j++)
+      for (int64_t i = iBegin; i <= iEnd; i++) {
+        const float dx = i - s.x;
+        const float dy = j - s.y;
+        if (dx * dx + dy * dy > s.radius * s.radius)
+          continue;
+        vx[idx(i, j, n)] = T(vx[idx(i, j, n)] + dt * s.fx);
+        vy[idx(i, j, n)] = T(vy[idx(i, j, n)] + dt * s.fy);
+        d[idx(i, j, n)] = T(d[idx(i, j, n)] + dt * s.density);
+      }
+  }
+}
+
+// Steps on fields stored as T, see SolverConfig::storage. With
+// compactPressure pressure and divergence hold T as well.
+template <typename T>
+static const CompactKernels<T> &compactKernels(const SolverBackend &k) {
+  if constexpr (is_same_v<T, Half>)
+    return k.half;
+  else
+    return k.bfloat16;
+}
+
+template <typename T>
+static SolveStats compactDiffuse(const uint64_t n, const Boundary b,
+                                 T *__restrict x, T *__restrict xPrev,
+                                 const float diff, const float dt,
+                                 const SolverConfig &cfg) {
+  PROFILE_ZONE("diffuse");
+  const float a = dt * diff * n * n;
+  return linearSolve(n, b, x, xPrev, a, 1 + 4 * a, cfg);
+}
+
+template <typename T>
+static SolveStats compactProject(const CompactKernels<T> &k, const uint64_t n,
+                                 T *__restrict vx, T *__restrict vy,
+                                 float *__restrict pressure,
+                                 float *__restrict divergence,
+                                 const bool compactPressure,
+                                 const SolverConfig &cfg, float &speed2) {
+  PROFILE_ZONE("project");
+  if (compactPressure) {
+    T *p = reinterpret_cast<T *>(pressure);
+    T *d = reinterpret_cast<T *>(divergence);
+    {
+      PROFILE_ZONE("divergence");
+      k.divergenceCompact(n, vx, vy, p, d);
+    }
+    SolveStats stats;
+    {
+      PROFILE_ZONE("pressure_solve");
+      stats = linearSolve(n, Boundary::NONE, p, d, 1, 4, cfg);
+    }
+    PROFILE_ZONE("subtract_gradient");
+    speed2 = k.subtractGradientCompact(n, vx, vy, p);
+    return stats;
+  }
+
+  {
+    PROFILE_ZONE("divergence");
+    k.divergence(n, vx, vy, pressure, divergence);
+  }
+  const SolveStats stats = pressureSolve(n, pressure, divergence, cfg);
+  PROFILE_ZONE("subtract_gradient");
+  speed2 = k.subtractGradient(n, vx, vy, pressure);
+  return stats;
+}
+
+template <typename T>
+void FluidSolver::compactVelocityStep(const float visc, const float dt,
+                                      SolverStats &stats) {
+  const CompactKernels<T> &k = compactKernels<T>(solverBackend());
+  float speed2;
+
+  if (cfg.sources) {
+    PROFILE_ZONE("add_source");
+    k.addSource(n, stored<T>(Field::VX), storedSource<T>(Field::VX), dt);
+    k.addSource(n, stored<T>(Field::VY), storedSource<T>(Field::VY), dt);
+  }
+
+  swap(Field::VX);
+  stats.solve(Solve::VISCOSITY_X) =
+      compactDiffuse(n, Boundary::VERTICAL, stored<T>(Field::VX),
+                     storedSource<T>(Field::VX), visc, dt, cfg);
+  swap(Field::VY);
+  stats.solve(Solve::VISCOSITY_Y) =
+      compactDiffuse(n, Boundary::HORIZONTAL, stored<T>(Field::VY),
+                     storedSource<T>(Field::VY), visc, dt, cfg);
+  stats.solve(Solve::PROJECT) =
+      compactProject(k, n, stored<T>(Field::VX), stored<T>(Field::VY),
+                     pressure, divergence, compactPressure, cfg, speed2);
+
+  swap(Field::VX);
+  swap(Field::VY);
+  {
+    PROFILE_ZONE("advect");
+    k.advect(n, Boundary::VERTICAL, stored<T>(Field::VX),
+             storedSource<T>(Field::VX), storedSource<T>(Field::VX),
+             storedSource<T>(Field::VY), dt);
+    k.advect(n, Boundary::HORIZONTAL, stored<T>(Field::VY),
+             storedSource<T>(Field::VY), storedSource<T>(Field::VX),
+             storedSource<T>(Field::VY), dt);
+  }
+  stats.solve(Solve::REPROJECT) =
+      compactProject(k, n, stored<T>(Field::VX), stored<T>(Field::VY),
+                     pressure, divergence, compactPressure, cfg, speed2);
+  maxSpeed = sqrt(speed2);
+  stats.maxSpeed = maxSpeed;
+}
+
+template <typename T>
+void FluidSolver::compactDensityStep(const float diff, const float dt,
+                                     SolverStats &stats) {
+  const CompactKernels<T> &k = compactKernels<T>(solverBackend());
+  stats.activeFraction = 1;
+
+  if (cfg.sources) {
+    PROFILE_ZONE("add_source");
+    k.addSource(n, stored<T>(Field::DENSITY), storedSource<T>(Field::DENSITY),
+                dt);
+  }
+
+  swap(Field::DENSITY);
+  stats.solve(Solve::DENSITY) =
+      compactDiffuse(n, Boundary::NONE, stored<T>(Field::DENSITY),
+                     storedSource<T>(Field::DENSITY), diff, dt, cfg);
+
+  swap(Field::DENSITY);
+  PROFILE_ZONE("advect");
+  maxDensity = k.advect(n, Boundary::NONE, stored<T>(Field::DENSITY),
+                        storedSource<T>(Field::DENSITY), stored<T>(Field::VX),
+                        stored<T>(Field::VY), dt);
+  stats.maxDensity = maxDensity;
+}
+
+const float *FluidSolver::values(const Field f, vector<float> &scratch) const {
+  if (!compact())
+    return field(f);
+  scratch.resize(cells());
+  widen(format, buffers[index(f)][current[index(f)]], scratch.data(),
+        cells());
+  return scratch.data();
+}
+
+const float *FluidSolver::sourceValues(const Field f,
+                                       vector<float> &scratch) const {
+  if (!compact())
+    return source(f);
+  scratch.resize(cells());
+  widen(format, buffers[index(f)][1 - current[index(f)]], scratch.data(),
+        cells());
+  return scratch.data();
+}
+
+void FluidSolver::setValues(const Field f, const float *values) {
+  narrow(format, values, buffers[index(f)][current[index(f)]], cells());
+}
+
+void FluidSolver::setSourceValues(const Field f, const float *values) {
+  narrow(format, values, buffers[index(f)][1 - current[index(f)]], cells());
+}
+
+void FluidSolver::clearSource(const Field f) {
+  // Zero bits are zero in every format
+  memset(buffers[index(f)][1 - current[index(f)]], 0,
+         cells() * elementSize(format));
+}
+
+void FluidSolver::inject(const span<const Splat> splats, const float dt) {
+  PROFILE_ZONE("inject");
+  withStorage(format, [&](auto type) {
+    using T = typename decltype(type)::type;
+    injectSplats(n, splats, dt, stored<T>(Field::VX), stored<T>(Field::VY),
+                 stored<T>(Field::DENSITY));
+  });
+}
+
+void FluidSolver::setObstacles(unique_ptr<Obstacles> obstacles) {
+  // 16 bit steps have no obstacle path
+  if (compact())
+    return;
+  solids = std::move(obstacles);
+  if (!solids)
+    return;
+  obstacleBoundary(n, Boundary::VERTICAL, field(Field::VX), solids.get());
+  obstacleBoundary(n, Boundary::HORIZONTAL, field(Field::VY), solids.get());
+  obstacleBoundary(n, Boundary::NONE, field(Field::DENSITY), solids.get());
+}
+
+void FluidSolver::measure() {
+  float speed2 = 0;
+  maxDensity = 0;
+  withStorage(format, [&](auto type) {
+    using T = typename decltype(type)::type;
+    const T *vx = stored<T>(Field::VX);
+    const T *vy = stored<T>(Field::VY);
+    const T *d = stored<T>(Field::DENSITY);
+    for (uint64_t j = 1; j <= n; j++)
+      for (uint64_t i = 1; i <= n; i++) {
+        const uint64_t k = idx(i, j, n);
+        const float x = vx[k];
+        const float y = vy[k];
+        speed2 = max(speed2, x * x + y * y);
+        maxDensity = max(maxDensity, float(d[k]));
+      }
+  });
+  maxSpeed = sqrt(speed2);
+}
+
+void FluidSolver::velocityStep(const float visc, const float dt,
+                               SolverStats &stats) {
+  PROFILE_ZONE("velocity_step");
+  if (compact()) {
+    if (format == Storage::FP16)
+      compactVelocityStep<Half>(visc, dt, stats);
+    else
+      compactVelocityStep<BFloat16>(visc, dt, stats);
+    return;
+  }
+  const SolverBackend &k = solverBackend();
+  if (periodic()) {
+    periodicVelocityStep(k, visc, dt, stats);
+    return;
+  }
+  const Obstacles *o = solids.get();
+  float speed2;
+
+  // Fused, diffuse adds the sources on its first sweep
+  const bool fused = cfg.fused && !o;
+  const SourceFold fold{fused && cfg.sources, dt};
+  if (!fused && cfg.sources) {
+    addSource(k, n, field(Field::VX), source(Field::VX), dt);
+    addSource(k, n, field(Field::VY), source(Field::VY), dt);
+  }
+
+  swap(Field::VX);
+  stats.solve(Solve::VISCOSITY_X) =
+      diffuse(n, Boundary::VERTICAL, field(Field::VX), source(Field::VX),
+              visc, dt, cfg, fold, o);
+  swap(Field::VY);
+  stats.solve(Solve::VISCOSITY_Y) =
+      diffuse(n, Boundary::HORIZONTAL, field(Field::VY), source(Field::VY),
+              visc, dt, cfg, fold, o);
+  stats.solve(Solve::PROJECT) =
+      project(k, n, field(Field::VX), field(Field::VY), pressure, divergence,
+              cfg, speed2, o);
+
+  swap(Field::VX);
+  swap(Field::VY);
+  if (fused) {
+    PROFILE_ZONE("project");
+    {
+      PROFILE_ZONE("advect_velocity");
+      k.advectVelocity(n, field(Field::VX), field(Field::VY),
+                       source(Field::VX), source(Field::VY), pressure,
+                       divergence, dt);
+    }
+    stats.solve(Solve::REPROJECT) =
+        solvePressure(k, n, field(Field::VX), field(Field::VY), pressure,
+                      divergence, cfg, speed2, o);
+  } else {
+    advect(k, n, Boundary::VERTICAL, field(Field::VX), source(Field::VX),
+           source(Field::VX), source(Field::VY), dt, o);
+    advect(k, n, Boundary::HORIZONTAL, field(Field::VY), source(Field::VY),
+           source(Field::VX), source(Field::VY), dt, o);
+    stats.solve(Solve::REPROJECT) =
+        project(k, n, field(Field::VX), field(Field::VY), pressure,
+                divergence, cfg, speed2, o);
+  }
+  maxSpeed = sqrt(speed2);
+  stats.maxSpeed = maxSpeed;
+}
+
+void FluidSolver::densityStep(const float diff, const float dt,
+                              SolverStats &stats) {
+  PROFILE_ZONE("density_step");
+  if (compact()) {
+    if (format == Storage::FP16)
+      compactDensityStep<Half>(diff, dt, stats);
+    else
+      compactDensityStep<BFloat16>(diff, dt, stats);
+    return;
+  }
+  const SolverBackend &k = solverBackend();
+  const Obstacles *o = solids.get();
+
+  if (periodic()) {
+    periodicDensityStep(k, diff, dt, stats);
+    return;
+  }
+  if (cfg.sparse && !o) {
+    sparseDensityStep(k, diff, dt, stats);
+    return;
+  }
+  stats.activeFraction = 1;
+
+  const bool fused = cfg.fused && !o;
+  if (!fused && cfg.sources)
+    addSource(k, n, field(Field::DENSITY), source(Field::DENSITY), dt);
+
+  swap(Field::DENSITY);
+  stats.solve(Solve::DENSITY) = diffuse(
+      n, Boundary::NONE, field(Field::DENSITY), source(Field::DENSITY), diff,
+      dt, cfg, {fused && cfg.sources, dt}, o);
+
+  swap(Field::DENSITY);
+  maxDensity = advect(k, n, Boundary::NONE, field(Field::DENSITY),
+                      source(Field::DENSITY), field(Field::VX),
+                      field(Field::VY), dt, o);
+  stats.maxDensity = maxDensity;
+}
+
+void FluidSolver::sparseDensityStep(const SolverBackend &k, const float diff,
+                                    const float dt, SolverStats &stats) {
+  if (!bricks)
+    bricks = make_unique<ActiveBricks>(n, cfg.sparseBrick);
+
+  // Advection carries density up to dt * n * max |v| cells plus one for the
+  // interpolation, the implicit diffusion spreads it over a few sqrt(a)
+  const float a = dt * diff * n * n;
+  const float reach = ceil(dt * n * maxSpeed) + ceil(3 * sqrt(a)) + 2;
+  bricks->update(field(Field::DENSITY),
+                 cfg.sources ? source(Field::DENSITY) : nullptr,
+                 cfg.sparseThreshold, uint32_t(min<float>(reach, n)));
+  stats.activeFraction = bricks->fraction();
+
+  if (cfg.sources) {
+    PROFILE_ZONE("add_source");
+    addSourceActive(n, field(Field::DENSITY), source(Field::DENSITY), dt,
+                    *bricks);
+  }
+
+  swap(Field::DENSITY);
+  stats.solve(Solve::DENSITY) =
+      diffuseActive(n, Boundary::NONE, field(Field::DENSITY),
+                    source(Field::DENSITY), diff, dt, cfg, *bricks);
+
+  swap(Field::DENSITY);
+  PROFILE_ZONE("advect");
+  maxDensity = k.advectActive(n, Boundary::NONE, field(Field::DENSITY),
+                              source(Field::DENSITY), field(Field::VX),
+                              field(Field::VY), dt, *bricks);
+  stats.maxDensity = maxDensity;
+}
+
+bool FluidSolver::periodic() const {
+  return cfg.periodic && SpectralSolver::supports(n);
+}
+
+// Diffusion and projection of the velocity in one transform pair per
+// component, the second projection on its own after advecting
+void FluidSolver::periodicVelocityStep(const SolverBackend &k,
+                                       const float visc, const float dt,
+                                       SolverStats &stats) {
+  if (!spectral)
+    spectral = make_unique<SpectralSolver>(n);
+  if (cfg.sources) {
+    addSource(k, n, field(Field::VX), source(Field::VX), dt);
+    addSource(k, n, field(Field::VY), source(Field::VY), dt);
+  }
+
+  float speed2;
+  swap(Field::VX);
+  swap(Field::VY);
+  const SolveStats diffused = spectral->project(
+      source(Field::VX), source(Field::VY), field(Field::VX),
+      field(Field::VY), dt * visc * n * n, cfg, speed2);
+  stats.solve(Solve::VISCOSITY_X) = diffused;
+  stats.solve(Solve::VISCOSITY_Y) = diffused;
+  stats.solve(Solve::PROJECT) = diffused;
+
+  swap(Field::VX);
+  swap(Field::VY);
+  advect(k, n, Boundary::PERIODIC, field(Field::VX), source(Field::VX),
+         source(Field::VX), source(Field::VY), dt, nullptr);
+  advect(k, n, Boundary::PERIODIC, field(Field::VY), source(Field::VY),
+         source(Field::VX), source(Field::VY), dt, nullptr);
+  stats.solve(Solve::REPROJECT) =
+      spectral->project(field(Field::VX), field(Field::VY), field(Field::VX),
+                        field(Field::VY), 0, cfg, speed2);
+  maxSpeed = sqrt(speed2);
+  stats.maxSpeed = maxSpeed;
+}
+
+void FluidSolver::periodicDensityStep(const SolverBackend &k,
+                                      const float diff, const float dt,
+                                      SolverStats &stats) {
+  if (!spectral)
+    spectral = make_unique<SpectralSolver>(n);
+  stats.activeFraction = 1;
+  if (cfg.sources)
+    addSource(k, n, field(Field::DENSITY), source(Field::DENSITY), dt);
+
+  const float a = dt * diff * n * n;
+  swap(Field::DENSITY);
+  stats.solve(Solve::DENSITY) = spectral->solve(
+      source(Field::DENSITY), field(Field::DENSITY), a, 1 + 4 * a, cfg);
+
+  swap(Field::DENSITY);
+  maxDensity = advect(k, n, Boundary::PERIODIC, field(Field::DENSITY),
+                      source(Field::DENSITY), field(Field::VX),
+                      field(Field::VY), dt, nullptr);
+  stats.maxDensity = maxDensity;
+}
+
+void FluidSolver::step(const float visc, const float diff, const float dt,
+                       SolverStats &stats) {
+  if (cfg.tasks && !periodic() && !compact()) {
+    taskStep(visc, diff, dt, stats);
+    return;
+  }
+  velocityStep(visc, dt, stats);
+  densityStep(diff, dt, stats);
+}
+
+// The same kernels on the same buffers as the two steps. Every field is
+// swapped twice, so instead of swapping the tasks name the buffers each
+// kernel would see after the swaps before it.
+void FluidSolver::taskStep(const float visc, const float diff, const float dt,
+                           SolverStats &stats) {
+  if (!scheduler || scheduler->size() != max(cfg.threads, 1u))
+    scheduler = make_unique<TaskScheduler>(cfg.threads);
+  const SolverBackend &k = solverBackend();
+
+  float *vx = field(Field::VX);
+  float *vy = field(Field::VY);
+  float *d = field(Field::DENSITY);
+  float *vx0 = source(Field::VX);
+  float *vy0 = source(Field::VY);
+  float *d0 = source(Field::DENSITY);
+  const Obstacles *o = solids.get();
+  const bool fused = cfg.fused && !o;
+  const SourceFold fold{fused && cfg.sources, dt};
+  const bool add = !fused && cfg.sources;
+
+  // The source tasks are left empty when there is nothing to add, so the
+  // graph keeps its shape
+  TaskGraph g;
+  const uint32_t addVx = g.add("add_source_vx", [&] {
+    if (add)
+      addSource(k, n, vx, vx0, dt);
+  });
+  const uint32_t addVy = g.add("add_source_vy", [&] {
+    if (add)
+      addSource(k, n, vy, vy0, dt);
+  });
+
+  const uint32_t diffuseVx = g.add(
+      "diffuse_vx",
+      [&] {
+        stats.solve(Solve::VISCOSITY_X) = diffuse(
+            n, Boundary::VERTICAL, vx0, vx, visc, dt, cfg, fold, o);
+      },
+      {addVx});
+  const uint32_t diffuseVy = g.add(
+      "diffuse_vy",
+      [&] {
+        stats.solve(Solve::VISCOSITY_Y) = diffuse(
+            n, Boundary::HORIZONTAL, vy0, vy, visc, dt, cfg, fold, o);
+      },
+      {addVy});
+  float speed2;
+  const uint32_t projectV = g.add(
+      "project",
+      [&] {
+        stats.solve(Solve::PROJECT) =
+            project(k, n, vx0, vy0, pressure, divergence, cfg, speed2, o);
+      },
+      {diffuseVx, diffuseVy});
+
+  uint32_t velocity;
+  if (fused) {
+    const uint32_t advectV = g.add(
+        "advect_velocity",
+        [&] {
+          PROFILE_ZONE("advect_velocity");
+          k.advectVelocity(n, vx, vy, vx0, vy0, pressure, divergence, dt);
+        },
+        {projectV});
+    velocity = g.add(
+        "reproject",
+        [&] {
+          stats.solve(Solve::REPROJECT) = solvePressure(
+              k, n, vx, vy, pressure, divergence, cfg, speed2, o);
+        },
+        {advectV});
+  } else {
+    const uint32_t advectVx = g.add(
+        "advect_vx",
+        [&] { advect(k, n, Boundary::VERTICAL, vx, vx0, vx0, vy0, dt, o); },
+        {projectV});
+    const uint32_t advectVy = g.add(
+        "advect_vy",
+        [&] {
+          advect(k, n, Boundary::HORIZONTAL, vy, vy0, vx0, vy0, dt, o);
+        },
+        {projectV});
+    velocity = g.add(
+        "reproject",
+        [&] {
+          stats.solve(Solve::REPROJECT) =
+              project(k, n, vx, vy, pressure, divergence, cfg, speed2, o);
+        },
+        {advectVx, advectVy});
+  }
+
+  // Sparse density sizes its bricks by the speed the velocity step left
+  if (cfg.sparse && !o)
+    g.add(
+        "density_step",
+        [&] {
+          maxSpeed = sqrt(speed2);
+          sparseDensityStep(k, diff, dt, stats);
+        },
+        {velocity});
+  else {
+    const uint32_t addD = g.add("add_source_density", [&] {
+      if (add)
+        addSource(k, n, d, d0, dt);
+    });
+    const uint32_t diffuseD = g.add(
+        "diffuse_density",
+        [&] {
+          stats.solve(Solve::DENSITY) =
+              diffuse(n, Boundary::NONE, d0, d, diff, dt, cfg, fold, o);
+        },
+        {addD});
+    g.add(
+        "advect_density",
+        [&] {
+          maxDensity = advect(k, n, Boundary::NONE, d, d0, vx, vy, dt, o);
+          stats.maxDensity = maxDensity;
+          stats.activeFraction = 1;
+        },
+        {velocity, diffuseD});
+  }
+
+  scheduler->run(g);
+  maxSpeed = sqrt(speed2);
+  stats.maxSpeed = maxSpeed;
+}
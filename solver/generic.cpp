@@ -1,167 +1,204 @@
+#include "backend.hpp"
+#include "kernels.hpp"
 #include "solver.hpp"
 
 #include <algorithm>
+#include <bit>
+#include <cmath>
 #include <cstdint>
-#include <utility>
 
 using namespace std;
 
-enum class Boundary { NONE = 0, VERTICAL = 1, HORIZONTAL = 2 };
+namespace generic {
 
-// reorder this... to row major
-// and also fix the usages below
-static inline uint64_t idx(uint64_t i, uint64_t j, uint64_t n) {
-  return i + (n + 2) * j;
-}
-
-static void add_source(const uint64_t n, float *__restrict x,
-                       float *__restrict s, const float dt) {
+// Every kernel takes the element type T of the fields and P of the pressure,
+// float or a format of precision.hpp, and computes in float
+template <typename T>
+static void add_source(const uint64_t n, T *__restrict x, T *__restrict s,
+                       const float dt) {
   uint64_t size = (n + 2) * (n + 2);
 
   for (uint64_t i = 0; i < size; i++)
-    x[i] += dt * s[i];
+    x[i] = T(x[i] + dt * s[i]);
 }
 
-static void setBoundary(const uint64_t n, const Boundary b,
-                        float *__restrict x) {
-  // left-upper corner
-  x[idx(0, 0, n)] = .5 * (x[idx(1, 0, n)] + x[idx(0, 1, n)]);
-
-  // first row
-  for (uint64_t j = 1; j <= n; j++)
-    x[idx(0, j, n)] =
-        (b == Boundary::VERTICAL) ? -x[idx(1, j, n)] : x[idx(1, j, n)];
-
-  // right-upper corner
-  x[idx(0, n + 1, n)] = .5 * (x[idx(1, n + 1, n)] + x[idx(0, n, n)]);
-
-  // cols
-  // not coallesced access :(
-  for (uint64_t i = 1; i <= n; i++) {
-    x[idx(i, 0, n)] =
-        b == Boundary::HORIZONTAL ? -x[idx(i, 1, n)] : x[idx(i, 1, n)];
-    x[idx(i, n + 1, n)] =
-        b == Boundary::HORIZONTAL ? -x[idx(i, n, n)] : x[idx(i, n, n)];
+// Back traces cells [iBegin, iEnd) of row j of d along (vx, vy) and
+// interpolates dPrev there, returns the bits of the largest result or 0.
+// Traces leaving a periodic grid come back in from the other side.
+template <bool periodic = false, typename T>
+static inline int32_t advectRow(const uint64_t n, const uint64_t j,
+                                const uint64_t iBegin, const uint64_t iEnd,
+                                T *__restrict d, const T *__restrict dPrev,
+                                const T *__restrict vx, const T *__restrict vy,
+                                const float dt0) {
+  int32_t peak = 0;
+  for (uint64_t i = iBegin; i < iEnd; i++) {
+    float x = i - dt0 * vx[idx(i, j, n)];
+    float y = j - dt0 * vy[idx(i, j, n)];
+
+    if constexpr (periodic) {
+      x -= n * floor((x - .5f) / n);
+      y -= n * floor((y - .5f) / n);
+    }
+    x = clamp(x, 0.5f, n + .5f);
+    y = clamp(y, 0.5f, n + .5f);
+
+    const uint32_t i0 = (uint32_t)x;
+    const uint32_t i1 = i0 + 1;
+    const uint32_t j0 = (uint32_t)y;
+    const uint32_t j1 = j0 + 1;
+
+    const float s1 = x - i0;
+    const float s0 = 1.f - s1;
+    const float t1 = y - j0;
+    const float t0 = 1.f - t1;
+
+    d[idx(i, j, n)] =
+        T(s0 * (t0 * dPrev[idx(i0, j0, n)] + t1 * dPrev[idx(i0, j1, n)]) +
+          s1 * (t0 * dPrev[idx(i1, j0, n)] + t1 * dPrev[idx(i1, j1, n)]));
+    // Negative floats are negative integers, below the starting 0
+    peak = max(peak, bit_cast<int32_t>(float(d[idx(i, j, n)])));
   }
-
-  // left-lower corner
-  x[idx(n + 1, 0, n)] = .5 * (x[idx(n, 0, n)] + x[idx(n + 1, 1, n)]);
-
-  // last row
-  for (uint64_t j = 1; j <= n; j++)
-    x[idx(n + 1, j, n)] =
-        (b == Boundary::VERTICAL) ? -x[idx(n, j, n)] : x[idx(n, j, n)];
-
-  // right-lower corner
-  x[idx(n + 1, n + 1, n)] = .5 * (x[idx(n, n + 1, n)] + x[idx(n + 1, n, n)]);
+  return peak;
 }
 
-static void linearSolve(const uint64_t n, const Boundary b, float *__restrict x,
-                        float *__restrict xPrev, const float a, const float c) {
-  for (uint32_t k = 0; k < 20; k++) {
-    for (uint64_t i = 1; i <= n; i++)
-      for (uint64_t j = 1; j <= n; j++)
-        x[idx(i, j, n)] = (xPrev[idx(i, j, n)] +
-                           a * (x[idx(i - 1, j, n)] + x[idx(i + 1, j, n)]) +
-                           x[idx(i, j - 1, n)] + x[idx(i, j + 1, n)]) /
-                          (1 + 4 * a);
-
-    setBoundary(n, b, x);
+template <typename T>
+static float advect(const uint64_t n, const Boundary b, T *__restrict d,
+                    T *__restrict dPrev, T *__restrict vx, T *__restrict vy,
+                    const float dt) {
+  const float dt0 = dt * n;
+  const float stale = beginBoundary(n, d);
+  int32_t peak = 0;
+  for (uint64_t j = 1; j <= n; j++) {
+    peak = max(peak, b == Boundary::PERIODIC
+                         ? advectRow<true>(n, j, 1, n + 1, d, dPrev, vx, vy,
+                                           dt0)
+                         : advectRow(n, j, 1, n + 1, d, dPrev, vx, vy, dt0));
+    setColumnWalls(n, b, d, j);
   }
+  endBoundary(n, b, d, stale);
+  return bit_cast<float>(peak);
 }
 
-static void diffuse(const uint64_t n, const Boundary b, float *__restrict x,
-                    float *__restrict xPrev, const float diff, const float dt) {
-
-  float a = dt * diff * n * n;
-  linearSolve(n, b, x, xPrev, a, 1 + 4 * a);
-}
-
-static void advect(const uint64_t n, const Boundary b, float *__restrict d,
-                   float *__restrict dPrev, float *__restrict vx,
-                   float *__restrict vy, const float dt) {
-
-  float dt0 = dt * n;
-  for (uint64_t i = 1; i <= n; i++) {
-    for (uint64_t j = 1; j <= n; j++) {
-      float x = i - dt0 * vx[idx(i, j, n)];
-      float y = j - dt0 * vx[idx(i, j, n)];
-
-      x = clamp(x, 0.5f, n + .5f);
-      y = clamp(y, 0.5f, n + .5f);
-
-      const uint32_t i0 = (uint32_t)x;
-      const uint32_t i1 = i0 + 1;
-      const uint32_t j0 = (uint32_t)y;
-      const uint32_t j1 = j0 + 1;
-
-      const float s1 = x - i0;
-      const float s0 = 1.f - s1;
-      const float t1 = y - j0;
-      const float t0 = 1.f - t1;
-
-      d[idx(i, j, n)] =
-          s0 * (t0 * dPrev[idx(i0, j0, n)] + t1 * dPrev[idx(i0, j1, n)]) +
-          s1 * (t0 * dPrev[idx(i1, j0, n)] + t1 * dPrev[idx(i1, j1, n)]);
-    }
-  }
+static float advectActive(const uint64_t n, const Boundary b,
+                          float *__restrict d, float *__restrict dPrev,
+                          float *__restrict vx, float *__restrict vy,
+                          const float dt, const ActiveBricks &active) {
+  const float dt0 = dt * n;
+  int32_t peak = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (const Span *p = active.begin(j); p != active.end(j); p++)
+      peak = max(peak,
+                 advectRow(n, j, p->begin, p->end, d, dPrev, vx, vy, dt0));
 
   setBoundary(n, b, d);
+  return bit_cast<float>(peak);
 }
 
-static void project(const uint64_t n, float *__restrict vx,
-                    float *__restrict vy, float *pressure, float *divergence) {
+// Row j of the divergence with its walls and the zeroed pressure, reads rows
+// j - 1 to j + 1 of vy
+template <typename T, typename P>
+static inline void divergenceRow(const uint64_t n, const uint64_t j,
+                                 const T *__restrict vx, const T *__restrict vy,
+                                 P *__restrict pressure,
+                                 P *__restrict divergence) {
   for (uint64_t i = 1; i <= n; i++) {
-    for (uint64_t j = 1; j <= n; j++) {
-      divergence[idx(i, j, n)] = -.5 *
-                                 (vx[idx(i + 1, j, n)] - vx[idx(i - 1, j, n)] +
-                                  vy[idx(i, j + 1, n)] - vy[idx(i, j - 1, n)]) /
-                                 n;
-      pressure[idx(i, j, n)] = 0;
-    }
+    divergence[idx(i, j, n)] =
+        P(-.5 *
+          (vx[idx(i + 1, j, n)] - vx[idx(i - 1, j, n)] + vy[idx(i, j + 1, n)] -
+           vy[idx(i, j - 1, n)]) /
+          n);
+    pressure[idx(i, j, n)] = P(0);
   }
+  setColumnWalls(n, Boundary::NONE, divergence, j);
+  setColumnWalls(n, Boundary::NONE, pressure, j);
+}
 
-  setBoundary(n, Boundary::NONE, pressure);
-  setBoundary(n, Boundary::NONE, divergence);
+// Divergence with its walls and the zeroed pressure in a single pass
+template <typename T, typename P>
+static void divergence(const uint64_t n, T *__restrict vx, T *__restrict vy,
+                       P *__restrict pressure, P *__restrict divergence) {
+  for (uint64_t j = 1; j <= n; j++)
+    divergenceRow(n, j, vx, vy, pressure, divergence);
 
-  linearSolve(n, Boundary::NONE, pressure, divergence, 1, 4);
+  setBoundaryRows(n, Boundary::NONE, pressure);
+  setBoundaryRows(n, Boundary::NONE, divergence);
+}
 
-  for (uint64_t i = 1; i <= n; i++) {
-    for (uint64_t j = 1; j <= n; j++) {
-      vx[idx(i, j, n)] -=
-          .5 * n * (pressure[idx(i + 1, j, n)] - pressure[idx(i - 1, j, n)]);
-      vy[idx(i, j, n)] -=
-          .5 * n * (pressure[idx(i, j + 1, n)] - pressure[idx(i, j - 1, n)]);
+// The walls go in as each row finishes
+template <typename T, typename P>
+static float subtractGradient(const uint64_t n, T *__restrict vx,
+                              T *__restrict vy, P *__restrict pressure) {
+  const float staleX = beginBoundary(n, vx);
+  const float staleY = beginBoundary(n, vy);
+  // Squares are never negative, so their bits order like integers and the
+  // maximum still vectorizes without fast math
+  int32_t speed2 = 0;
+  for (uint64_t j = 1; j <= n; j++) {
+    for (uint64_t i = 1; i <= n; i++) {
+      vx[idx(i, j, n)] =
+          T(vx[idx(i, j, n)] - .5 * n * (pressure[idx(i + 1, j, n)] -
+                                         pressure[idx(i - 1, j, n)]));
+      vy[idx(i, j, n)] =
+          T(vy[idx(i, j, n)] - .5 * n * (pressure[idx(i, j + 1, n)] -
+                                         pressure[idx(i, j - 1, n)]));
+      const float x = vx[idx(i, j, n)];
+      const float y = vy[idx(i, j, n)];
+      const float v2 = x * x + y * y;
+      speed2 = max(speed2, bit_cast<int32_t>(v2));
     }
+    setColumnWalls(n, Boundary::VERTICAL, vx, j);
+    setColumnWalls(n, Boundary::HORIZONTAL, vy, j);
   }
-
-  setBoundary(n, Boundary::VERTICAL, vx);
-  setBoundary(n, Boundary::HORIZONTAL, vy);
+  endBoundary(n, Boundary::VERTICAL, vx, staleX);
+  endBoundary(n, Boundary::HORIZONTAL, vy, staleY);
+  return bit_cast<float>(speed2);
 }
 
-void velocityStep(const uint64_t n, float *__restrict vx, float *__restrict vy,
-                  float *__restrict vxPrev, float *__restrict vyPrev,
-                  const float visc, const float dt) {
-  add_source(n, vx, vxPrev, dt);
-  add_source(n, vy, vyPrev, dt);
-  swap(vx, vxPrev);
-  diffuse(n, Boundary::VERTICAL, vx, vxPrev, visc, dt);
-  swap(vy, vyPrev);
-  diffuse(n, Boundary::HORIZONTAL, vy, vyPrev, visc, dt);
-  project(n, vx, vy, vxPrev, vyPrev);
-  swap(vx, vxPrev);
-  swap(vy, vyPrev);
-  advect(n, Boundary::VERTICAL, vx, vxPrev, vxPrev, vyPrev, dt);
-  advect(n, Boundary::VERTICAL, vy, vyPrev, vxPrev, vyPrev, dt);
-  project(n, vx, vy, vxPrev, vyPrev);
-}
+// Divergence of row j - 1 is complete once row j of vy is advected. Row 0 of
+// vy is written early for the first one, the last waits for the boundary.
+static void advectVelocity(const uint64_t n, float *__restrict vx,
+                           float *__restrict vy, float *__restrict vx0,
+                           float *__restrict vy0, float *__restrict pressure,
+                           float *__restrict divergence, const float dt) {
+  const float dt0 = dt * n;
+  const float staleX = beginBoundary(n, vx);
+  const float staleY = beginBoundary(n, vy);
+  for (uint64_t j = 1; j <= n; j++) {
+    advectRow(n, j, 1, n + 1, vx, vx0, vx0, vy0, dt0);
+    advectRow(n, j, 1, n + 1, vy, vy0, vx0, vy0, dt0);
+    setColumnWalls(n, Boundary::VERTICAL, vx, j);
+    setColumnWalls(n, Boundary::HORIZONTAL, vy, j);
+    if (j == 1)
+      for (uint64_t i = 1; i <= n; i++)
+        vy[idx(i, 0, n)] = -vy[idx(i, 1, n)];
+    else
+      divergenceRow(n, j - 1, vx, vy, pressure, divergence);
+  }
+  endBoundary(n, Boundary::VERTICAL, vx, staleX);
+  endBoundary(n, Boundary::HORIZONTAL, vy, staleY);
+  divergenceRow(n, n, vx, vy, pressure, divergence);
 
-void densityStep(const uint64_t n, float *__restrict d, float *__restrict dPrev,
-                 float *__restrict vx, float *__restrict vy, const float diff,
-                 const float dt) {
-  add_source(n, d, dPrev, dt);
-  swap(d, dPrev);
-  diffuse(n, Boundary::NONE, d, dPrev, diff, dt);
-  swap(d, dPrev);
-  advect(n, Boundary::NONE, d, dPrev, vx, vy, dt);
+  setBoundaryRows(n, Boundary::NONE, pressure);
+  setBoundaryRows(n, Boundary::NONE, divergence);
 }
+
+} // namespace generic
+
+const SolverBackend genericBackend{
+    "generic",
+    generic::add_source<float>,
+    generic::advect<float>,
+    generic::divergence<float, float>,
+    generic::subtractGradient<float, float>,
+    generic::advectVelocity,
+    generic::advectActive,
+    {generic::add_source<Half>, generic::advect<Half>,
+     generic::divergence<Half, float>, generic::divergence<Half, Half>,
+     generic::subtractGradient<Half, float>,
+     generic::subtractGradient<Half, Half>},
+    {generic::add_source<BFloat16>, generic::advect<BFloat16>,
+     generic::divergence<BFloat16, float>,
+     generic::divergence<BFloat16, BFloat16>,
+     generic::subtractGradient<BFloat16, float>,
+     generic::subtractGradient<BFloat16, BFloat16>}};
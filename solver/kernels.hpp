@@ -0,0 +1,166 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include "precision.hpp"
+#include "solver.hpp"
+
+#include <cstdint>
+#include <type_traits>
+
+// Building blocks shared by the solver translation units
+
+// How the ghost cells follow the interior: copied, mirrored across the
+// walls normal to i (vx) or to j (vy), or wrapped around from the opposite
+// side of a periodic grid
+enum class Boundary { NONE = 0, VERTICAL = 1, HORIZONTAL = 2, PERIODIC = 3 };
+
+// Row major with j as the row, i is the contiguous axis so every loop runs
+// j outer and i inner
+static inline uint64_t idx(uint64_t i, uint64_t j, uint64_t n) {
+  return i + (n + 2) * j;
+}
+
+// Calls fn with n as a std::integral_constant for the production grid sizes,
+// so the kernel it instantiates has compile time strides and trip counts.
+// Other sizes, or any size when fixed is false, get the 0 instantiation,
+// which has to read n at runtime.
+template <typename Fn>
+static inline decltype(auto) withGridSize(const uint64_t n, const bool fixed,
+                                          Fn &&fn) {
+  if (fixed)
+    switch (n) {
+    case 128:
+      return fn(std::integral_constant<uint64_t, 128>{});
+    case 256:
+      return fn(std::integral_constant<uint64_t, 256>{});
+    case 512:
+      return fn(std::integral_constant<uint64_t, 512>{});
+    case 1024:
+      return fn(std::integral_constant<uint64_t, 1024>{});
+    case 2048:
+      return fn(std::integral_constant<uint64_t, 2048>{});
+    }
+  return fn(std::integral_constant<uint64_t, 0>{});
+}
+
+// The kernels below take the element type of the grid, float or one of the
+// 16 bit formats of precision.hpp, and compute in float either way
+template <typename T>
+static inline float relax(const uint64_t n, const uint64_t i,
+                          const uint64_t j, const T *__restrict x,
+                          const T *__restrict xPrev, const float a,
+                          const float c) {
+  return (xPrev[idx(i, j, n)] +
+          a * (x[idx(i - 1, j, n)] + x[idx(i + 1, j, n)] + x[idx(i, j - 1, n)] +
+               x[idx(i, j + 1, n)])) /
+         c;
+}
+
+template <typename T>
+void setBoundary(const uint64_t n, const Boundary b, T *__restrict x);
+
+// Wall ghosts at i = 0 and i = n + 1 of column j, fused passes write them
+// while the column is still in cache
+template <typename T>
+static inline void setColumnWalls(const uint64_t n, const Boundary b,
+                                  T *__restrict x, const uint64_t j) {
+  if (b == Boundary::PERIODIC) {
+    x[idx(0, j, n)] = x[idx(n, j, n)];
+    x[idx(n + 1, j, n)] = x[idx(1, j, n)];
+    return;
+  }
+  const float s = b == Boundary::VERTICAL ? -1 : 1;
+  x[idx(0, j, n)] = T(s * x[idx(1, j, n)]);
+  x[idx(n + 1, j, n)] = T(s * x[idx(n, j, n)]);
+}
+
+// The rest of setBoundary once every column has its walls: rows j = 0 and
+// j = n + 1 and the corners
+template <typename T>
+void setBoundaryRows(const uint64_t n, const Boundary b, T *__restrict x);
+
+// setBoundary spread over a pass that finishes one column at a time:
+// beginBoundary before it, setColumnWalls after each column and endBoundary
+// once done. setBoundary computes some corners from ghosts it only writes
+// later, so beginBoundary writes the first corner and returns the one ghost
+// the walls overwrite before endBoundary needs it. The result is bit
+// identical to setBoundary after the pass.
+template <typename T>
+static inline float beginBoundary(const uint64_t n, T *__restrict x) {
+  x[idx(0, 0, n)] = T(.5 * (x[idx(1, 0, n)] + x[idx(0, 1, n)]));
+  return x[idx(n + 1, 1, n)];
+}
+
+template <typename T>
+static inline void endBoundary(const uint64_t n, const Boundary b,
+                               T *__restrict x, const float stale) {
+  // Whole rows, corners included, once the walls wrapped
+  if (b == Boundary::PERIODIC) {
+    for (uint64_t i = 0; i <= n + 1; i++) {
+      x[idx(i, 0, n)] = x[idx(i, n, n)];
+      x[idx(i, n + 1, n)] = x[idx(i, 1, n)];
+    }
+    return;
+  }
+  x[idx(0, n + 1, n)] = T(.5 * (x[idx(1, n + 1, n)] + x[idx(0, n, n)]));
+  for (uint64_t i = 1; i <= n; i++) {
+    x[idx(i, 0, n)] =
+        T(b == Boundary::HORIZONTAL ? -x[idx(i, 1, n)] : x[idx(i, 1, n)]);
+    x[idx(i, n + 1, n)] =
+        T(b == Boundary::HORIZONTAL ? -x[idx(i, n, n)] : x[idx(i, n, n)]);
+  }
+  x[idx(n + 1, 0, n)] = T(.5 * (x[idx(n, 0, n)] + stale));
+  x[idx(n + 1, n + 1, n)] =
+      T(.5 * (x[idx(n, n + 1, n)] + x[idx(n + 1, n, n)]));
+}
+
+// addSource of the right hand side a solve is about to read, xPrev += dt * x
+// over the padded grid, as the steps do right before the swap leading into
+// diffuse. With it the first sweep folds the source into each column just
+// before relaxing it instead of a pass of its own.
+struct SourceFold {
+  bool enabled = false;
+  float dt = 0;
+};
+
+// Solves c * x - a * (sum of the 4 neighbours of x) = xPrev in place
+SolveStats linearSolve(const uint64_t n, const Boundary b, float *__restrict x,
+                       float *__restrict xPrev, const float a, const float c,
+                       const SolverConfig &cfg, const SourceFold fold = {});
+
+// linearSolve on fields kept in a 16 bit format, see SolverConfig::storage.
+// Sweeps as cfg.linearSolver says, multigrid and conjugate gradients need
+// float grids.
+SolveStats linearSolve(const uint64_t n, const Boundary b, Half *__restrict x,
+                       Half *__restrict xPrev, const float a, const float c,
+                       const SolverConfig &cfg);
+SolveStats linearSolve(const uint64_t n, const Boundary b,
+                       BFloat16 *__restrict x, BFloat16 *__restrict xPrev,
+                       const float a, const float c, const SolverConfig &cfg);
+
+// Runs sweeps relaxations of the same system without tracking the residual
+void smooth(const uint64_t n, const Boundary b, float *__restrict x,
+            float *__restrict xPrev, const float a, const float c,
+            const SolverConfig &cfg, const uint32_t sweeps);
+
+// V-cycles for the pressure equation of project, 4 * x - (neighbours) = xPrev
+// with Neumann boundaries
+SolveStats multigridSolve(const uint64_t n, float *__restrict x,
+                          float *__restrict xPrev, const SolverConfig &cfg);
+
+// Preconditioned conjugate gradient on the same system as linearSolve
+SolveStats conjugateGradientSolve(const uint64_t n, const Boundary b,
+                                  float *__restrict x, float *__restrict xPrev,
+                                  const float a, const float c,
+                                  const SolverConfig &cfg);
+
+// Implicit diffusion of x with the solver picked by cfg.diffusionSolver
+SolveStats diffuse(const uint64_t n, const Boundary b, float *__restrict x,
+                   float *__restrict xPrev, const float diff, const float dt,
+                   const SolverConfig &cfg, const SourceFold fold = {});
+
+// Pressure equation of project with the solver picked by cfg.pressureSolver
+SolveStats pressureSolve(const uint64_t n, float *__restrict pressure,
+                         float *__restrict divergence, const SolverConfig &cfg);
+
+#endif
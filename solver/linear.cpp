@@ -0,0 +1,390 @@
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+template <typename T>
+void setBoundary(const uint64_t n, const Boundary b, T *__restrict x) {
+  if (b == Boundary::PERIODIC) {
+    for (uint64_t j = 1; j <= n; j++)
+      setColumnWalls(n, b, x, j);
+    setBoundaryRows(n, b, x);
+    return;
+  }
+
+  // left-upper corner
+  x[idx(0, 0, n)] = T(.5 * (x[idx(1, 0, n)] + x[idx(0, 1, n)]));
+
+  // first row
+  for (uint64_t j = 1; j <= n; j++)
+    x[idx(0, j, n)] =
+        T((b == Boundary::VERTICAL) ? -x[idx(1, j, n)] : x[idx(1, j, n)]);
+
+  // right-upper corner
+  x[idx(0, n + 1, n)] = T(.5 * (x[idx(1, n + 1, n)] + x[idx(0, n, n)]));
+
+  // cols
+  // not coallesced access :(
+  for (uint64_t i = 1; i <= n; i++) {
+    x[idx(i, 0, n)] =
+        T(b == Boundary::HORIZONTAL ? -x[idx(i, 1, n)] : x[idx(i, 1, n)]);
+    x[idx(i, n + 1, n)] =
+        T(b == Boundary::HORIZONTAL ? -x[idx(i, n, n)] : x[idx(i, n, n)]);
+  }
+
+  // left-lower corner
+  x[idx(n + 1, 0, n)] = T(.5 * (x[idx(n, 0, n)] + x[idx(n + 1, 1, n)]));
+
+  // last row
+  for (uint64_t j = 1; j <= n; j++)
+    x[idx(n + 1, j, n)] =
+        T((b == Boundary::VERTICAL) ? -x[idx(n, j, n)] : x[idx(n, j, n)]);
+
+  // right-lower corner
+  x[idx(n + 1, n + 1, n)] =
+      T(.5 * (x[idx(n, n + 1, n)] + x[idx(n + 1, n, n)]));
+}
+
+template <typename T>
+void setBoundaryRows(const uint64_t n, const Boundary b, T *__restrict x) {
+  // The corners wrap with the rows
+  if (b == Boundary::PERIODIC) {
+    for (uint64_t i = 0; i <= n + 1; i++) {
+      x[idx(i, 0, n)] = x[idx(i, n, n)];
+      x[idx(i, n + 1, n)] = x[idx(i, 1, n)];
+    }
+    return;
+  }
+  const float s = b == Boundary::HORIZONTAL ? -1 : 1;
+  for (uint64_t i = 1; i <= n; i++) {
+    x[idx(i, 0, n)] = T(s * x[idx(i, 1, n)]);
+    x[idx(i, n + 1, n)] = T(s * x[idx(i, n, n)]);
+  }
+
+  x[idx(0, 0, n)] = T(.5 * (x[idx(1, 0, n)] + x[idx(0, 1, n)]));
+  x[idx(0, n + 1, n)] = T(.5 * (x[idx(1, n + 1, n)] + x[idx(0, n, n)]));
+  x[idx(n + 1, 0, n)] = T(.5 * (x[idx(n, 0, n)] + x[idx(n + 1, 1, n)]));
+  x[idx(n + 1, n + 1, n)] =
+      T(.5 * (x[idx(n, n + 1, n)] + x[idx(n + 1, n, n)]));
+}
+
+template void setBoundary(const uint64_t, const Boundary, float *__restrict);
+template void setBoundary(const uint64_t, const Boundary, Half *__restrict);
+template void setBoundary(const uint64_t, const Boundary,
+                          BFloat16 *__restrict);
+template void setBoundaryRows(const uint64_t, const Boundary,
+                              float *__restrict);
+template void setBoundaryRows(const uint64_t, const Boundary,
+                              Half *__restrict);
+template void setBoundaryRows(const uint64_t, const Boundary,
+                              BFloat16 *__restrict);
+
+// One row of SourceFold, right before the first sweep relaxes it. Ghost
+// cells are folded too, addSource covers the whole padded grid.
+template <typename T>
+static inline void foldRow(const uint64_t n, const T *__restrict x,
+                           T *__restrict xPrev, const uint64_t j,
+                           const float dt) {
+  for (uint64_t i = 0; i <= n + 1; i++)
+    xPrev[idx(i, j, n)] = T(xPrev[idx(i, j, n)] + dt * x[idx(i, j, n)]);
+}
+
+// Each sweep relaxes x in place and, when track is set, returns the squared
+// norm of the residual every cell had right before it was relaxed, that is
+// c * (new - old). It lags a sweep behind but costs no extra pass.
+//
+// N is the grid size when known at compile time, 0 takes it from gridN. An
+// enabled fold adds the source row by row, each row is only relaxed after it
+// got it.
+template <bool track, uint64_t N, typename T>
+static double sweepGaussSeidel(const uint64_t gridN, T *__restrict x,
+                               T *__restrict xPrev, const float a,
+                               const float c, const SourceFold fold) {
+  const uint64_t n = N ? N : gridN;
+  if (fold.enabled) {
+    foldRow(n, x, xPrev, 0, fold.dt);
+    foldRow(n, x, xPrev, n + 1, fold.dt);
+  }
+
+  double r2 = 0;
+  for (uint64_t j = 1; j <= n; j++) {
+    if (fold.enabled)
+      foldRow(n, x, xPrev, j, fold.dt);
+    for (uint64_t i = 1; i <= n; i++) {
+      const float v = relax(n, i, j, x, xPrev, a, c);
+      if constexpr (track) {
+        const float r = c * (v - x[idx(i, j, n)]);
+        r2 += r * r;
+      }
+      x[idx(i, j, n)] = T(v);
+    }
+  }
+
+  return r2;
+}
+
+// Checkerboard ordering: every cell of one color only reads cells of the
+// other one, so each half sweep can be split across threads and the result
+// is the same for any thread count. Residuals are reduced per column and
+// summed in order to keep that property.
+template <bool track, uint64_t N, typename T>
+static double sweepRedBlack(const uint64_t gridN, T *__restrict x,
+                            T *__restrict xPrev, const float a,
+                            const float c, ThreadPool &pool,
+                            double *__restrict colResidual,
+                            const SourceFold fold) {
+  const uint64_t n = N ? N : gridN;
+  if (fold.enabled) {
+    foldRow(n, x, xPrev, 0, fold.dt);
+    foldRow(n, x, xPrev, n + 1, fold.dt);
+  }
+
+  for (uint64_t color = 0; color < 2; color++) {
+    // j outer keeps the inner loop on the contiguous axis of idx()
+    pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+      for (uint64_t j = jBegin; j < jEnd; j++) {
+        // The first color reads the row of its own thread only
+        if (fold.enabled && color == 0)
+          foldRow(n, x, xPrev, j, fold.dt);
+        double r2 = 0;
+        for (uint64_t i = 1 + ((j + color) & 1); i <= n; i += 2) {
+          const float v = relax(n, i, j, x, xPrev, a, c);
+          if constexpr (track) {
+            const float r = c * (v - x[idx(i, j, n)]);
+            r2 += r * r;
+          }
+          x[idx(i, j, n)] = T(v);
+        }
+        if constexpr (track)
+          colResidual[j] = color ? colResidual[j] + r2 : r2;
+      }
+    });
+  }
+
+  double r2 = 0;
+  if constexpr (track)
+    for (uint64_t j = 1; j <= n; j++)
+      r2 += colResidual[j];
+  return r2;
+}
+
+// Wavefront temporal blocking: depth Gauss-Seidel sweeps (in j outer order)
+// share one pass over the grid. At step s sweep t relaxes column s - 2t, so
+// it reads column j - 1 already at sweep t and column j + 1 still at t - 1,
+// exactly as depth separate sweeps would, while only about 2 * depth
+// columns are live in cache. Wall ghosts of a column are written as soon as
+// it finishes a sweep, which is all the next sweep reads of them.
+template <bool track, uint64_t N, typename T>
+static double sweepTiled(const uint64_t gridN, const Boundary b,
+                         T *__restrict x, T *__restrict xPrev,
+                         const float a, const float c, const uint32_t depth,
+                         const SourceFold fold) {
+  const uint64_t n = N ? N : gridN;
+  const float sj = b == Boundary::HORIZONTAL ? -1 : 1;
+  if (fold.enabled) {
+    foldRow(n, x, xPrev, 0, fold.dt);
+    foldRow(n, x, xPrev, n + 1, fold.dt);
+  }
+
+  double r2 = 0;
+  for (uint64_t s = 1; s <= n + 2 * (depth - 1); s++)
+    for (uint32_t t = 0; t < depth && 2 * t < s; t++) {
+      const uint64_t j = s - 2 * t;
+      if (j > n)
+        continue;
+
+      if (fold.enabled && t == 0)
+        foldRow(n, x, xPrev, j, fold.dt);
+      for (uint64_t i = 1; i <= n; i++) {
+        const float v = relax(n, i, j, x, xPrev, a, c);
+        if constexpr (track)
+          if (t + 1 == depth) {
+            const float r = c * (v - x[idx(i, j, n)]);
+            r2 += r * r;
+          }
+        x[idx(i, j, n)] = T(v);
+      }
+
+      setColumnWalls(n, b, x, j);
+      // Column 1 and n sweeps read the row ghosts of the previous one
+      if (j == 1)
+        for (uint64_t i = 1; i <= n; i++)
+          x[idx(i, 0, n)] = T(sj * x[idx(i, 1, n)]);
+      if (j == n)
+        for (uint64_t i = 1; i <= n; i++)
+          x[idx(i, n + 1, n)] = T(sj * x[idx(i, n, n)]);
+    }
+
+  setBoundaryRows(n, b, x);
+  return r2;
+}
+
+// Runs sweeps relaxations including their boundaries and returns the
+// residual of the last one when track is set. fold goes to the first sweep.
+template <bool track, typename T>
+static double relaxPass(const uint64_t n, const Boundary b, T *__restrict x,
+                        T *__restrict xPrev, const float a, const float c,
+                        const SolverConfig &cfg, const uint32_t sweeps,
+                        double *__restrict colResidual,
+                        const SourceFold fold) {
+  return withGridSize(n, cfg.fixedGrid, [&](auto grid) {
+    constexpr uint64_t N = decltype(grid)::value;
+    double r2 = 0;
+    for (uint32_t k = 0; k < sweeps; k++) {
+      const bool last = k + 1 == sweeps;
+      const SourceFold f = k == 0 ? fold : SourceFold{};
+      switch (cfg.linearSolver) {
+      case LinearSolver::GAUSS_SEIDEL:
+        r2 = track && last
+                 ? sweepGaussSeidel<true, N>(n, x, xPrev, a, c, f)
+                 : sweepGaussSeidel<false, N>(n, x, xPrev, a, c, f);
+        setBoundary(n, b, x);
+        break;
+      case LinearSolver::RED_BLACK: {
+        ThreadPool &pool = threadPool(cfg.threads);
+        r2 = track && last ? sweepRedBlack<true, N>(n, x, xPrev, a, c, pool,
+                                                    colResidual, f)
+                           : sweepRedBlack<false, N>(n, x, xPrev, a, c, pool,
+                                                     colResidual, f);
+        setBoundary(n, b, x);
+        break;
+      }
+      case LinearSolver::TILED: {
+        const uint32_t depth = min(max(cfg.tileDepth, 1u), sweeps - k);
+        r2 = track && k + depth == sweeps
+                 ? sweepTiled<true, N>(n, b, x, xPrev, a, c, depth, f)
+                 : sweepTiled<false, N>(n, b, x, xPrev, a, c, depth, f);
+        k += depth - 1;
+        break;
+      }
+      }
+    }
+    return r2;
+  });
+}
+
+void smooth(const uint64_t n, const Boundary b, float *__restrict x,
+            float *__restrict xPrev, const float a, const float c,
+            const SolverConfig &cfg, const uint32_t sweeps) {
+  relaxPass<false>(n, b, x, xPrev, a, c, cfg, sweeps, nullptr, {});
+}
+
+// Residuals are relative to the right hand side unless it vanishes
+template <typename T>
+static double relativeScale(const uint64_t n, const T *__restrict x) {
+  double s = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++) {
+      const float v = x[idx(i, j, n)];
+      s += v * v;
+    }
+  return s > 0 ? 1 / sqrt(s) : 1;
+}
+
+// Runs up to cfg.maxIterations sweeps. With a tolerance the residual is
+// tracked on every pass (one sweep, or tileDepth for the tiled solver) and
+// the solve stops once it is small enough, otherwise only the last sweep
+// pays for it so it can be reported. scale makes it relative, with an
+// enabled fold it is only known once the first pass completed xPrev.
+template <typename T>
+static SolveStats sweepSolve(const uint64_t n, const Boundary b,
+                             T *__restrict x, T *__restrict xPrev,
+                             const float a, const float c,
+                             const SolverConfig &cfg, double scale,
+                             const SourceFold fold) {
+  const bool converge = cfg.tolerance > 0;
+
+  vector<double> colResidual;
+  if (cfg.linearSolver == LinearSolver::RED_BLACK)
+    colResidual.resize(n + 2);
+
+  const uint32_t passSweeps =
+      cfg.linearSolver == LinearSolver::TILED ? max(cfg.tileDepth, 1u) : 1;
+
+  SolveStats stats{0, NAN};
+  while (stats.iterations < cfg.maxIterations) {
+    const uint32_t sweeps =
+        min(passSweeps, cfg.maxIterations - stats.iterations);
+    const bool track =
+        converge || stats.iterations + sweeps == cfg.maxIterations;
+    const SourceFold f = stats.iterations == 0 ? fold : SourceFold{};
+    const double r2 =
+        track ? relaxPass<true>(n, b, x, xPrev, a, c, cfg, sweeps,
+                                colResidual.data(), f)
+              : relaxPass<false>(n, b, x, xPrev, a, c, cfg, sweeps,
+                                 colResidual.data(), f);
+    if (f.enabled)
+      scale = relativeScale(n, xPrev);
+    stats.iterations += sweeps;
+
+    if (track) {
+      stats.residual = sqrt(r2) * scale;
+      if (converge && stats.residual <= cfg.tolerance)
+        break;
+    }
+  }
+
+  return stats;
+}
+
+SolveStats linearSolve(const uint64_t n, const Boundary b, float *__restrict x,
+                       float *__restrict xPrev, const float a, const float c,
+                       const SolverConfig &cfg, const SourceFold fold) {
+  PROFILE_ZONE("linear_solve");
+  return sweepSolve(n, b, x, xPrev, a, c, cfg,
+                    fold.enabled ? 1 : relativeScale(n, xPrev), fold);
+}
+
+SolveStats linearSolve(const uint64_t n, const Boundary b, Half *__restrict x,
+                       Half *__restrict xPrev, const float a, const float c,
+                       const SolverConfig &cfg) {
+  PROFILE_ZONE("linear_solve");
+  return sweepSolve(n, b, x, xPrev, a, c, cfg, relativeScale(n, xPrev), {});
+}
+
+SolveStats linearSolve(const uint64_t n, const Boundary b,
+                       BFloat16 *__restrict x, BFloat16 *__restrict xPrev,
+                       const float a, const float c, const SolverConfig &cfg) {
+  PROFILE_ZONE("linear_solve");
+  return sweepSolve(n, b, x, xPrev, a, c, cfg, relativeScale(n, xPrev), {});
+}
+
+SolveStats diffuse(const uint64_t n, const Boundary b, float *__restrict x,
+                   float *__restrict xPrev, const float diff, const float dt,
+                   const SolverConfig &cfg, const SourceFold fold) {
+  PROFILE_ZONE("diffuse");
+  const float a = dt * diff * n * n;
+  switch (cfg.diffusionSolver) {
+  case DiffusionSolver::LINEAR:
+    return linearSolve(n, b, x, xPrev, a, 1 + 4 * a, cfg, fold);
+  case DiffusionSolver::CONJUGATE_GRADIENT:
+    // Conjugate gradient reads the right hand side up front
+    if (fold.enabled)
+      for (uint64_t k = 0; k < (n + 2) * (n + 2); k++)
+        xPrev[k] += fold.dt * x[k];
+    return conjugateGradientSolve(n, b, x, xPrev, a, 1 + 4 * a, cfg);
+  }
+  return {};
+}
+
+SolveStats pressureSolve(const uint64_t n, float *__restrict pressure,
+                         float *__restrict divergence,
+                         const SolverConfig &cfg) {
+  PROFILE_ZONE("pressure_solve");
+  switch (cfg.pressureSolver) {
+  case PressureSolver::LINEAR:
+    return linearSolve(n, Boundary::NONE, pressure, divergence, 1, 4, cfg);
+  case PressureSolver::MULTIGRID:
+    return multigridSolve(n, pressure, divergence, cfg);
+  case PressureSolver::CONJUGATE_GRADIENT:
+    return conjugateGradientSolve(n, Boundary::NONE, pressure, divergence, 1,
+                                  4, cfg);
+  }
+  return {};
+}
@@ -0,0 +1,189 @@
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Cell centered geometric multigrid for the pressure Poisson equation. Each
+// coarse level halves n, keeping the (n + 2) * (n + 2) padded layout so the
+// Gauss-Seidel sweeps and setBoundary work unchanged as the smoother.
+
+static constexpr uint32_t PRE_SMOOTH = 2;
+static constexpr uint32_t POST_SMOOTH = 2;
+static constexpr uint64_t COARSEST = 4;
+
+struct Level {
+  uint64_t n;
+  float *x;
+  float *b;
+  vector<float> r;
+  vector<float> xStorage;
+  vector<float> bStorage;
+};
+
+// Levels are cached between calls, only level 0 x and b change every solve
+static vector<Level> &hierarchy(const uint64_t n, float *__restrict x,
+                                float *__restrict b) {
+  static thread_local vector<Level> levels;
+
+  if (levels.empty() || levels[0].n != n) {
+    levels.clear();
+    for (uint64_t ln = n;; ln /= 2) {
+      Level &l = levels.emplace_back();
+      l.n = ln;
+      l.r.resize((ln + 2) * (ln + 2));
+      if (ln != n) {
+        l.xStorage.resize((ln + 2) * (ln + 2));
+        l.bStorage.resize((ln + 2) * (ln + 2));
+        l.x = l.xStorage.data();
+        l.b = l.bStorage.data();
+      }
+      if (ln % 2 != 0 || ln / 2 < COARSEST)
+        break;
+    }
+  }
+
+  levels[0].x = x;
+  levels[0].b = b;
+  return levels;
+}
+
+// r = b - (4 * x - neighbours), returns the squared norm of r
+static double residual(Level &l, ThreadPool &pool,
+                       double *__restrict colResidual) {
+  const uint64_t n = l.n;
+  const float *__restrict x = l.x;
+  const float *__restrict b = l.b;
+  float *__restrict r = l.r.data();
+
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t j = jBegin; j < jEnd; j++) {
+      double r2 = 0;
+      for (uint64_t i = 1; i <= n; i++) {
+        const float v =
+            b[idx(i, j, n)] -
+            (4 * x[idx(i, j, n)] - x[idx(i - 1, j, n)] - x[idx(i + 1, j, n)] -
+             x[idx(i, j - 1, n)] - x[idx(i, j + 1, n)]);
+        r[idx(i, j, n)] = v;
+        r2 += v * v;
+      }
+      colResidual[j] = r2;
+    }
+  });
+
+  double r2 = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    r2 += colResidual[j];
+  return r2;
+}
+
+// The coarse operator has 4 times the fine cell area, so the right hand side
+// is the sum of the 4 fine residuals instead of their average
+static void restrictResidual(const Level &fine, Level &coarse,
+                             ThreadPool &pool) {
+  const uint64_t n = coarse.n;
+  const uint64_t fn = fine.n;
+  const float *__restrict r = fine.r.data();
+  float *__restrict b = coarse.b;
+  float *__restrict x = coarse.x;
+
+  fill(x, x + (n + 2) * (n + 2), 0.f);
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t j = jBegin; j < jEnd; j++)
+      for (uint64_t i = 1; i <= n; i++)
+        b[idx(i, j, n)] =
+            r[idx(2 * i - 1, 2 * j - 1, fn)] + r[idx(2 * i, 2 * j - 1, fn)] +
+            r[idx(2 * i - 1, 2 * j, fn)] + r[idx(2 * i, 2 * j, fn)];
+  });
+}
+
+// Bilinear interpolation of the coarse correction, the coarse ghost cells
+// already hold the Neumann boundary so edge cells need no special case
+static void prolongCorrection(const Level &coarse, Level &fine,
+                              ThreadPool &pool) {
+  const uint64_t n = fine.n;
+  const uint64_t cn = coarse.n;
+  const float *__restrict e = coarse.x;
+  float *__restrict x = fine.x;
+
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t j = jBegin; j < jEnd; j++) {
+      const uint64_t cj = (j + 1) / 2;
+      const uint64_t nj = j & 1 ? cj - 1 : cj + 1;
+      for (uint64_t i = 1; i <= n; i++) {
+        const uint64_t ci = (i + 1) / 2;
+        const uint64_t ni = i & 1 ? ci - 1 : ci + 1;
+        x[idx(i, j, n)] +=
+            (9 * e[idx(ci, cj, cn)] + 3 * e[idx(ni, cj, cn)] +
+             3 * e[idx(ci, nj, cn)] + e[idx(ni, nj, cn)]) /
+            16;
+      }
+    }
+  });
+}
+
+static void vcycle(vector<Level> &levels, const uint64_t l,
+                   const SolverConfig &cfg, ThreadPool &pool,
+                   double *__restrict colResidual) {
+  Level &fine = levels[l];
+
+  if (l + 1 == levels.size()) {
+    // Coarsest level, cheap enough to just sweep until it converges
+    smooth(fine.n, Boundary::NONE, fine.x, fine.b, 1, 4, cfg,
+           static_cast<uint32_t>(4 * fine.n));
+    return;
+  }
+
+  smooth(fine.n, Boundary::NONE, fine.x, fine.b, 1, 4, cfg, PRE_SMOOTH);
+  residual(fine, pool, colResidual);
+
+  Level &coarse = levels[l + 1];
+  restrictResidual(fine, coarse, pool);
+  vcycle(levels, l + 1, cfg, pool, colResidual);
+
+  prolongCorrection(coarse, fine, pool);
+  setBoundary(fine.n, Boundary::NONE, fine.x);
+  smooth(fine.n, Boundary::NONE, fine.x, fine.b, 1, 4, cfg, POST_SMOOTH);
+}
+
+SolveStats multigridSolve(const uint64_t n, float *__restrict x,
+                          float *__restrict xPrev, const SolverConfig &cfg) {
+  PROFILE_ZONE("multigrid");
+  ThreadPool &pool = threadPool(cfg.threads);
+  vector<Level> &levels = hierarchy(n, x, xPrev);
+  vector<double> colResidual(n + 2);
+
+  // Pure Neumann makes the system singular, it only has a solution when the
+  // right hand side has zero mean. Removing it in place leaves the pressure
+  // gradient untouched and keeps every coarse level consistent.
+  double sum = 0;
+  double b2 = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++)
+      sum += xPrev[idx(i, j, n)];
+  const float mean = sum / (n * n);
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++) {
+      xPrev[idx(i, j, n)] -= mean;
+      b2 += xPrev[idx(i, j, n)] * xPrev[idx(i, j, n)];
+    }
+  const double scale = b2 > 0 ? 1 / sqrt(b2) : 1;
+
+  SolveStats stats{0, NAN};
+  while (stats.iterations < cfg.maxCycles) {
+    vcycle(levels, 0, cfg, pool, colResidual.data());
+    stats.iterations++;
+
+    const double r2 = residual(levels[0], pool, colResidual.data());
+    stats.residual = sqrt(r2) * scale;
+    if (cfg.tolerance > 0 && stats.residual <= cfg.tolerance)
+      break;
+  }
+
+  return stats;
+}
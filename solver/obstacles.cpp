@@ -0,0 +1,216 @@
+#include "obstacles.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// Runs of cells of row j whose flag in solid is value
+static void collectSpans(const uint64_t n, const vector<uint8_t> &solid,
+                         const uint64_t j, const uint8_t value,
+                         vector<Span> &spans) {
+  const uint8_t *row = solid.data() + (j - 1) * n;
+  for (uint64_t i = 1; i <= n;) {
+    if (bool(row[i - 1]) != bool(value)) {
+      i++;
+      continue;
+    }
+    const uint32_t begin = i;
+    while (i <= n && bool(row[i - 1]) == bool(value))
+      i++;
+    spans.push_back({begin, uint32_t(i)});
+  }
+}
+
+Obstacles::Obstacles(const uint64_t n, const vector<uint8_t> &solid)
+    : n(n), rowSpans(n + 1), solidRowSpans(n + 1) {
+  for (uint64_t j = 1; j <= n; j++) {
+    collectSpans(n, solid, j, 0, spans);
+    collectSpans(n, solid, j, 1, solidSpans);
+    rowSpans[j] = spans.size();
+    solidRowSpans[j] = solidSpans.size();
+  }
+  for (const Span &s : spans)
+    fluidCells += s.end - s.begin;
+
+  // Outside the interior counts as solid, the walls take care of it
+  const auto fluid = [&](const uint64_t i, const uint64_t j) {
+    return i >= 1 && i <= n && j >= 1 && j <= n && !solid[(j - 1) * n + i - 1];
+  };
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++) {
+      if (fluid(i, j))
+        continue;
+      const uint64_t around[4][2] = {
+          {i - 1, j}, {i + 1, j}, {i, j - 1}, {i, j + 1}};
+      array<uint32_t, 4> from{};
+      bool alongI[4]{};
+      uint32_t count = 0;
+      for (uint32_t k = 0; k < 4; k++)
+        if (fluid(around[k][0], around[k][1])) {
+          from[count] = idx(around[k][0], around[k][1], n);
+          alongI[count++] = k < 2;
+        }
+      if (count == 0)
+        continue;
+
+      ghosts.push_back(idx(i, j, n));
+      array<float, 4> w[3]{};
+      for (uint32_t k = 0; k < count; k++) {
+        w[static_cast<size_t>(Boundary::NONE)][k] = 1.f / count;
+        w[static_cast<size_t>(Boundary::VERTICAL)][k] =
+            (alongI[k] ? -1.f : 1.f) / count;
+        w[static_cast<size_t>(Boundary::HORIZONTAL)][k] =
+            (alongI[k] ? 1.f : -1.f) / count;
+      }
+      // Spare taps read a fluid neighbour with weight 0
+      for (uint32_t k = count; k < 4; k++)
+        from[k] = from[0];
+      taps.push_back(from);
+      for (size_t b = 0; b < 3; b++)
+        weights[b].push_back(w[b]);
+    }
+}
+
+void Obstacles::apply(const Boundary b, float *__restrict x) const {
+  PROFILE_ZONE("obstacles");
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint32_t s = solidRowSpans[j - 1]; s < solidRowSpans[j]; s++)
+      fill(x + idx(solidSpans[s].begin, j, n), x + idx(solidSpans[s].end, j, n),
+           0.f);
+
+  // Ghosts only read fluid cells, so their order doesn't matter
+  const array<float, 4> *w = weights[static_cast<size_t>(b)].data();
+  for (uint64_t k = 0; k < ghosts.size(); k++) {
+    const array<uint32_t, 4> &t = taps[k];
+    x[ghosts[k]] = w[k][0] * x[t[0]] + w[k][1] * x[t[1]] +
+                   w[k][2] * x[t[2]] + w[k][3] * x[t[3]];
+  }
+}
+
+// Next header token of a netpbm file, skipping whitespace and comments.
+// Values past 32 bits are rejected so sizes built from them can't overflow.
+static bool readToken(FILE *f, uint64_t &value) {
+  int c = fgetc(f);
+  while (c == '#' || isspace(c)) {
+    if (c == '#')
+      while (c != '\n' && c != EOF)
+        c = fgetc(f);
+    c = fgetc(f);
+  }
+  if (!isdigit(c))
+    return false;
+  value = 0;
+  while (isdigit(c)) {
+    value = value * 10 + (c - '0');
+    if (value > UINT32_MAX)
+      return false;
+    c = fgetc(f);
+  }
+  // The single whitespace ending the header is part of it
+  return c == EOF || isspace(c);
+}
+
+// Bytes of f left from the current position
+static uint64_t remainingBytes(FILE *f) {
+  const long here = ftell(f);
+  if (here < 0 || fseek(f, 0, SEEK_END) != 0)
+    return 0;
+  const long end = ftell(f);
+  fseek(f, here, SEEK_SET);
+  return end > here ? end - here : 0;
+}
+
+bool loadBitmap(const char *path, Bitmap &bitmap, string &error) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    error = strerror(errno);
+    return false;
+  }
+
+  char magic[2];
+  uint64_t width, height, maxValue = 1;
+  const bool ok =
+      fread(magic, 1, 2, f) == 2 && magic[0] == 'P' && magic[1] &&
+      strchr("1245", magic[1]) && readToken(f, width) &&
+      readToken(f, height) &&
+      (magic[1] == '1' || magic[1] == '4' || readToken(f, maxValue));
+  if (!ok || width == 0 || height == 0 || maxValue == 0 ||
+      maxValue > 65535) {
+    fclose(f);
+    error = "not a PBM or PGM bitmap";
+    return false;
+  }
+
+  // Raw rows take a bit or one or two bytes per pixel, plain ones at least
+  // a byte per pixel
+  const uint64_t bytes = maxValue > 255 ? 2 : 1;
+  const uint64_t rowBytes = magic[1] == '4'   ? (width + 7) / 8
+                            : magic[1] == '5' ? width * bytes
+                                              : width;
+  if (height > remainingBytes(f) / rowBytes) {
+    fclose(f);
+    error = "truncated bitmap";
+    return false;
+  }
+
+  // Every format read as one value per pixel, 1 for solid
+  vector<uint8_t> pixels(width * height);
+  bool complete = true;
+  if (magic[1] == '4') {
+    vector<uint8_t> row(rowBytes);
+    for (uint64_t y = 0; y < height && complete; y++) {
+      complete = fread(row.data(), 1, row.size(), f) == row.size();
+      for (uint64_t x = 0; x < width; x++)
+        pixels[y * width + x] = row[x / 8] >> (7 - x % 8) & 1;
+    }
+  } else if (magic[1] == '5') {
+    vector<uint8_t> row(rowBytes);
+    for (uint64_t y = 0; y < height && complete; y++) {
+      complete = fread(row.data(), 1, row.size(), f) == row.size();
+      for (uint64_t x = 0; x < width; x++) {
+        const uint64_t v = bytes == 2 ? row[2 * x] << 8 | row[2 * x + 1]
+                                      : row[x];
+        pixels[y * width + x] = 2 * v < maxValue;
+      }
+    }
+  } else if (magic[1] == '2')
+    for (uint64_t k = 0; k < width * height && complete; k++) {
+      uint64_t v;
+      complete = readToken(f, v);
+      pixels[k] = 2 * v < maxValue;
+    }
+  else
+    // Plain PBM pixels need no whitespace between them
+    for (uint64_t k = 0; k < width * height && complete;) {
+      const int c = fgetc(f);
+      if (c == '#')
+        while (fgetc(f) != '\n' && !feof(f))
+          ;
+      else if (c == '0' || c == '1')
+        pixels[k++] = c == '1';
+      else
+        complete = c != EOF;
+    }
+  fclose(f);
+  if (!complete) {
+    error = "truncated bitmap";
+    return false;
+  }
+
+  bitmap = {width, height, std::move(pixels)};
+  return true;
+}
+
+vector<uint8_t> scaleBitmap(const Bitmap &bitmap, const uint64_t n) {
+  vector<uint8_t> solid(n * n);
+  for (uint64_t j = 0; j < n; j++)
+    for (uint64_t i = 0; i < n; i++)
+      solid[j * n + i] = bitmap.pixels[(j * bitmap.height / n) * bitmap.width +
+                                       i * bitmap.width / n];
+  return solid;
+}
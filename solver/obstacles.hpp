@@ -0,0 +1,70 @@
+#ifndef OBSTACLES_HPP
+#define OBSTACLES_HPP
+
+#include "kernels.hpp"
+#include "sparse.hpp"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Solid cells inside the grid, preprocessed once so the kernels never test
+// a cell: the fluid cells of every row as sorted spans, and the solid cells
+// next to fluid as a flat list, each the weighted sum of up to 4 fluid
+// neighbours. Like the walls, the component of velocity normal to a face is
+// mirrored and everything else copied, averaged over the faces a cell has.
+class Obstacles {
+public:
+  // solid holds n * n flags, row j - 1 holding cells 1 to n of row j
+  Obstacles(const uint64_t n, const std::vector<uint8_t> &solid);
+
+  // Fluid spans of row j, 1 <= j <= n
+  const Span *begin(const uint64_t j) const {
+    return spans.data() + rowSpans[j - 1];
+  }
+  const Span *end(const uint64_t j) const {
+    return spans.data() + rowSpans[j];
+  }
+
+  // Zeroes the solid cells of x, then writes the ones next to fluid from
+  // their neighbours. Run before setBoundary, whose walls may read them.
+  void apply(const Boundary b, float *__restrict x) const;
+
+  // Share of the interior cells that are fluid
+  float fraction() const { return float(fluidCells) / (n * n); }
+  uint64_t boundaryCells() const { return ghosts.size(); }
+
+private:
+  uint64_t n;
+  // Fluid spans of row j are spans[rowSpans[j - 1]] to spans[rowSpans[j]],
+  // solid ones likewise in solidSpans
+  std::vector<uint32_t> rowSpans;
+  std::vector<Span> spans;
+  std::vector<uint32_t> solidRowSpans;
+  std::vector<Span> solidSpans;
+  uint64_t fluidCells = 0;
+
+  // Cell index of every solid cell next to fluid, the cells it reads and
+  // their weight for each Boundary. Unused taps have weight 0.
+  std::vector<uint32_t> ghosts;
+  std::vector<std::array<uint32_t, 4>> taps;
+  std::vector<std::array<float, 4>> weights[3];
+};
+
+// Solid flags of a bitmap, width per row and row after row
+struct Bitmap {
+  uint64_t width, height;
+  std::vector<uint8_t> pixels;
+};
+
+// Reads a PBM or PGM bitmap (P1, P2, P4 or P5), black pixels and gray ones
+// darker than half the maximum are solid. Images the file is too short to
+// hold are rejected before anything is allocated.
+bool loadBitmap(const char *path, Bitmap &bitmap, std::string &error);
+
+// n * n solid flags for Obstacles, scaled from bitmap by nearest neighbour.
+// Image rows are rows j.
+std::vector<uint8_t> scaleBitmap(const Bitmap &bitmap, const uint64_t n);
+
+#endif
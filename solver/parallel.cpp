@@ -0,0 +1,92 @@
+#include "parallel.hpp"
+#include "tasks.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+
+using namespace std;
+
+ThreadPool::ThreadPool(const uint32_t threads) : threads(max(threads, 1u)) {
+  for (uint32_t id = 1; id < this->threads; id++)
+    workers.emplace_back(&ThreadPool::work, this, id);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard lk(m);
+    stop = true;
+  }
+  wake.notify_all();
+  for (auto &w : workers)
+    w.join();
+}
+
+void ThreadPool::runChunk(const uint32_t id) {
+  const uint64_t count = jobEnd - jobBegin;
+  const uint64_t lo = jobBegin + count * id / threads;
+  const uint64_t hi = jobBegin + count * (id + 1) / threads;
+  if (lo < hi)
+    (*job)(lo, hi);
+}
+
+void ThreadPool::work(const uint32_t id) {
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      unique_lock lk(m);
+      wake.wait(lk, [&] { return stop || generation != seen; });
+      if (stop)
+        return;
+      seen = generation;
+    }
+
+    runChunk(id);
+
+    lock_guard lk(m);
+    if (--pending == 0)
+      done.notify_one();
+  }
+}
+
+void ThreadPool::parallelFor(const uint64_t begin, const uint64_t end,
+                             const RangeFn &fn) {
+  // Inside a task the rows become bands of the task scheduler
+  if (TaskScheduler *s = TaskScheduler::current()) {
+    s->parallelFor(begin, end, fn);
+    return;
+  }
+  if (threads == 1 || end - begin < threads) {
+    if (begin < end)
+      fn(begin, end);
+    return;
+  }
+
+  {
+    lock_guard lk(m);
+    job = &fn;
+    jobBegin = begin;
+    jobEnd = end;
+    pending = threads - 1;
+    generation++;
+  }
+  wake.notify_all();
+
+  runChunk(0);
+
+  unique_lock lk(m);
+  done.wait(lk, [&] { return pending == 0; });
+  job = nullptr;
+}
+
+ThreadPool &threadPool(const uint32_t threads) {
+  static thread_local map<uint32_t, unique_ptr<ThreadPool>> pools;
+
+  // Tasks share the scheduler's workers instead of starting their own, they
+  // get the serial pool any caller asking for one thread gets
+  const uint32_t size = TaskScheduler::current() ? 1 : threads;
+  auto &pool = pools[size];
+  if (!pool)
+    pool = make_unique<ThreadPool>(size);
+  return *pool;
+}
@@ -0,0 +1,54 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool used by the solver kernels. Workers are kept alive between
+// calls since a single linearSolve dispatches dozens of parallel sweeps.
+class ThreadPool {
+public:
+  using RangeFn = std::function<void(uint64_t, uint64_t)>;
+
+  explicit ThreadPool(const uint32_t threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  uint32_t size() const { return threads; }
+
+  // Splits [begin, end) in contiguous chunks, one per thread, and blocks
+  // until every chunk is done. The calling thread runs the first chunk.
+  void parallelFor(const uint64_t begin, const uint64_t end, const RangeFn &fn);
+
+private:
+  void work(const uint32_t id);
+  void runChunk(const uint32_t id);
+
+  uint32_t threads;
+  std::vector<std::thread> workers;
+
+  std::mutex m;
+  std::condition_variable wake;
+  std::condition_variable done;
+  uint64_t generation = 0;
+  uint32_t pending = 0;
+  bool stop = false;
+
+  const RangeFn *job = nullptr;
+  uint64_t jobBegin = 0;
+  uint64_t jobEnd = 0;
+};
+
+// Pool of the calling thread for the given amount of threads, created on
+// first use. parallelFor is not reentrant, so threads running solvers
+// concurrently each get their own. Within a TaskScheduler task parallelFor
+// hands the rows to that scheduler instead.
+ThreadPool &threadPool(const uint32_t threads);
+
+#endif
@@ -0,0 +1,251 @@
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Matrix free preconditioned conjugate gradient for the same systems as
+// linearSolve, c * x - a * (neighbours) = xPrev. The ghost cells setBoundary
+// writes only depend on the adjacent interior cell, so they fold into the
+// diagonal and the operator stays symmetric.
+//
+// Vectors keep their ghost cells at zero (r, z, q) or irrelevant (p, x),
+// which lets dot products and updates run over whole contiguous columns.
+
+struct Workspace {
+  uint64_t n = 0;
+  vector<float> r;
+  vector<float> z;
+  vector<float> p;
+  vector<float> q;
+  vector<float> diag;
+  vector<double> colPartial;
+  // Parameters diag was built for
+  Boundary b = Boundary::NONE;
+  float a = NAN;
+  float c = NAN;
+};
+
+// Buffers are only reallocated when the grid size changes
+static Workspace &workspace(const uint64_t n) {
+  static thread_local Workspace ws;
+
+  if (ws.n != n) {
+    const uint64_t size = (n + 2) * (n + 2);
+    ws = Workspace{};
+    ws.n = n;
+    ws.r.resize(size);
+    ws.z.resize(size);
+    ws.p.resize(size);
+    ws.q.resize(size);
+    ws.diag.resize(size);
+    ws.colPartial.resize(n + 2);
+  }
+
+  return ws;
+}
+
+static void buildDiagonal(Workspace &ws, const Boundary b, const float a,
+                          const float c) {
+  if (ws.b == b && ws.a == a && ws.c == c)
+    return;
+
+  const uint64_t n = ws.n;
+  // A ghost copies (+1) or negates (-1) the interior cell next to it
+  const float si = b == Boundary::VERTICAL ? -1 : 1;
+  const float sj = b == Boundary::HORIZONTAL ? -1 : 1;
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++) {
+      float d = c;
+      d -= a * si * ((i == 1) + (i == n));
+      d -= a * sj * ((j == 1) + (j == n));
+      ws.diag[idx(i, j, n)] = d;
+    }
+
+  ws.b = b;
+  ws.a = a;
+  ws.c = c;
+}
+
+// Independent lanes let the loop vectorize without reassociating the sum
+static inline double dotSpan(const float *__restrict x,
+                             const float *__restrict y, const uint64_t len) {
+  constexpr uint64_t LANES = 8;
+  double acc[LANES]{};
+  uint64_t k = 0;
+  for (; k + LANES <= len; k += LANES)
+    for (uint64_t l = 0; l < LANES; l++)
+      acc[l] += double(x[k + l]) * y[k + l];
+  for (; k < len; k++)
+    acc[0] += double(x[k]) * y[k];
+
+  double s = 0;
+  for (uint64_t l = 0; l < LANES; l++)
+    s += acc[l];
+  return s;
+}
+
+// Per column partials summed in order, independent of the thread count
+static double dot(Workspace &ws, const float *__restrict x,
+                  const float *__restrict y, ThreadPool &pool) {
+  const uint64_t n = ws.n;
+  double *__restrict partial = ws.colPartial.data();
+
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t j = jBegin; j < jEnd; j++)
+      partial[j] = dotSpan(x + idx(0, j, n), y + idx(0, j, n), n + 2);
+  });
+
+  double s = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    s += partial[j];
+  return s;
+}
+
+// y += alpha * x over the interior columns
+static void axpy(const uint64_t n, const float alpha, const float *__restrict x,
+                 float *__restrict y, ThreadPool &pool) {
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t k = idx(0, jBegin, n); k < idx(0, jEnd, n); k++)
+      y[k] += alpha * x[k];
+  });
+}
+
+// p = z + beta * p over the interior columns
+static void xpby(const uint64_t n, const float *__restrict z, const float beta,
+                 float *__restrict p, ThreadPool &pool) {
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t k = idx(0, jBegin, n); k < idx(0, jEnd, n); k++)
+      p[k] = z[k] + beta * p[k];
+  });
+}
+
+// q = A * p on the interior, q ghosts are left untouched at zero
+static void apply(const uint64_t n, const Boundary b, const float a,
+                  const float c, float *__restrict p, float *__restrict q,
+                  ThreadPool &pool) {
+  setBoundary(n, b, p);
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t j = jBegin; j < jEnd; j++)
+      for (uint64_t i = 1; i <= n; i++)
+        q[idx(i, j, n)] =
+            c * p[idx(i, j, n)] -
+            a * (p[idx(i - 1, j, n)] + p[idx(i + 1, j, n)] +
+                 p[idx(i, j - 1, n)] + p[idx(i, j + 1, n)]);
+  });
+}
+
+// Symmetric Gauss-Seidel, M = (D + L) D^-1 (D + U). Boundary neighbours are
+// already in the diagonal so the sweeps only read interior cells, relying on
+// the zero ghosts of z.
+static void ssor(const uint64_t n, const float a, const float *__restrict diag,
+                 const float *__restrict r, float *__restrict z) {
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++)
+      z[idx(i, j, n)] =
+          (r[idx(i, j, n)] + a * (z[idx(i - 1, j, n)] + z[idx(i, j - 1, n)])) /
+          diag[idx(i, j, n)];
+
+  for (uint64_t j = n; j >= 1; j--)
+    for (uint64_t i = n; i >= 1; i--)
+      z[idx(i, j, n)] += a * (z[idx(i + 1, j, n)] + z[idx(i, j + 1, n)]) /
+                         diag[idx(i, j, n)];
+}
+
+static void precondition(Workspace &ws, const float a,
+                         const Preconditioner kind, ThreadPool &pool) {
+  const uint64_t n = ws.n;
+  const float *__restrict r = ws.r.data();
+  const float *__restrict diag = ws.diag.data();
+  float *__restrict z = ws.z.data();
+
+  switch (kind) {
+  case Preconditioner::NONE:
+    pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+      for (uint64_t j = jBegin; j < jEnd; j++)
+        for (uint64_t i = 1; i <= n; i++)
+          z[idx(i, j, n)] = r[idx(i, j, n)];
+    });
+    break;
+  case Preconditioner::JACOBI:
+    pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+      for (uint64_t j = jBegin; j < jEnd; j++)
+        for (uint64_t i = 1; i <= n; i++)
+          z[idx(i, j, n)] = r[idx(i, j, n)] / diag[idx(i, j, n)];
+    });
+    break;
+  case Preconditioner::SSOR:
+    ssor(n, a, diag, r, z);
+    break;
+  }
+}
+
+SolveStats conjugateGradientSolve(const uint64_t n, const Boundary b,
+                                  float *__restrict x, float *__restrict xPrev,
+                                  const float a, const float c,
+                                  const SolverConfig &cfg) {
+  PROFILE_ZONE("conjugate_gradient");
+  ThreadPool &pool = threadPool(cfg.threads);
+  Workspace &ws = workspace(n);
+  buildDiagonal(ws, b, a, c);
+
+  float *__restrict r = ws.r.data();
+  float *__restrict z = ws.z.data();
+  float *__restrict p = ws.p.data();
+  float *__restrict q = ws.q.data();
+
+  // The pressure system (Neumann walls, c = 4a) is singular and only has a
+  // solution for a zero mean right hand side
+  if (b == Boundary::NONE && c == 4 * a) {
+    double sum = 0;
+    for (uint64_t j = 1; j <= n; j++)
+      for (uint64_t i = 1; i <= n; i++)
+        sum += xPrev[idx(i, j, n)];
+    const float mean = sum / (n * n);
+    for (uint64_t j = 1; j <= n; j++)
+      for (uint64_t i = 1; i <= n; i++)
+        xPrev[idx(i, j, n)] -= mean;
+  }
+
+  // r = xPrev - A x
+  apply(n, b, a, c, x, q, pool);
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++)
+      r[idx(i, j, n)] = xPrev[idx(i, j, n)] - q[idx(i, j, n)];
+
+  // Residuals are relative to the right hand side unless it vanishes
+  double b2 = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (uint64_t i = 1; i <= n; i++)
+      b2 += xPrev[idx(i, j, n)] * xPrev[idx(i, j, n)];
+  const double scale = b2 > 0 ? 1 / sqrt(b2) : 1;
+
+  precondition(ws, a, cfg.preconditioner, pool);
+  xpby(n, z, 0, p, pool);
+  double rz = dot(ws, r, z, pool);
+
+  SolveStats stats{0, float(sqrt(dot(ws, r, r, pool)) * scale)};
+  while (stats.iterations < cfg.maxIterations && rz > 0) {
+    apply(n, b, a, c, p, q, pool);
+    const double alpha = rz / dot(ws, p, q, pool);
+    axpy(n, alpha, p, x, pool);
+    axpy(n, -alpha, q, r, pool);
+    stats.iterations++;
+
+    stats.residual = sqrt(dot(ws, r, r, pool)) * scale;
+    if (cfg.tolerance > 0 && stats.residual <= cfg.tolerance)
+      break;
+
+    precondition(ws, a, cfg.preconditioner, pool);
+    const double rzNext = dot(ws, r, z, pool);
+    xpby(n, z, rzNext / rz, p, pool);
+    rz = rzNext;
+  }
+
+  setBoundary(n, b, x);
+  return stats;
+}
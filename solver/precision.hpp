@@ -0,0 +1,80 @@
+#ifndef PRECISION_HPP
+#define PRECISION_HPP
+
+#include <bit>
+#include <cstdint>
+
+// 16 bit storage formats. Kernels templated on the element type load them
+// as float, compute in float and round back on store, so T(x) and the
+// implicit conversion are the only places the format shows up and the float
+// instantiation compiles to exactly the fp32 code. Conversions are branch
+// free so loops over them still vectorize.
+
+// IEEE half, rounded to nearest even, overflow goes to infinity and NaNs
+// stay NaNs
+static inline uint16_t toHalf(const float f) {
+  const uint32_t x = std::bit_cast<uint32_t>(f);
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const uint32_t abs = x & 0x7fffffff;
+
+  // Subnormal halves count units of 2^-24, adding 0.5 lines them up with
+  // the low mantissa bits and the float adder does the rounding
+  const uint32_t magic = (127 - 15 + 23 - 10 + 1) << 23;
+  const uint32_t subnormal =
+      std::bit_cast<uint32_t>(std::bit_cast<float>(abs) +
+                              std::bit_cast<float>(magic)) -
+      magic;
+  // Rebias and round the 13 dropped bits, a carry out of the mantissa bumps
+  // the exponent, up to infinity
+  const uint32_t normal =
+      (abs + ((15u - 127u) << 23) + 0xfff + ((abs >> 13) & 1)) >> 13;
+  const uint32_t special = abs > 0x7f800000 ? 0x7e00 : 0x7c00;
+
+  const uint32_t isSpecial = -uint32_t(abs >= 0x47800000);
+  const uint32_t isSubnormal = -uint32_t(abs < 0x38800000);
+  const uint32_t h = (special & isSpecial) | (subnormal & isSubnormal) |
+                     (normal & ~(isSpecial | isSubnormal));
+  return uint16_t(sign | h);
+}
+
+static inline float fromHalf(const uint16_t h) {
+  // Scaling by 2^112 rebiases the exponent and normalizes subnormals
+  const uint32_t bits = uint32_t(h & 0x7fff) << 13;
+  const float scaled = std::bit_cast<float>(bits) * 0x1p112f;
+  const uint32_t isSpecial = -uint32_t((h & 0x7c00) == 0x7c00);
+  const uint32_t abs = ((bits | 0x7f800000) & isSpecial) |
+                       (std::bit_cast<uint32_t>(scaled) & ~isSpecial);
+  return std::bit_cast<float>(abs | uint32_t(h & 0x8000) << 16);
+}
+
+// The upper half of a float, rounded to nearest even. NaNs are kept quiet
+// so rounding can't turn them into infinities.
+static inline uint16_t toBFloat16(const float f) {
+  const uint32_t x = std::bit_cast<uint32_t>(f);
+  const uint32_t rounded = (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+  return uint16_t((x & 0x7fffffff) > 0x7f800000 ? (x >> 16) | 0x40 : rounded);
+}
+
+static inline float fromBFloat16(const uint16_t b) {
+  return std::bit_cast<float>(uint32_t(b) << 16);
+}
+
+// 5 exponent and 10 mantissa bits, about 3 decimal digits up to 65504
+struct Half {
+  uint16_t bits;
+
+  Half() = default;
+  explicit Half(const float f) : bits(toHalf(f)) {}
+  operator float() const { return fromHalf(bits); }
+};
+
+// The exponent range of float with 7 mantissa bits, about 2 decimal digits
+struct BFloat16 {
+  uint16_t bits;
+
+  BFloat16() = default;
+  explicit BFloat16(const float f) : bits(toBFloat16(f)) {}
+  operator float() const { return fromBFloat16(bits); }
+};
+
+#endif
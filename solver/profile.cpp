@@ -0,0 +1,233 @@
+#include "profile.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <memory>
+#include <mutex>
+#include <print>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace profile {
+
+// Zones past the last slot are merged into it
+static constexpr uint32_t MAX_ZONES = 128;
+static constexpr uint32_t COUNTERS = 3;
+
+struct ZoneInfo {
+  const char *name;
+  atomic<uint64_t> count;
+  atomic<uint64_t> ns;
+  atomic<uint64_t> counters[COUNTERS];
+  // Totals handed out by the previous collect
+  uint64_t reported[2 + COUNTERS];
+};
+
+static ZoneInfo zones[MAX_ZONES];
+static uint32_t zoneCount = 0;
+static mutex zonesMutex;
+
+static atomic<bool> countersEnabled = false;
+
+// Per thread group of counters, the leader counts cycles
+struct ThreadCounters {
+  bool opened = false;
+  bool ok = false;
+  int fds[COUNTERS] = {-1, -1, -1};
+
+  ~ThreadCounters() {
+    for (const int fd : fds)
+      if (fd >= 0)
+        close(fd);
+  }
+};
+
+static thread_local ThreadCounters threadCounters;
+
+struct Event {
+  uint32_t id;
+  uint64_t begin;
+  uint64_t end;
+};
+
+// Kept alive past the thread so its events can still be written
+struct ThreadTrace {
+  uint32_t tid;
+  vector<Event> events;
+};
+
+static atomic<bool> tracing = false;
+static atomic<uint64_t> traceEvents = 0;
+static uint64_t traceLimit = 0;
+static uint64_t traceStart = 0;
+static mutex tracesMutex;
+static vector<shared_ptr<ThreadTrace>> traces;
+static thread_local shared_ptr<ThreadTrace> threadTrace;
+
+static uint64_t now() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Generic cache misses, which the kernel maps to the last level cache on the
+// common PMUs
+static bool openCounters(ThreadCounters &tc) {
+  static constexpr uint64_t EVENTS[COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES,
+  };
+
+  for (uint32_t k = 0; k < COUNTERS; k++) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = EVENTS[k];
+    attr.disabled = k == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    tc.fds[k] = syscall(SYS_perf_event_open, &attr, 0, -1,
+                        k == 0 ? -1 : tc.fds[0], PERF_FLAG_FD_CLOEXEC);
+    if (tc.fds[k] < 0)
+      return false;
+  }
+
+  ioctl(tc.fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(tc.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+static void readCounters(uint64_t (&out)[COUNTERS]) {
+  ThreadCounters &tc = threadCounters;
+  if (!tc.opened) {
+    tc.opened = true;
+    tc.ok = openCounters(tc);
+  }
+
+  struct {
+    uint64_t nr;
+    uint64_t values[COUNTERS];
+  } group;
+  if (!tc.ok || read(tc.fds[0], &group, sizeof(group)) != sizeof(group)) {
+    fill(begin(out), end(out), 0);
+    return;
+  }
+  copy(begin(group.values), end(group.values), out);
+}
+
+static ThreadTrace &trace() {
+  if (!threadTrace) {
+    threadTrace = make_shared<ThreadTrace>();
+    lock_guard lk(tracesMutex);
+    threadTrace->tid = traces.size() + 1;
+    traces.push_back(threadTrace);
+  }
+  return *threadTrace;
+}
+
+bool enableCounters() {
+  uint64_t probe[COUNTERS];
+  readCounters(probe);
+  if (!threadCounters.ok)
+    return false;
+  countersEnabled = true;
+  return true;
+}
+
+void enableTrace(const uint64_t maxEvents) {
+  traceLimit = maxEvents;
+  traceStart = now();
+  tracing = true;
+}
+
+uint32_t zone(const char *name) {
+  lock_guard lk(zonesMutex);
+  for (uint32_t k = 0; k < zoneCount; k++)
+    if (strcmp(zones[k].name, name) == 0)
+      return k;
+  if (zoneCount == MAX_ZONES)
+    return MAX_ZONES - 1;
+
+  zones[zoneCount].name = name;
+  return zoneCount++;
+}
+
+Zone::Zone(const uint32_t id) : id(id) {
+  if (countersEnabled.load(memory_order_relaxed))
+    readCounters(counters);
+  begin = now();
+}
+
+Zone::~Zone() {
+  const uint64_t end = now();
+  ZoneInfo &z = zones[id];
+  z.count.fetch_add(1, memory_order_relaxed);
+  z.ns.fetch_add(end - begin, memory_order_relaxed);
+
+  if (countersEnabled.load(memory_order_relaxed)) {
+    uint64_t after[COUNTERS];
+    readCounters(after);
+    for (uint32_t k = 0; k < COUNTERS; k++)
+      z.counters[k].fetch_add(after[k] - counters[k], memory_order_relaxed);
+  }
+
+  if (tracing.load(memory_order_relaxed) &&
+      traceEvents.fetch_add(1, memory_order_relaxed) < traceLimit)
+    trace().events.push_back({id, begin, end});
+}
+
+vector<ZoneStats> collect() {
+  lock_guard lk(zonesMutex);
+  vector<ZoneStats> stats;
+  for (uint32_t k = 0; k < zoneCount; k++) {
+    ZoneInfo &z = zones[k];
+    uint64_t totals[2 + COUNTERS] = {z.count.load(), z.ns.load()};
+    for (uint32_t c = 0; c < COUNTERS; c++)
+      totals[2 + c] = z.counters[c].load();
+
+    uint64_t delta[2 + COUNTERS];
+    for (uint32_t c = 0; c < 2 + COUNTERS; c++) {
+      delta[c] = totals[c] - z.reported[c];
+      z.reported[c] = totals[c];
+    }
+    if (delta[0] > 0)
+      stats.push_back({z.name, delta[0],
+                       chrono::nanoseconds(delta[1]), delta[2], delta[3],
+                       delta[4]});
+  }
+  return stats;
+}
+
+bool writeTrace(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+
+  lock_guard lk(tracesMutex);
+  lock_guard zonesLk(zonesMutex);
+  print(f, R"({{"displayTimeUnit": "ns", "traceEvents": [)");
+  bool first = true;
+  for (const auto &t : traces)
+    for (const Event &e : t->events) {
+      if (e.begin < traceStart)
+        continue;
+      print(f,
+            R"({}
+{{"name": "{}", "ph": "X", "pid": 1, "tid": {}, "ts": {:.3f}, )"
+            R"("dur": {:.3f}}})",
+            first ? "" : ",", zones[e.id].name, t->tid,
+            (e.begin - traceStart) / 1e3, (e.end - e.begin) / 1e3);
+      first = false;
+    }
+  println(f, "\n]}}");
+  return fclose(f) == 0;
+}
+
+} // namespace profile
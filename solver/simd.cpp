@@ -0,0 +1,467 @@
+#include "backend.hpp"
+#include "kernels.hpp"
+#include "precision.hpp"
+#include "solver.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <experimental/simd>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Explicitly vectorized counterpart of generic.cpp. Every loop runs j outer
+// and i inner, the contiguous axis of idx(), so the lanes of a vector are
+// consecutive cells of one column. The width follows the target flags:
+// AVX-512, AVX2, NEON or SSE via std::experimental::simd.
+//
+// Gather indices are 32 bit, so n must stay below 46340.
+//
+// Kernels are templated on the element type of the fields like the generic
+// ones, 16 bit formats are widened by load and rounded by store.
+//
+// Each variant is a module built with its own target flags and hidden
+// visibility, so inline functions it instantiates can never replace the
+// baseline ones of the executable.
+
+namespace simd {
+
+namespace stdx = std::experimental;
+using floatv = stdx::native_simd<float>;
+using intv = stdx::rebind_simd_t<int32_t, floatv>;
+
+static constexpr uint64_t W = floatv::size();
+
+static inline floatv load(const float *p) {
+  return floatv(p, stdx::element_aligned);
+}
+
+static inline void store(const floatv &v, float *p) {
+  v.copy_to(p, stdx::element_aligned);
+}
+
+static inline floatv gather(const float *__restrict base, const intv &index) {
+#if defined(__AVX512F__)
+  return floatv(_mm512_i32gather_ps(static_cast<__m512i>(index), base, 4));
+#elif defined(__AVX2__)
+  return floatv(_mm256_i32gather_ps(base, static_cast<__m256i>(index), 4));
+#else
+  return floatv([&](auto l) { return base[index[l]]; });
+#endif
+}
+
+// base[index] and base[index + 1], the horizontal neighbours bilinear
+// interpolation reads together
+static inline void gatherPair(const float *__restrict base, const intv &index,
+                              floatv &lo, floatv &hi) {
+  lo = gather(base, index);
+  hi = gather(base, index + 1);
+}
+
+// The 16 bit formats round to nearest even as precision.hpp does, F16C only
+// differs in keeping NaN payloads. Pairs are adjacent, so one 32 bit gather
+// fetches both.
+#if defined(__AVX512F__)
+static inline __m512i bfloat16Bits(const floatv &v) {
+  const __m512i x = _mm512_castps_si512(static_cast<__m512>(v));
+  const __m512i high = _mm512_srli_epi32(x, 16);
+  const __m512i rounded = _mm512_srli_epi32(
+      _mm512_add_epi32(
+          x, _mm512_add_epi32(_mm512_set1_epi32(0x7fff),
+                              _mm512_and_si512(high, _mm512_set1_epi32(1)))),
+      16);
+  const __mmask16 nan = _mm512_cmpgt_epu32_mask(
+      _mm512_and_si512(x, _mm512_set1_epi32(0x7fffffff)),
+      _mm512_set1_epi32(0x7f800000));
+  return _mm512_mask_blend_epi32(
+      nan, rounded, _mm512_or_si512(high, _mm512_set1_epi32(0x40)));
+}
+
+static inline floatv load(const Half *p) {
+  return floatv(_mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)p)));
+}
+
+static inline void store(const floatv &v, Half *p) {
+  _mm256_storeu_si256(
+      (__m256i *)p, _mm512_cvtps_ph(static_cast<__m512>(v),
+                                    _MM_FROUND_TO_NEAREST_INT |
+                                        _MM_FROUND_NO_EXC));
+}
+
+static inline floatv load(const BFloat16 *p) {
+  const __m512i bits =
+      _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)p));
+  return floatv(_mm512_castsi512_ps(_mm512_slli_epi32(bits, 16)));
+}
+
+static inline void store(const floatv &v, BFloat16 *p) {
+  _mm256_storeu_si256((__m256i *)p, _mm512_cvtepi32_epi16(bfloat16Bits(v)));
+}
+
+static inline void gatherPair(const Half *__restrict base, const intv &index,
+                              floatv &lo, floatv &hi) {
+  const __m512i pairs =
+      _mm512_i32gather_epi32(static_cast<__m512i>(index), base, 2);
+  lo = floatv(_mm512_cvtph_ps(_mm512_cvtepi32_epi16(pairs)));
+  hi = floatv(
+      _mm512_cvtph_ps(_mm512_cvtepi32_epi16(_mm512_srli_epi32(pairs, 16))));
+}
+
+static inline void gatherPair(const BFloat16 *__restrict base,
+                              const intv &index, floatv &lo, floatv &hi) {
+  const __m512i pairs =
+      _mm512_i32gather_epi32(static_cast<__m512i>(index), base, 2);
+  lo = floatv(_mm512_castsi512_ps(_mm512_slli_epi32(pairs, 16)));
+  hi = floatv(_mm512_castsi512_ps(
+      _mm512_and_si512(pairs, _mm512_set1_epi32(0xffff0000))));
+}
+#elif defined(__AVX2__)
+static inline __m256i bfloat16Bits(const floatv &v) {
+  const __m256i x = _mm256_castps_si256(static_cast<__m256>(v));
+  const __m256i high = _mm256_srli_epi32(x, 16);
+  const __m256i rounded = _mm256_srli_epi32(
+      _mm256_add_epi32(
+          x, _mm256_add_epi32(_mm256_set1_epi32(0x7fff),
+                              _mm256_and_si256(high, _mm256_set1_epi32(1)))),
+      16);
+  // Both sides are below 2^31, the signed compare orders them
+  const __m256i nan = _mm256_cmpgt_epi32(
+      _mm256_and_si256(x, _mm256_set1_epi32(0x7fffffff)),
+      _mm256_set1_epi32(0x7f800000));
+  return _mm256_blendv_epi8(rounded,
+                            _mm256_or_si256(high, _mm256_set1_epi32(0x40)),
+                            nan);
+}
+
+// The low 16 bits of every lane of lo then of hi, packus works per 128 bit
+// lane and the permute puts its quarters back in order
+static inline __m256i packLow16(const __m256i lo, const __m256i hi) {
+  return _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi),
+                                  _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static inline floatv load(const Half *p) {
+  return floatv(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p)));
+}
+
+static inline void store(const floatv &v, Half *p) {
+  _mm_storeu_si128((__m128i *)p,
+                   _mm256_cvtps_ph(static_cast<__m256>(v),
+                                   _MM_FROUND_TO_NEAREST_INT |
+                                       _MM_FROUND_NO_EXC));
+}
+
+static inline floatv load(const BFloat16 *p) {
+  const __m256i bits =
+      _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p));
+  return floatv(_mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)));
+}
+
+static inline void store(const floatv &v, BFloat16 *p) {
+  const __m256i bits = bfloat16Bits(v);
+  _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(packLow16(bits, bits)));
+}
+
+static inline void gatherPair(const Half *__restrict base, const intv &index,
+                              floatv &lo, floatv &hi) {
+  const __m256i pairs = _mm256_i32gather_epi32(
+      (const int *)base, static_cast<__m256i>(index), 2);
+  const __m256i halves =
+      packLow16(_mm256_and_si256(pairs, _mm256_set1_epi32(0xffff)),
+                _mm256_srli_epi32(pairs, 16));
+  lo = floatv(_mm256_cvtph_ps(_mm256_castsi256_si128(halves)));
+  hi = floatv(_mm256_cvtph_ps(_mm256_extracti128_si256(halves, 1)));
+}
+
+static inline void gatherPair(const BFloat16 *__restrict base,
+                              const intv &index, floatv &lo, floatv &hi) {
+  const __m256i pairs = _mm256_i32gather_epi32(
+      (const int *)base, static_cast<__m256i>(index), 2);
+  lo = floatv(_mm256_castsi256_ps(_mm256_slli_epi32(pairs, 16)));
+  hi = floatv(_mm256_castsi256_ps(
+      _mm256_and_si256(pairs, _mm256_set1_epi32(0xffff0000))));
+}
+#else
+template <typename T> static inline floatv load(const T *p) {
+  return floatv([&](auto l) { return float(p[l]); });
+}
+
+template <typename T> static inline void store(const floatv &v, T *p) {
+  for (uint64_t l = 0; l < W; l++)
+    p[l] = T(v[l]);
+}
+
+template <typename T>
+static inline void gatherPair(const T *__restrict base, const intv &index,
+                              floatv &lo, floatv &hi) {
+  lo = floatv([&](auto l) { return float(base[index[l]]); });
+  hi = floatv([&](auto l) { return float(base[index[l] + 1]); });
+}
+#endif
+
+template <typename T>
+static void add_source(const uint64_t n, T *__restrict x, T *__restrict s,
+                       const float dt) {
+  const uint64_t size = (n + 2) * (n + 2);
+
+  uint64_t k = 0;
+  for (; k + W <= size; k += W)
+    store(load(x + k) + dt * load(s + k), x + k);
+  for (; k < size; k++)
+    x[k] = T(x[k] + dt * s[k]);
+}
+
+// Scalar bilinear back trace, used for the cells left after the last vector
+template <bool periodic, typename T>
+static inline float advectCell(const uint64_t n, const uint64_t i,
+                               const uint64_t j, const T *__restrict dPrev,
+                               const T *__restrict vx, const T *__restrict vy,
+                               const float dt0) {
+  float x = i - dt0 * vx[idx(i, j, n)];
+  float y = j - dt0 * vy[idx(i, j, n)];
+  if constexpr (periodic) {
+    x -= n * floor((x - .5f) / n);
+    y -= n * floor((y - .5f) / n);
+  }
+  x = clamp(x, 0.5f, n + .5f);
+  y = clamp(y, 0.5f, n + .5f);
+
+  const uint32_t i0 = (uint32_t)x;
+  const uint32_t j0 = (uint32_t)y;
+
+  const float s1 = x - i0;
+  const float s0 = 1.f - s1;
+  const float t1 = y - j0;
+  const float t0 = 1.f - t1;
+
+  return s0 * (t0 * dPrev[idx(i0, j0, n)] + t1 * dPrev[idx(i0, j0 + 1, n)]) +
+         s1 * (t0 * dPrev[idx(i0 + 1, j0, n)] +
+               t1 * dPrev[idx(i0 + 1, j0 + 1, n)]);
+}
+
+// Back traces cells [iBegin, iEnd) of row j of d along (vx, vy) and
+// interpolates dPrev there, returns the largest result or 0. Traces leaving
+// a periodic grid come back in from the other side.
+template <bool periodic = false, typename T>
+static inline float advectRow(const uint64_t n, const uint64_t j,
+                              const uint64_t iBegin, const uint64_t iEnd,
+                              T *__restrict d, const T *__restrict dPrev,
+                              const T *__restrict vx, const T *__restrict vy,
+                              const float dt0) {
+  const int32_t stride = n + 2;
+  const floatv lane([](auto l) { return float(l); });
+  const floatv lo = .5f;
+  const floatv hi = n + .5f;
+  floatv peakv = 0.f;
+  float peak = 0;
+
+  uint64_t i = iBegin;
+  for (; i + W <= iEnd; i += W) {
+    const uint64_t k = idx(i, j, n);
+    floatv x = lane + float(i) - dt0 * load(vx + k);
+    floatv y = float(j) - dt0 * load(vy + k);
+    if constexpr (periodic) {
+      x -= float(n) * stdx::floor((x - lo) / float(n));
+      y -= float(n) * stdx::floor((y - lo) / float(n));
+    }
+    x = stdx::clamp(x, lo, hi);
+    y = stdx::clamp(y, lo, hi);
+
+    // x and y are positive, truncation is the floor
+    const intv i0 = stdx::static_simd_cast<intv>(x);
+    const intv j0 = stdx::static_simd_cast<intv>(y);
+
+    const floatv s1 = x - stdx::static_simd_cast<floatv>(i0);
+    const floatv s0 = 1.f - s1;
+    const floatv t1 = y - stdx::static_simd_cast<floatv>(j0);
+    const floatv t0 = 1.f - t1;
+
+    const intv k00 = i0 + stride * j0;
+    floatv d00, d10, d01, d11;
+    gatherPair(dPrev, k00, d00, d10);
+    gatherPair(dPrev, k00 + stride, d01, d11);
+    const floatv d0 = t0 * d00 + t1 * d01;
+    const floatv d1 = t0 * d10 + t1 * d11;
+    const floatv v = s0 * d0 + s1 * d1;
+    store(v, d + k);
+    peakv = stdx::max(peakv, v);
+  }
+  for (; i < iEnd; i++) {
+    d[idx(i, j, n)] = T(advectCell<periodic>(n, i, j, dPrev, vx, vy, dt0));
+    peak = max(peak, float(d[idx(i, j, n)]));
+  }
+  // Rounding is monotonic, the rounded peak is the peak of what was stored
+  return float(T(max(peak, stdx::hmax(peakv))));
+}
+
+template <typename T>
+static float advect(const uint64_t n, const Boundary b, T *__restrict d,
+                    T *__restrict dPrev, T *__restrict vx, T *__restrict vy,
+                    const float dt) {
+  const float dt0 = dt * n;
+  const float stale = beginBoundary(n, d);
+  float peak = 0;
+  for (uint64_t j = 1; j <= n; j++) {
+    peak = max(peak, b == Boundary::PERIODIC
+                         ? advectRow<true>(n, j, 1, n + 1, d, dPrev, vx, vy,
+                                           dt0)
+                         : advectRow(n, j, 1, n + 1, d, dPrev, vx, vy, dt0));
+    setColumnWalls(n, b, d, j);
+  }
+  endBoundary(n, b, d, stale);
+  return peak;
+}
+
+static float advectActive(const uint64_t n, const Boundary b,
+                          float *__restrict d, float *__restrict dPrev,
+                          float *__restrict vx, float *__restrict vy,
+                          const float dt, const ActiveBricks &active) {
+  const float dt0 = dt * n;
+  float peak = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (const Span *p = active.begin(j); p != active.end(j); p++)
+      peak = max(peak,
+                 advectRow(n, j, p->begin, p->end, d, dPrev, vx, vy, dt0));
+
+  setBoundary(n, b, d);
+  return peak;
+}
+
+// Row j of the divergence with its walls and the zeroed pressure, reads rows
+// j - 1 to j + 1 of vy
+template <typename T, typename P>
+static inline void divergenceRow(const uint64_t n, const uint64_t j,
+                                 const T *__restrict vx, const T *__restrict vy,
+                                 P *__restrict pressure,
+                                 P *__restrict divergence) {
+  const uint64_t stride = n + 2;
+  const float h = -.5f / n;
+
+  uint64_t i = 1;
+  for (; i + W <= n + 1; i += W) {
+    const uint64_t k = idx(i, j, n);
+    store(h * (load(vx + k + 1) - load(vx + k - 1) + load(vy + k + stride) -
+               load(vy + k - stride)),
+          divergence + k);
+    store(floatv(0.f), pressure + k);
+  }
+  for (; i <= n; i++) {
+    const uint64_t k = idx(i, j, n);
+    divergence[k] =
+        P(h * (vx[k + 1] - vx[k - 1] + vy[k + stride] - vy[k - stride]));
+    pressure[k] = P(0);
+  }
+  setColumnWalls(n, Boundary::NONE, divergence, j);
+  setColumnWalls(n, Boundary::NONE, pressure, j);
+}
+
+// Divergence with its walls and the zeroed pressure in a single pass
+template <typename T, typename P>
+static void divergence(const uint64_t n, T *__restrict vx, T *__restrict vy,
+                       P *__restrict pressure, P *__restrict divergence) {
+  for (uint64_t j = 1; j <= n; j++)
+    divergenceRow(n, j, vx, vy, pressure, divergence);
+
+  setBoundaryRows(n, Boundary::NONE, pressure);
+  setBoundaryRows(n, Boundary::NONE, divergence);
+}
+
+// The walls go in as each row finishes
+template <typename T, typename P>
+static float subtractGradient(const uint64_t n, T *__restrict vx,
+                              T *__restrict vy, P *__restrict pressure) {
+  const uint64_t stride = n + 2;
+  const float g = .5f * n;
+  const float staleX = beginBoundary(n, vx);
+  const float staleY = beginBoundary(n, vy);
+  floatv speed2v = 0.f;
+  float speed2 = 0;
+  for (uint64_t j = 1; j <= n; j++) {
+    uint64_t i = 1;
+    for (; i + W <= n + 1; i += W) {
+      const uint64_t k = idx(i, j, n);
+      floatv x =
+          load(vx + k) - g * (load(pressure + k + 1) - load(pressure + k - 1));
+      floatv y =
+          load(vy + k) -
+          g * (load(pressure + k + stride) - load(pressure + k - stride));
+      store(x, vx + k);
+      store(y, vy + k);
+      // The speed of what was stored
+      if constexpr (!is_same_v<T, float>) {
+        x = load(vx + k);
+        y = load(vy + k);
+      }
+      speed2v = stdx::max(speed2v, x * x + y * y);
+    }
+    for (; i <= n; i++) {
+      const uint64_t k = idx(i, j, n);
+      vx[k] = T(vx[k] - g * (pressure[k + 1] - pressure[k - 1]));
+      vy[k] = T(vy[k] - g * (pressure[k + stride] - pressure[k - stride]));
+      const float x = vx[k];
+      const float y = vy[k];
+      speed2 = max(speed2, x * x + y * y);
+    }
+    setColumnWalls(n, Boundary::VERTICAL, vx, j);
+    setColumnWalls(n, Boundary::HORIZONTAL, vy, j);
+  }
+  endBoundary(n, Boundary::VERTICAL, vx, staleX);
+  endBoundary(n, Boundary::HORIZONTAL, vy, staleY);
+  return max(speed2, stdx::hmax(speed2v));
+}
+
+// Divergence of row j - 1 is complete once row j of vy is advected. Row 0 of
+// vy is written early for the first one, the last waits for the boundary.
+static void advectVelocity(const uint64_t n, float *__restrict vx,
+                           float *__restrict vy, float *__restrict vx0,
+                           float *__restrict vy0, float *__restrict pressure,
+                           float *__restrict divergence, const float dt) {
+  const float dt0 = dt * n;
+  const float staleX = beginBoundary(n, vx);
+  const float staleY = beginBoundary(n, vy);
+  for (uint64_t j = 1; j <= n; j++) {
+    advectRow(n, j, 1, n + 1, vx, vx0, vx0, vy0, dt0);
+    advectRow(n, j, 1, n + 1, vy, vy0, vx0, vy0, dt0);
+    setColumnWalls(n, Boundary::VERTICAL, vx, j);
+    setColumnWalls(n, Boundary::HORIZONTAL, vy, j);
+    if (j == 1)
+      for (uint64_t i = 1; i <= n; i++)
+        vy[idx(i, 0, n)] = -vy[idx(i, 1, n)];
+    else
+      divergenceRow(n, j - 1, vx, vy, pressure, divergence);
+  }
+  endBoundary(n, Boundary::VERTICAL, vx, staleX);
+  endBoundary(n, Boundary::HORIZONTAL, vy, staleY);
+  divergenceRow(n, n, vx, vy, pressure, divergence);
+
+  setBoundaryRows(n, Boundary::NONE, pressure);
+  setBoundaryRows(n, Boundary::NONE, divergence);
+}
+
+} // namespace simd
+
+extern "C" __attribute__((visibility("default"))) const SolverBackend *
+navierStokesSolverBackend() {
+  static const SolverBackend backend{
+      SOLVER_BACKEND_NAME,
+      simd::add_source<float>,
+      simd::advect<float>,
+      simd::divergence<float, float>,
+      simd::subtractGradient<float, float>,
+      simd::advectVelocity,
+      simd::advectActive,
+      {simd::add_source<Half>, simd::advect<Half>,
+       simd::divergence<Half, float>, simd::divergence<Half, Half>,
+       simd::subtractGradient<Half, float>,
+       simd::subtractGradient<Half, Half>},
+      {simd::add_source<BFloat16>, simd::advect<BFloat16>,
+       simd::divergence<BFloat16, float>, simd::divergence<BFloat16, BFloat16>,
+       simd::subtractGradient<BFloat16, float>,
+       simd::subtractGradient<BFloat16, BFloat16>}};
+  return &backend;
+}
@@ -1,14 +1,279 @@
 #ifndef SOLVER_HPP
 #define SOLVER_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
 
-void velocityStep(const uint64_t n, float *__restrict vx, float *__restrict vy,
-                  float *__restrict vxPrev, float *__restrict vyPrev,
-                  const float visc, const float dt);
+enum class LinearSolver { GAUSS_SEIDEL = 0, RED_BLACK = 1, TILED = 2 };
 
-void densityStep(const uint64_t n, float *__restrict d, float *__restrict dPrev,
-                 float *__restrict vx, float *__restrict vy, const float diff,
-                 const float dt);
+enum class PressureSolver { LINEAR = 0, MULTIGRID = 1, CONJUGATE_GRADIENT = 2 };
+
+enum class DiffusionSolver { LINEAR = 0, CONJUGATE_GRADIENT = 1 };
+
+enum class Preconditioner { NONE = 0, JACOBI = 1, SSOR = 2 };
+
+enum class Storage { FP32 = 0, FP16 = 1, BF16 = 2 };
+
+struct SolverConfig {
+  LinearSolver linearSolver = LinearSolver::GAUSS_SEIDEL;
+  // Threads used by the parallel solvers, results don't depend on it
+  uint32_t threads = 1;
+  // Sweeps stop once the residual relative to the right hand side drops
+  // below tolerance, with 0 every solve runs exactly maxIterations
+  float tolerance = 0;
+  uint32_t maxIterations = 20;
+  // Sweeps the tiled solver fuses in one pass over the grid, it keeps about
+  // 2 * tileDepth columns of (n + 2) floats in cache
+  uint32_t tileDepth = 4;
+  // Sweeps on 128, 256, 512, 1024 and 2048 grids use code compiled for that
+  // size, turning it off forces the generic runtime size path
+  bool fixedGrid = true;
+  // project either runs linearSolve or V-cycles smoothed by it, in which case
+  // the tolerance applies per cycle and maxCycles caps them
+  PressureSolver pressureSolver = PressureSolver::LINEAR;
+  uint32_t maxCycles = 8;
+  // diffuse and project can each use conjugate gradient instead, capped by
+  // maxIterations as well
+  DiffusionSolver diffusionSolver = DiffusionSolver::LINEAR;
+  Preconditioner preconditioner = Preconditioner::JACOBI;
+  // densityStep only visits bricks of sparseBrick x sparseBrick cells where
+  // the density or its source reach sparseThreshold, grown by how far the
+  // step can carry them. Bricks that go quiet are zeroed, so results only
+  // differ from the dense step by about the threshold. Diffusion then always
+  // relaxes in place (Gauss-Seidel or red-black order) in fp32.
+  bool sparse = false;
+  uint32_t sparseBrick = 32;
+  float sparseThreshold = 1e-4f;
+  // Steps merge passes over the grid: the sources are added by the first
+  // diffusion sweep and both velocity advections also compute the
+  // divergence of the second projection. Every cell sees the same
+  // operations in the same order, so results match the unfused steps.
+  bool fused = false;
+  // Steps start by adding dt times the source buffers to the fields. Without
+  // sources they skip those passes, the fields then only take what
+  // FluidSolver::inject puts into them and the diffusion solves start from
+  // whatever the previous step left in the back buffers.
+  bool sources = true;
+  // FluidSolver::step runs the kernels of both steps as a task graph on a
+  // work stealing scheduler of threads workers: the density diffusion
+  // overlaps the velocity step, both velocity advections run side by side
+  // and the parallel solvers split their rows in bands any idle worker can
+  // take. Each task sees the same inputs, so results match.
+  bool tasks = false;
+  // The grid wraps around instead of having walls: ghost cells copy the
+  // opposite edge, advection traces come back in from the other side, and
+  // diffusion and projection are solved exactly by FFT (SpectralSolver)
+  // rather than relaxed. Needs n to be a power of two from 4 on, other
+  // grids keep the walls. Periodic steps ignore fused, sparse, tasks and
+  // obstacles.
+  bool periodic = false;
+  // Element type of the fields in the FluidSolver arena, fixed when it is
+  // built. FP16 and BF16 halve the memory and bandwidth of vx, vy, density
+  // and their back buffers: the backend kernels widen them to float in
+  // registers and round what they store. Those steps are unfused, dense and
+  // without tasks, diffuse with the linear sweeps and ignore periodic and
+  // obstacles. Pressure and divergence stay fp32, and the pressure solver
+  // choice with them, unless compactPressure stores them in the same format
+  // and relaxes them with linear sweeps as well.
+  Storage storage = Storage::FP32;
+  bool compactPressure = false;
+};
+
+enum class Solve {
+  VISCOSITY_X = 0,
+  VISCOSITY_Y = 1,
+  PROJECT = 2,
+  REPROJECT = 3,
+  DENSITY = 4,
+  COUNT = 5
+};
+
+struct SolveStats {
+  uint32_t iterations;
+  float residual;
+};
+
+// Filled by every step with the outcome of each linear solve it ran
+struct SolverStats {
+  SolveStats solves[static_cast<uint32_t>(Solve::COUNT)];
+  // Largest |v| velocityStep left in the interior, measured by its last
+  // pass, so the next step size can follow it without another one
+  float maxSpeed;
+  // Largest density densityStep left, or 0, measured by its advection
+  float maxDensity;
+  // Share of the grid densityStep visited, below 1 only when sparse
+  float activeFraction;
+
+  SolveStats &solve(const Solve s) { return solves[static_cast<uint32_t>(s)]; }
+};
+
+// Picks the solver backend used by FluidSolver: the one named (or set in
+// NAVIER_STOKES_BACKEND) if the host can run it, otherwise the fastest
+// available. Returns its name. Called on first use if never called
+// explicitly.
+const char *selectSolverBackend(const char *name);
+
+// Double buffered fields, each has a current buffer holding its value and a
+// previous one the step reads sources from and uses as its back buffer
+enum class Field { VX = 0, VY = 1, DENSITY = 2, COUNT = 3 };
+
+// Round blob of force and density: every cell (i, j) with its centre within
+// radius of (x, y) gains (fx, fy) and density per unit of time. Interior
+// cells run from 1 to n, so a splat of radius 0 on (i, j) hits that cell.
+struct Splat {
+  float x;
+  float y;
+  float radius;
+  float fx;
+  float fy;
+  float density;
+};
+
+// Owns every field and the project scratch in a single arena. Buffers start
+// on 64 byte boundaries, the arena can be backed by huge pages and its pages
+// are first touched by the pool threads that later sweep the same columns,
+// so on NUMA hosts each slab lives on the node of the thread using it.
+class ActiveBricks;
+class Obstacles;
+class SpectralSolver;
+class TaskScheduler;
+struct SolverBackend;
+
+class FluidSolver {
+public:
+  FluidSolver(const uint64_t n, const SolverConfig &cfg,
+              const bool hugePages = false);
+  ~FluidSolver();
+
+  FluidSolver(const FluidSolver &) = delete;
+  FluidSolver &operator=(const FluidSolver &) = delete;
+
+  uint64_t resolution() const { return n; }
+  // Cells of every buffer, ghost cells included
+  uint64_t cells() const { return (n + 2) * (n + 2); }
+  // Whether the arena actually got huge pages, explicit or transparent
+  bool hugePages() const { return huge; }
+
+  SolverConfig &config() { return cfg; }
+  const SolverConfig &config() const { return cfg; }
+
+  Storage storage() const { return format; }
+
+  // Null with 16 bit storage, values() and setValues() convert those
+  float *field(const Field f) {
+    return compact() ? nullptr : buffers[index(f)][current[index(f)]];
+  }
+  const float *field(const Field f) const {
+    return compact() ? nullptr : buffers[index(f)][current[index(f)]];
+  }
+  // Added to the field, scaled by dt, by the next step. Steps leave stale
+  // values behind so sources must be rewritten before every step.
+  float *source(const Field f) {
+    return compact() ? nullptr : buffers[index(f)][1 - current[index(f)]];
+  }
+  const float *source(const Field f) const {
+    return compact() ? nullptr : buffers[index(f)][1 - current[index(f)]];
+  }
+  // Exchanges the current and previous buffers of f
+  void swap(const Field f) { current[index(f)] ^= 1; }
+
+  // The field or its source as floats for any storage: the buffer itself
+  // with fp32, otherwise widened into scratch
+  const float *values(const Field f, std::vector<float> &scratch) const;
+  const float *sourceValues(const Field f, std::vector<float> &scratch) const;
+  // Overwrite the field or its source, rounding to the storage format
+  void setValues(const Field f, const float *values);
+  void setSourceValues(const Field f, const float *values);
+  // Zeroes the source of f
+  void clearSource(const Field f);
+
+  // Adds dt times the splats to the current fields, as the sources would
+  // but only over the cells they cover, so with SolverConfig::sources off
+  // driving the simulation costs the splat area rather than the grid
+  void inject(std::span<const Splat> splats, const float dt);
+
+  // Both leave their result in the current buffers
+  void velocityStep(const float visc, const float dt, SolverStats &stats);
+  void densityStep(const float diff, const float dt, SolverStats &stats);
+  // velocityStep then densityStep, as a task graph with SolverConfig::tasks
+  // unless periodic or stored in 16 bit
+  void step(const float visc, const float diff, const float dt,
+            SolverStats &stats);
+  // Solid cells the steps keep the flow out of, null for none, ignored with
+  // 16 bit storage. Applies their boundary to the current fields right away.
+  // With obstacles the diffusion and pressure solves relax in place over the
+  // fluid cells in fp32, in red-black order for LinearSolver::RED_BLACK and
+  // Gauss-Seidel order otherwise, and the steps are never fused or sparse.
+  void setObstacles(std::unique_ptr<Obstacles> obstacles);
+  const Obstacles *obstacles() const { return solids.get(); }
+
+  // Scheduler of the task steps, null until the first one
+  TaskScheduler *taskScheduler() { return scheduler.get(); }
+
+  // Largest |v| and density the last steps left in the interior, tracked by
+  // their final passes, 0 before any. measure recomputes them from the
+  // fields after those are written some other way, like a restore.
+  float lastMaxSpeed() const { return maxSpeed; }
+  float lastMaxDensity() const { return maxDensity; }
+  void measure();
+
+private:
+  static constexpr size_t FIELDS = static_cast<size_t>(Field::COUNT);
+
+  static size_t index(const Field f) { return static_cast<size_t>(f); }
+
+  bool compact() const { return format != Storage::FP32; }
+  // The buffers of f as the element type of the storage
+  template <typename T> T *stored(const Field f) const {
+    return reinterpret_cast<T *>(buffers[index(f)][current[index(f)]]);
+  }
+  template <typename T> T *storedSource(const Field f) const {
+    return reinterpret_cast<T *>(buffers[index(f)][1 - current[index(f)]]);
+  }
+
+  void taskStep(const float visc, const float diff, const float dt,
+                SolverStats &stats);
+  void sparseDensityStep(const SolverBackend &k, const float diff,
+                         const float dt, SolverStats &stats);
+  bool periodic() const;
+  void periodicVelocityStep(const SolverBackend &k, const float visc,
+                            const float dt, SolverStats &stats);
+  void periodicDensityStep(const SolverBackend &k, const float diff,
+                           const float dt, SolverStats &stats);
+  template <typename T>
+  void compactVelocityStep(const float visc, const float dt,
+                           SolverStats &stats);
+  template <typename T>
+  void compactDensityStep(const float diff, const float dt,
+                          SolverStats &stats);
+
+  uint64_t n;
+  SolverConfig cfg;
+  bool huge = false;
+  // cfg.storage and cfg.compactPressure the arena was laid out for
+  Storage format;
+  bool compactPressure;
+
+  void *arena = nullptr;
+  size_t arenaBytes = 0;
+
+  // Hold the storage format, pressure and divergence only when
+  // compactPressure
+  float *buffers[FIELDS][2];
+  uint8_t current[FIELDS]{};
+  float *pressure;
+  float *divergence;
+
+  // Set by velocityStep, how far the density step can move anything
+  float maxSpeed = 0;
+  float maxDensity = 0;
+  std::unique_ptr<ActiveBricks> bricks;
+  std::unique_ptr<Obstacles> solids;
+  std::unique_ptr<TaskScheduler> scheduler;
+  std::unique_ptr<SpectralSolver> spectral;
+};
 
 #endif
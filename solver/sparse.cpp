@@ -0,0 +1,245 @@
+#include "sparse.hpp"
+#include "kernels.hpp"
+#include "obstacles.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+ActiveBricks::ActiveBricks(const uint64_t n, const uint32_t brick)
+    : n(n), brick(max(brick, 1u)), bricks((n + this->brick - 1) / this->brick),
+      peak(bricks * bricks), hot(bricks * bricks),
+      active(bricks * bricks, 1), rowSpans(bricks + 1), activeCells(n * n) {
+  // Everything is active until the first update
+  for (uint64_t r = 0; r < bricks; r++) {
+    rowSpans[r] = r;
+    spans.push_back({1, uint32_t(n + 1)});
+  }
+  rowSpans[bricks] = bricks;
+}
+
+void ActiveBricks::update(float *__restrict x, float *__restrict s,
+                          const float threshold, const uint32_t margin) {
+  PROFILE_ZONE("active_bricks");
+  // Magnitudes are compared as float bits, which order like integers once
+  // the sign is dropped and keep the loop vectorized without fast math
+  fill(peak.begin(), peak.end(), 0);
+  for (uint64_t j = 1; j <= n; j++) {
+    int32_t *row = peak.data() + (j - 1) / brick * bricks;
+    for (uint64_t c = 0; c < bricks; c++) {
+      const uint64_t iEnd = min((c + 1) * brick, n) + 1;
+      int32_t m = row[c];
+      for (uint64_t i = c * brick + 1; i < iEnd; i++)
+        m = max(m, bit_cast<int32_t>(x[idx(i, j, n)]) & 0x7fffffff);
+      if (s)
+        for (uint64_t i = c * brick + 1; i < iEnd; i++)
+          m = max(m, bit_cast<int32_t>(s[idx(i, j, n)]) & 0x7fffffff);
+      row[c] = m;
+    }
+  }
+
+  const int32_t limit = bit_cast<int32_t>(abs(threshold));
+  for (uint64_t k = 0; k < bricks * bricks; k++)
+    hot[k] = peak[k] > limit;
+
+  // Grown by the margin rounded up to whole bricks, along i then along j
+  const int64_t reach = (uint64_t(margin) + brick - 1) / brick;
+  const int64_t last = bricks - 1;
+  vector<uint8_t> grown(bricks * bricks);
+  for (int64_t r = 0; r <= last; r++)
+    for (int64_t c = 0; c <= last; c++) {
+      uint8_t any = 0;
+      for (int64_t k = max(c - reach, int64_t(0)); k <= min(c + reach, last);
+           k++)
+        any |= hot[r * bricks + k];
+      grown[r * bricks + c] = any;
+    }
+  for (int64_t r = 0; r <= last; r++)
+    for (int64_t c = 0; c <= last; c++) {
+      uint8_t any = 0;
+      for (int64_t k = max(r - reach, int64_t(0)); k <= min(r + reach, last);
+           k++)
+        any |= grown[k * bricks + c];
+      active[r * bricks + c] = any;
+    }
+
+  spans.clear();
+  activeCells = 0;
+  for (uint64_t r = 0; r < bricks; r++) {
+    rowSpans[r] = spans.size();
+    const uint64_t jBegin = r * brick + 1;
+    const uint64_t jEnd = min((r + 1) * brick, n) + 1;
+    for (uint64_t c = 0; c < bricks; c++) {
+      const uint32_t iBegin = c * brick + 1;
+      const uint32_t iEnd = min((c + 1) * brick, n) + 1;
+      if (!active[r * bricks + c]) {
+        if (peak[r * bricks + c] > 0)
+          for (uint64_t j = jBegin; j < jEnd; j++) {
+            fill(x + idx(iBegin, j, n), x + idx(iEnd, j, n), 0.f);
+            if (s)
+              fill(s + idx(iBegin, j, n), s + idx(iEnd, j, n), 0.f);
+          }
+        continue;
+      }
+
+      activeCells += (jEnd - jBegin) * (iEnd - iBegin);
+      if (spans.size() > rowSpans[r] && spans.back().end == iBegin)
+        spans.back().end = iEnd;
+      else
+        spans.push_back({iBegin, iEnd});
+    }
+  }
+  rowSpans[bricks] = spans.size();
+}
+
+void addSourceActive(const uint64_t n, float *__restrict x,
+                     const float *__restrict s, const float dt,
+                     const ActiveBricks &active) {
+  for (uint64_t j = 1; j <= n; j++)
+    for (const Span *p = active.begin(j); p != active.end(j); p++)
+      for (uint64_t i = p->begin; i < p->end; i++)
+        x[idx(i, j, n)] += dt * s[idx(i, j, n)];
+}
+
+// The sweeps and solves below run over either set of spans, the active
+// bricks or the fluid cells around obstacles
+template <bool track, typename Cells>
+static double sweepGaussSeidel(const uint64_t n, float *__restrict x,
+                               const float *__restrict xPrev, const float a,
+                               const float c, const Cells &active) {
+  double r2 = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (const Span *p = active.begin(j); p != active.end(j); p++)
+      for (uint64_t i = p->begin; i < p->end; i++) {
+        const float v = relax(n, i, j, x, xPrev, a, c);
+        if constexpr (track) {
+          const float r = c * (v - x[idx(i, j, n)]);
+          r2 += r * r;
+        }
+        x[idx(i, j, n)] = v;
+      }
+  return r2;
+}
+
+// Same colouring and per row residuals as the dense red-black sweep
+template <bool track, typename Cells>
+static double sweepRedBlack(const uint64_t n, float *__restrict x,
+                            const float *__restrict xPrev, const float a,
+                            const float c, const Cells &active,
+                            ThreadPool &pool, double *__restrict colResidual) {
+  for (uint64_t color = 0; color < 2; color++) {
+    pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+      for (uint64_t j = jBegin; j < jEnd; j++) {
+        // Cells of this color have the parity of 1 + ((j + color) & 1)
+        const uint64_t parity = (1 + j + color) & 1;
+        double r2 = 0;
+        for (const Span *p = active.begin(j); p != active.end(j); p++)
+          for (uint64_t i = p->begin + ((p->begin + parity) & 1); i < p->end;
+               i += 2) {
+            const float v = relax(n, i, j, x, xPrev, a, c);
+            if constexpr (track) {
+              const float r = c * (v - x[idx(i, j, n)]);
+              r2 += r * r;
+            }
+            x[idx(i, j, n)] = v;
+          }
+        if constexpr (track)
+          colResidual[j] = color ? colResidual[j] + r2 : r2;
+      }
+    });
+  }
+
+  double r2 = 0;
+  if constexpr (track)
+    for (uint64_t j = 1; j <= n; j++)
+      r2 += colResidual[j];
+  return r2;
+}
+
+static void applyBoundary(const uint64_t n, const Boundary b,
+                          float *__restrict x, const ActiveBricks &) {
+  setBoundary(n, b, x);
+}
+
+static void applyBoundary(const uint64_t n, const Boundary b,
+                          float *__restrict x, const Obstacles &fluid) {
+  fluid.apply(b, x);
+  setBoundary(n, b, x);
+}
+
+template <typename Cells>
+static SolveStats solveActive(const uint64_t n, const Boundary b,
+                              float *__restrict x, float *__restrict xPrev,
+                              const float a, const float c,
+                              const SolverConfig &cfg, const Cells &active) {
+  const bool converge = cfg.tolerance > 0;
+  const bool redBlack = cfg.linearSolver == LinearSolver::RED_BLACK;
+
+  // Residuals are relative to the right hand side unless it vanishes
+  double b2 = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    for (const Span *p = active.begin(j); p != active.end(j); p++)
+      for (uint64_t i = p->begin; i < p->end; i++)
+        b2 += xPrev[idx(i, j, n)] * xPrev[idx(i, j, n)];
+  const double scale = b2 > 0 ? 1 / sqrt(b2) : 1;
+
+  vector<double> colResidual;
+  if (redBlack)
+    colResidual.resize(n + 2);
+  ThreadPool &pool = threadPool(cfg.threads);
+
+  SolveStats stats{0, NAN};
+  while (stats.iterations < cfg.maxIterations) {
+    const bool track = converge || stats.iterations + 1 == cfg.maxIterations;
+    double r2;
+    if (redBlack)
+      r2 = track ? sweepRedBlack<true>(n, x, xPrev, a, c, active, pool,
+                                       colResidual.data())
+                 : sweepRedBlack<false>(n, x, xPrev, a, c, active, pool,
+                                        colResidual.data());
+    else
+      r2 = track ? sweepGaussSeidel<true>(n, x, xPrev, a, c, active)
+                 : sweepGaussSeidel<false>(n, x, xPrev, a, c, active);
+    applyBoundary(n, b, x, active);
+    stats.iterations++;
+
+    if (track) {
+      stats.residual = sqrt(r2) * scale;
+      if (converge && stats.residual <= cfg.tolerance)
+        break;
+    }
+  }
+
+  return stats;
+}
+
+SolveStats diffuseActive(const uint64_t n, const Boundary b,
+                         float *__restrict x, float *__restrict xPrev,
+                         const float diff, const float dt,
+                         const SolverConfig &cfg, const ActiveBricks &active) {
+  PROFILE_ZONE("diffuse");
+  const float a = dt * diff * n * n;
+  return solveActive(n, b, x, xPrev, a, 1 + 4 * a, cfg, active);
+}
+
+SolveStats linearSolveActive(const uint64_t n, const Boundary b,
+                             float *__restrict x, float *__restrict xPrev,
+                             const float a, const float c,
+                             const SolverConfig &cfg, const Obstacles &fluid) {
+  return solveActive(n, b, x, xPrev, a, c, cfg, fluid);
+}
+
+SolveStats diffuseActive(const uint64_t n, const Boundary b,
+                         float *__restrict x, float *__restrict xPrev,
+                         const float diff, const float dt,
+                         const SolverConfig &cfg, const Obstacles &fluid) {
+  PROFILE_ZONE("diffuse");
+  const float a = dt * diff * n * n;
+  return solveActive(n, b, x, xPrev, a, 1 + 4 * a, cfg, fluid);
+}
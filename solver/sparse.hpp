@@ -0,0 +1,83 @@
+#ifndef SPARSE_HPP
+#define SPARSE_HPP
+
+#include "kernels.hpp"
+#include "solver.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Interior cells [begin, end) of a row
+struct Span {
+  uint32_t begin;
+  uint32_t end;
+};
+
+// Splits the interior in bricks of brick x brick cells and keeps the ones
+// worth stepping. Kernels given it only visit cells of active bricks, as
+// one span per run of consecutive active bricks of a row. Inactive bricks
+// are kept at exactly 0, so skipping them reads as an empty region.
+class ActiveBricks {
+public:
+  ActiveBricks(const uint64_t n, const uint32_t brick);
+
+  // Activates the bricks holding a cell of x or s above threshold and every
+  // brick within margin cells of those. Inactive bricks still holding
+  // anything are zeroed in x and s. s may be null when there are no sources.
+  void update(float *__restrict x, float *__restrict s, const float threshold,
+              const uint32_t margin);
+
+  // Spans of row j, 1 <= j <= n
+  const Span *begin(const uint64_t j) const {
+    return spans.data() + rowSpans[(j - 1) / brick];
+  }
+  const Span *end(const uint64_t j) const {
+    return spans.data() + rowSpans[(j - 1) / brick + 1];
+  }
+
+  // Share of the interior cells in active bricks
+  float fraction() const { return float(activeCells) / (n * n); }
+
+private:
+  uint64_t n;
+  uint32_t brick;
+  // Bricks per side
+  uint64_t bricks;
+  // Largest |x| or |s| of every brick, as float bits
+  std::vector<int32_t> peak;
+  std::vector<uint8_t> hot;
+  std::vector<uint8_t> active;
+  // Spans of brick row r are spans[rowSpans[r]] to spans[rowSpans[r + 1]]
+  std::vector<uint32_t> rowSpans;
+  std::vector<Span> spans;
+  uint64_t activeCells;
+};
+
+// x += dt * s over the active cells
+void addSourceActive(const uint64_t n, float *__restrict x,
+                     const float *__restrict s, const float dt,
+                     const ActiveBricks &active);
+
+// diffuse over the active cells. Always relaxes in place, in red-black
+// order for LinearSolver::RED_BLACK and Gauss-Seidel order otherwise (the
+// order tiled sweeps follow too), whatever cfg.diffusionSolver says.
+SolveStats diffuseActive(const uint64_t n, const Boundary b,
+                         float *__restrict x, float *__restrict xPrev,
+                         const float diff, const float dt,
+                         const SolverConfig &cfg, const ActiveBricks &active);
+
+// linearSolve restricted to the fluid cells, with the obstacle boundary and
+// then setBoundary after every sweep. Always relaxes in place, in red-black
+// order for LinearSolver::RED_BLACK and Gauss-Seidel order otherwise.
+SolveStats linearSolveActive(const uint64_t n, const Boundary b,
+                             float *__restrict x, float *__restrict xPrev,
+                             const float a, const float c,
+                             const SolverConfig &cfg, const Obstacles &fluid);
+
+// diffuse over the fluid cells, see linearSolveActive
+SolveStats diffuseActive(const uint64_t n, const Boundary b,
+                         float *__restrict x, float *__restrict xPrev,
+                         const float diff, const float dt,
+                         const SolverConfig &cfg, const Obstacles &fluid);
+
+#endif
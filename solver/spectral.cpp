@@ -0,0 +1,344 @@
+#include "spectral.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <new>
+#include <numbers>
+
+using namespace std;
+
+static constexpr size_t ALIGNMENT = 64;
+
+// Index with its log2(len) low bits reversed
+static vector<uint32_t> bitReversal(const uint64_t len) {
+  const uint32_t bits = countr_zero(len);
+  vector<uint32_t> rev(len);
+  for (uint64_t k = 0; k < len; k++)
+    for (uint32_t b = 0; b < bits; b++)
+      rev[k] |= (k >> b & 1) << (bits - 1 - b);
+  return rev;
+}
+
+// Radix-2 stages of a length len FFT over data already in bit reversed
+// order. Twiddles of stage h are cosine and sine at k * n / (2 * h), the
+// inverse conjugates them and leaves the result scaled by len.
+static void butterflies(float *__restrict re, float *__restrict im,
+                        const uint64_t len, const uint64_t n,
+                        const float *__restrict cosine,
+                        const float *__restrict sine, const bool inverse) {
+  const float sign = inverse ? -1 : 1;
+  for (uint64_t h = 1; h < len; h *= 2) {
+    const uint64_t step = n / (2 * h);
+    for (uint64_t base = 0; base < len; base += 2 * h)
+      for (uint64_t k = 0; k < h; k++) {
+        const float wr = cosine[k * step];
+        const float wi = sign * sine[k * step];
+        const uint64_t a = base + k;
+        const uint64_t b = a + h;
+        const float tr = wr * re[b] - wi * im[b];
+        const float ti = wr * im[b] + wi * re[b];
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+  }
+}
+
+bool SpectralSolver::supports(const uint64_t n) {
+  return n >= 4 && has_single_bit(n);
+}
+
+void SpectralSolver::FreeAligned::operator()(float *p) const {
+  ::operator delete[](p, align_val_t(ALIGNMENT));
+}
+
+SpectralSolver::SpectralSolver(const uint64_t n)
+    : n(n), m(n / 2), width(n / 2 + 1),
+      stride((width + ALIGNMENT / sizeof(float) - 1) /
+             (ALIGNMENT / sizeof(float)) * (ALIGNMENT / sizeof(float))),
+      cosine(m + 1), sine(m + 1), reverseRows(bitReversal(n)),
+      reverseHalf(bitReversal(m)), cosWave(n), sinWave(n) {
+  for (uint64_t k = 0; k < n; k++) {
+    const double theta = 2 * numbers::pi * k / n;
+    cosWave[k] = cos(theta);
+    sinWave[k] = sin(theta);
+    if (k <= m) {
+      cosine[k] = cos(theta);
+      sine[k] = -sin(theta);
+    }
+  }
+
+  const uint64_t plane = n * stride;
+  planes.reset(static_cast<float *>(::operator new[](
+      4 * plane * sizeof(float), align_val_t(ALIGNMENT))));
+  for (uint32_t k = 0; k < 2; k++) {
+    re[k] = planes.get() + 2 * k * plane;
+    im[k] = re[k] + plane;
+  }
+}
+
+// Each row of n reals is a complex sequence of m, evens as the real part,
+// whose FFT splits into the transforms of the evens and the odds
+void SpectralSolver::rowsForward(const float *__restrict x,
+                                 float *__restrict re, float *__restrict im,
+                                 const uint64_t jBegin,
+                                 const uint64_t jEnd) const {
+  static thread_local vector<float> zr, zi;
+  zr.resize(m);
+  zi.resize(m);
+  for (uint64_t j = jBegin; j < jEnd; j++) {
+    const float *row = x + idx(1, j, n);
+    for (uint64_t k = 0; k < m; k++) {
+      zr[reverseHalf[k]] = row[2 * k];
+      zi[reverseHalf[k]] = row[2 * k + 1];
+    }
+    butterflies(zr.data(), zi.data(), m, n, cosine.data(), sine.data(),
+                false);
+
+    float *outRe = re + (j - 1) * stride;
+    float *outIm = im + (j - 1) * stride;
+    for (uint64_t k = 0; k <= m; k++) {
+      const uint64_t a = k % m;
+      const uint64_t b = (m - k) % m;
+      const float evenRe = .5f * (zr[a] + zr[b]);
+      const float evenIm = .5f * (zi[a] - zi[b]);
+      const float oddRe = .5f * (zi[a] + zi[b]);
+      const float oddIm = -.5f * (zr[a] - zr[b]);
+      outRe[k] = evenRe + cosine[k] * oddRe - sine[k] * oddIm;
+      outIm[k] = evenIm + cosine[k] * oddIm + sine[k] * oddRe;
+    }
+  }
+}
+
+void SpectralSolver::rowsInverse(float *__restrict x,
+                                 const float *__restrict re,
+                                 const float *__restrict im,
+                                 const uint64_t jBegin,
+                                 const uint64_t jEnd) const {
+  static thread_local vector<float> zr, zi;
+  zr.resize(m);
+  zi.resize(m);
+  // Both inverses leave a factor n * m
+  const float scale = 1.f / (n * m);
+  for (uint64_t j = jBegin; j < jEnd; j++) {
+    const float *inRe = re + (j - 1) * stride;
+    const float *inIm = im + (j - 1) * stride;
+    for (uint64_t k = 0; k < m; k++) {
+      const float evenRe = .5f * (inRe[k] + inRe[m - k]);
+      const float evenIm = .5f * (inIm[k] - inIm[m - k]);
+      const float dRe = .5f * (inRe[k] - inRe[m - k]);
+      const float dIm = .5f * (inIm[k] + inIm[m - k]);
+      // Undoes the twiddle of the forward split
+      const float oddRe = dRe * cosine[k] + dIm * sine[k];
+      const float oddIm = dIm * cosine[k] - dRe * sine[k];
+      zr[reverseHalf[k]] = evenRe - oddIm;
+      zi[reverseHalf[k]] = evenIm + oddRe;
+    }
+    butterflies(zr.data(), zi.data(), m, n, cosine.data(), sine.data(),
+                true);
+
+    float *row = x + idx(1, j, n);
+    for (uint64_t k = 0; k < m; k++) {
+      row[2 * k] = scale * zr[k];
+      row[2 * k + 1] = scale * zi[k];
+    }
+  }
+}
+
+// The FFT of every column in [cBegin, cEnd) at once, each butterfly
+// combining two rows of the spectrum cell by cell
+void SpectralSolver::columns(float *__restrict re, float *__restrict im,
+                             const uint64_t cBegin, const uint64_t cEnd,
+                             const bool inverse) const {
+  for (uint64_t r = 0; r < n; r++) {
+    const uint64_t t = reverseRows[r];
+    if (r < t)
+      for (uint64_t c = cBegin; c < cEnd; c++) {
+        std::swap(re[r * stride + c], re[t * stride + c]);
+        std::swap(im[r * stride + c], im[t * stride + c]);
+      }
+  }
+
+  const float sign = inverse ? -1 : 1;
+  for (uint64_t h = 1; h < n; h *= 2) {
+    const uint64_t step = n / (2 * h);
+    for (uint64_t base = 0; base < n; base += 2 * h)
+      for (uint64_t k = 0; k < h; k++) {
+        const float wr = cosine[k * step];
+        const float wi = sign * sine[k * step];
+        float *aRe = re + (base + k) * stride;
+        float *aIm = im + (base + k) * stride;
+        float *bRe = aRe + h * stride;
+        float *bIm = aIm + h * stride;
+        for (uint64_t c = cBegin; c < cEnd; c++) {
+          const float tr = wr * bRe[c] - wi * bIm[c];
+          const float ti = wr * bIm[c] + wi * bRe[c];
+          bRe[c] = aRe[c] - tr;
+          bIm[c] = aIm[c] - ti;
+          aRe[c] += tr;
+          aIm[c] += ti;
+        }
+      }
+  }
+}
+
+void SpectralSolver::forward(const float *__restrict x, const uint32_t k,
+                             const SolverConfig &cfg) {
+  PROFILE_ZONE("fft");
+  ThreadPool &pool = threadPool(cfg.threads);
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    rowsForward(x, re[k], im[k], jBegin, jEnd);
+  });
+  pool.parallelFor(0, width, [&](uint64_t cBegin, uint64_t cEnd) {
+    columns(re[k], im[k], cBegin, cEnd, false);
+  });
+}
+
+void SpectralSolver::inverse(float *__restrict x, const uint32_t k,
+                             const SolverConfig &cfg) {
+  PROFILE_ZONE("inverse_fft");
+  ThreadPool &pool = threadPool(cfg.threads);
+  pool.parallelFor(0, width, [&](uint64_t cBegin, uint64_t cEnd) {
+    columns(re[k], im[k], cBegin, cEnd, true);
+  });
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    rowsInverse(x, re[k], im[k], jBegin, jEnd);
+  });
+  setBoundary(n, Boundary::PERIODIC, x);
+}
+
+// Squared norm of c * x - a * (neighbours) - xPrev relative to xPrev, per
+// row and summed in order so the threads don't change it
+static float residual(const uint64_t n, const float *__restrict x,
+                      const float *__restrict xPrev, const float a,
+                      const float c, const SolverConfig &cfg) {
+  vector<double> rows(2 * (n + 1));
+  threadPool(cfg.threads)
+      .parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+        for (uint64_t j = jBegin; j < jEnd; j++) {
+          double r2 = 0, b2 = 0;
+          for (uint64_t i = 1; i <= n; i++) {
+            const float r = c * x[idx(i, j, n)] - xPrev[idx(i, j, n)] -
+                            a * (x[idx(i - 1, j, n)] + x[idx(i + 1, j, n)] +
+                                 x[idx(i, j - 1, n)] + x[idx(i, j + 1, n)]);
+            r2 += r * r;
+            b2 += xPrev[idx(i, j, n)] * xPrev[idx(i, j, n)];
+          }
+          rows[2 * j] = r2;
+          rows[2 * j + 1] = b2;
+        }
+      });
+  double r2 = 0, b2 = 0;
+  for (uint64_t j = 1; j <= n; j++) {
+    r2 += rows[2 * j];
+    b2 += rows[2 * j + 1];
+  }
+  return sqrt(r2 / (b2 > 0 ? b2 : 1));
+}
+
+SolveStats SpectralSolver::solve(const float *__restrict xPrev,
+                                 float *__restrict x, const float a,
+                                 const float c, const SolverConfig &cfg) {
+  PROFILE_ZONE("spectral_solve");
+  forward(xPrev, 0, cfg);
+  threadPool(cfg.threads)
+      .parallelFor(0, n, [&](uint64_t rBegin, uint64_t rEnd) {
+        for (uint64_t r = rBegin; r < rEnd; r++)
+          for (uint64_t k = 0; k < width; k++) {
+            // Symbol of the stencil, 0 only for the constant mode of a
+            // singular system, which is then dropped
+            const float symbol = c - 2 * a * (cosWave[k] + cosWave[r]);
+            const float g = symbol != 0 ? 1 / symbol : 0;
+            re[0][r * stride + k] *= g;
+            im[0][r * stride + k] *= g;
+          }
+      });
+  inverse(x, 0, cfg);
+  return {1, residual(n, x, xPrev, a, c, cfg)};
+}
+
+// Central difference divergence of (vx, vy) per row, summed in order
+static double divergence2(const uint64_t n, const float *__restrict vx,
+                          const float *__restrict vy,
+                          const SolverConfig &cfg) {
+  vector<double> rows(n + 1);
+  threadPool(cfg.threads)
+      .parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+        for (uint64_t j = jBegin; j < jEnd; j++) {
+          double d2 = 0;
+          for (uint64_t i = 1; i <= n; i++) {
+            const float d = vx[idx(i + 1, j, n)] - vx[idx(i - 1, j, n)] +
+                            vy[idx(i, j + 1, n)] - vy[idx(i, j - 1, n)];
+            d2 += d * d;
+          }
+          rows[j] = d2;
+        }
+      });
+  double d2 = 0;
+  for (uint64_t j = 1; j <= n; j++)
+    d2 += rows[j];
+  return d2;
+}
+
+SolveStats SpectralSolver::project(const float *vxPrev, const float *vyPrev,
+                                   float *vx, float *vy, const float a,
+                                   const SolverConfig &cfg, float &speed2) {
+  PROFILE_ZONE("spectral_project");
+  forward(vxPrev, 0, cfg);
+  forward(vyPrev, 1, cfg);
+  ThreadPool &pool = threadPool(cfg.threads);
+  pool.parallelFor(0, n, [&](uint64_t rBegin, uint64_t rEnd) {
+    for (uint64_t r = rBegin; r < rEnd; r++)
+      for (uint64_t k = 0; k < width; k++) {
+        const float g = 1 / (1 + 2 * a * (2 - cosWave[k] - cosWave[r]));
+        // The central difference divergence of a mode is i (sx, sy) . v,
+        // modes it can't see (sx = sy = 0) are left alone
+        const float sx = sinWave[k];
+        const float sy = sinWave[r];
+        const float s2 = sx * sx + sy * sy;
+        const float w = s2 > 0 ? 1 / s2 : 0;
+        const uint64_t q = r * stride + k;
+        const float uRe = g * re[0][q], uIm = g * im[0][q];
+        const float vRe = g * re[1][q], vIm = g * im[1][q];
+        const float dRe = w * (sx * uRe + sy * vRe);
+        const float dIm = w * (sx * uIm + sy * vIm);
+        re[0][q] = uRe - sx * dRe;
+        im[0][q] = uIm - sx * dIm;
+        re[1][q] = vRe - sy * dRe;
+        im[1][q] = vIm - sy * dIm;
+      }
+  });
+  inverse(vx, 0, cfg);
+  inverse(vy, 1, cfg);
+
+  // Largest and summed vx^2 + vy^2 per row
+  vector<double> rows(2 * (n + 1));
+  pool.parallelFor(1, n + 1, [&](uint64_t jBegin, uint64_t jEnd) {
+    for (uint64_t j = jBegin; j < jEnd; j++) {
+      float peak = 0;
+      double v2 = 0;
+      for (uint64_t i = 1; i <= n; i++) {
+        const float s = vx[idx(i, j, n)] * vx[idx(i, j, n)] +
+                        vy[idx(i, j, n)] * vy[idx(i, j, n)];
+        peak = max(peak, s);
+        v2 += s;
+      }
+      rows[2 * j] = peak;
+      rows[2 * j + 1] = v2;
+    }
+  });
+  speed2 = 0;
+  double v2 = 0;
+  for (uint64_t j = 1; j <= n; j++) {
+    speed2 = max(speed2, float(rows[2 * j]));
+    v2 += rows[2 * j + 1];
+  }
+
+  // Divergence left relative to the velocity, what rounding leaves
+  const double after = divergence2(n, vx, vy, cfg);
+  return {1, float(sqrt(after / (v2 > 0 ? v2 : 1)))};
+}
@@ -0,0 +1,87 @@
+#ifndef SPECTRAL_HPP
+#define SPECTRAL_HPP
+
+#include "kernels.hpp"
+#include "solver.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Exact diffusion and projection on periodic grids through a real to
+// complex 2D FFT. Rows go through a half length complex FFT and a real
+// split, columns through radix-2 butterflies applied to whole rows of the
+// spectrum, so both passes run on contiguous memory and split over threads
+// by rows or columns. Twiddles, bit reversals and the spectra are set up
+// once for the grid, the spectra as separate real and imaginary planes.
+class SpectralSolver {
+public:
+  explicit SpectralSolver(const uint64_t n);
+
+  SpectralSolver(const SpectralSolver &) = delete;
+  SpectralSolver &operator=(const SpectralSolver &) = delete;
+
+  // Powers of two from 4 on
+  static bool supports(const uint64_t n);
+
+  // Solves c * x - a * (sum of the 4 neighbours of x) = xPrev on the
+  // periodic grid, the system linearSolve relaxes, with one forward and one
+  // inverse transform
+  SolveStats solve(const float *__restrict xPrev, float *__restrict x,
+                   const float a, const float c, const SolverConfig &cfg);
+
+  // Diffuses (vxPrev, vyPrev) by a as solve does with c = 1 + 4 * a, then
+  // removes every mode of it the central difference divergence sees, all
+  // with one transform pair per component. The result goes to (vx, vy),
+  // which may be the same buffers, speed2 is its largest vx^2 + vy^2. The
+  // residual is the divergence left relative to the velocity.
+  SolveStats project(const float *vxPrev, const float *vyPrev, float *vx,
+                     float *vy, const float a, const SolverConfig &cfg,
+                     float &speed2);
+
+private:
+  struct FreeAligned {
+    void operator()(float *p) const;
+  };
+
+  // Transform of the interior of x into spectrum k and back, the inverse
+  // also writes the periodic ghosts
+  void forward(const float *__restrict x, const uint32_t k,
+               const SolverConfig &cfg);
+  void inverse(float *__restrict x, const uint32_t k, const SolverConfig &cfg);
+
+  void rowsForward(const float *__restrict x, float *__restrict re,
+                   float *__restrict im, const uint64_t jBegin,
+                   const uint64_t jEnd) const;
+  void rowsInverse(float *__restrict x, const float *__restrict re,
+                   const float *__restrict im, const uint64_t jBegin,
+                   const uint64_t jEnd) const;
+  void columns(float *__restrict re, float *__restrict im,
+               const uint64_t cBegin, const uint64_t cEnd,
+               const bool inverse) const;
+
+  uint64_t n;
+  // Half the row length, the row FFT length, and spectrum columns m + 1.
+  // Spectrum rows are stride floats apart, whole cache lines.
+  uint64_t m;
+  uint64_t width;
+  uint64_t stride;
+
+  // exp(-2 pi i k / n) for k <= n / 2, the row FFT of length m takes every
+  // other one
+  std::vector<float> cosine;
+  std::vector<float> sine;
+  std::vector<uint32_t> reverseRows;
+  std::vector<uint32_t> reverseHalf;
+  // cos(2 pi k / n) and sin(2 pi k / n) for every k < n, the symbols
+  std::vector<float> cosWave;
+  std::vector<float> sinWave;
+
+  // Two spectra, one per velocity component, real and imaginary planes of
+  // n rows of width each
+  std::unique_ptr<float, FreeAligned> planes;
+  float *re[2];
+  float *im[2];
+};
+
+#endif
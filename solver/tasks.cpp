@@ -0,0 +1,261 @@
+#include "tasks.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <print>
+
+using namespace std;
+
+// What the calling thread is running, set on the workers and on the thread
+// in run for as long as it lasts
+static thread_local TaskScheduler *currentScheduler = nullptr;
+static thread_local uint32_t currentWorker = 0;
+static thread_local const char *currentTask = nullptr;
+// Time a worker spent waiting for bands others took, not busy
+static thread_local chrono::nanoseconds waited{};
+
+uint32_t TaskGraph::add(const char *name, TaskFn fn,
+                        const initializer_list<uint32_t> after) {
+  const uint32_t id = nodes.size();
+  Node &node = nodes.emplace_back();
+  node.name = name;
+  node.fn = std::move(fn);
+  node.deps = after.size();
+  for (const uint32_t k : after)
+    nodes[k].next.push_back(id);
+  return id;
+}
+
+TaskScheduler::TaskScheduler(const uint32_t threads)
+    : threads(max(threads, 1u)), workers(this->threads) {
+  for (uint32_t id = 1; id < this->threads; id++)
+    pool.emplace_back(&TaskScheduler::loop, this, id);
+}
+
+TaskScheduler::~TaskScheduler() {
+  stop.store(true, memory_order_release);
+  epoch.fetch_add(1, memory_order_release);
+  epoch.notify_all();
+  for (thread &t : pool)
+    t.join();
+}
+
+TaskScheduler *TaskScheduler::current() { return currentScheduler; }
+
+void TaskScheduler::push(Worker &w, const Work &work, const bool band) {
+  {
+    lock_guard lk(w.m);
+    (band ? w.bands : w.tasks).push_back(work);
+  }
+  epoch.fetch_add(1, memory_order_release);
+  epoch.notify_all();
+}
+
+// The owner takes the newest work, still warm in its cache
+bool TaskScheduler::pop(Worker &w, Work &out, const bool bandsOnly) {
+  lock_guard lk(w.m);
+  deque<Work> &q = !w.bands.empty() || bandsOnly ? w.bands : w.tasks;
+  if (q.empty())
+    return false;
+  out = q.back();
+  q.pop_back();
+  return true;
+}
+
+// Thieves take the oldest, bands before tasks
+bool TaskScheduler::steal(const uint32_t self, Work &out,
+                          const bool bandsOnly) {
+  for (const bool band : {true, false}) {
+    if (!band && bandsOnly)
+      break;
+    for (uint32_t k = 1; k < threads; k++) {
+      Worker &w = workers[(self + k) % threads];
+      lock_guard lk(w.m);
+      deque<Work> &q = band ? w.bands : w.tasks;
+      if (q.empty())
+        continue;
+      out = q.front();
+      q.pop_front();
+      workers[self].steals++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskScheduler::execute(const uint32_t self, const Work &work) {
+  Worker &w = workers[self];
+  const auto begin = chrono::steady_clock::now();
+  const chrono::nanoseconds waitedBefore = waited;
+
+  if (work.node) {
+    const char *outer = currentTask;
+    currentTask = work.name;
+    work.node->fn();
+    currentTask = outer;
+  } else
+    (*work.fn)(work.begin, work.end);
+
+  const auto end = chrono::steady_clock::now();
+  w.timings.push_back({work.name, self, !work.node,
+                       chrono::nanoseconds(begin - runBegin),
+                       chrono::nanoseconds(end - runBegin)});
+  // Bands run while waiting inside a task are already part of its time
+  if (work.node) {
+    w.busy += chrono::nanoseconds(end - begin) - (waited - waitedBefore);
+    w.tasksRun++;
+  } else {
+    if (!currentTask)
+      w.busy += chrono::nanoseconds(end - begin);
+    w.bandsRun++;
+    work.left->fetch_sub(1, memory_order_release);
+    return;
+  }
+
+  for (const uint32_t k : work.node->next) {
+    TaskGraph::Node &next = graph->nodes[k];
+    if (next.pending.fetch_sub(1, memory_order_acq_rel) == 1)
+      push(w, {&next, nullptr, 0, 0, nullptr, next.name}, false);
+  }
+  if (remaining.fetch_sub(1, memory_order_acq_rel) == 1) {
+    epoch.fetch_add(1, memory_order_release);
+    epoch.notify_all();
+  }
+}
+
+void TaskScheduler::loop(const uint32_t self) {
+  currentScheduler = this;
+  currentWorker = self;
+  for (;;) {
+    const uint64_t seen = epoch.load(memory_order_acquire);
+    if (stop.load(memory_order_acquire))
+      return;
+    Work work;
+    if (pop(workers[self], work, false) || steal(self, work, false)) {
+      execute(self, work);
+      continue;
+    }
+    epoch.wait(seen, memory_order_acquire);
+  }
+}
+
+void TaskScheduler::run(TaskGraph &graph) {
+  if (graph.nodes.empty())
+    return;
+
+  this->graph = &graph;
+  for (Worker &w : workers)
+    w.timings.clear();
+  runBegin = chrono::steady_clock::now();
+  remaining.store(graph.nodes.size(), memory_order_relaxed);
+  for (TaskGraph::Node &node : graph.nodes)
+    node.pending.store(node.deps, memory_order_relaxed);
+  for (TaskGraph::Node &node : graph.nodes)
+    if (node.deps == 0)
+      push(workers[0], {&node, nullptr, 0, 0, nullptr, node.name}, false);
+
+  currentScheduler = this;
+  currentWorker = 0;
+  while (remaining.load(memory_order_acquire) != 0) {
+    const uint64_t seen = epoch.load(memory_order_acquire);
+    Work work;
+    if (pop(workers[0], work, false) || steal(0, work, false)) {
+      execute(0, work);
+      continue;
+    }
+    if (remaining.load(memory_order_acquire) != 0)
+      epoch.wait(seen, memory_order_acquire);
+  }
+  currentScheduler = nullptr;
+
+  runs++;
+  wall += chrono::steady_clock::now() - runBegin;
+  this->graph = nullptr;
+}
+
+void TaskScheduler::parallelFor(const uint64_t begin, const uint64_t end,
+                                const RangeFn &fn) {
+  // A few bands per worker lets the idle ones even out the load
+  const uint64_t count = end > begin ? end - begin : 0;
+  const uint64_t bands = min<uint64_t>(count, 4 * threads);
+  if (bands <= 1 || threads == 1) {
+    if (count)
+      fn(begin, end);
+    return;
+  }
+
+  const uint32_t self = currentWorker;
+  Worker &w = workers[self];
+  atomic<uint32_t> left = bands;
+  {
+    lock_guard lk(w.m);
+    for (uint64_t b = bands; b-- > 0;)
+      w.bands.push_back({nullptr, &fn, begin + count * b / bands,
+                         begin + count * (b + 1) / bands, &left,
+                         currentTask});
+  }
+  epoch.fetch_add(1, memory_order_release);
+  epoch.notify_all();
+
+  while (left.load(memory_order_acquire) != 0) {
+    Work work;
+    if (pop(w, work, true) || steal(self, work, true)) {
+      execute(self, work);
+      continue;
+    }
+    // The rest is running elsewhere
+    const auto begin = chrono::steady_clock::now();
+    bool stolen = false;
+    while (left.load(memory_order_acquire) != 0 &&
+           !(stolen = steal(self, work, true)))
+      this_thread::yield();
+    waited += chrono::steady_clock::now() - begin;
+    if (stolen)
+      execute(self, work);
+  }
+}
+
+TaskStats TaskScheduler::collect() {
+  TaskStats s{};
+  s.runs = runs;
+  s.wall = wall;
+  for (Worker &w : workers) {
+    s.tasks += w.tasksRun;
+    s.bands += w.bandsRun;
+    s.steals += w.steals;
+    s.busy += w.busy;
+    w.tasksRun = w.bandsRun = w.steals = 0;
+    w.busy = {};
+  }
+  runs = 0;
+  wall = {};
+  return s;
+}
+
+vector<TaskTiming> TaskScheduler::timeline() const {
+  vector<TaskTiming> all;
+  for (const Worker &w : workers)
+    all.insert(all.end(), w.timings.begin(), w.timings.end());
+  sort(all.begin(), all.end(), [](const TaskTiming &a, const TaskTiming &b) {
+    return a.begin < b.begin;
+  });
+  return all;
+}
+
+bool TaskScheduler::writeTimeline(const char *path) const {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  println(f, "{{\"traceEvents\": [");
+  bool first = true;
+  for (const TaskTiming &t : timeline()) {
+    println(f,
+            R"({}{{"name": "{}", "cat": "{}", "ph": "X", "pid": 1, )"
+            R"("tid": {}, "ts": {:.3f}, "dur": {:.3f}}})",
+            first ? "" : ",", t.name, t.band ? "band" : "task", t.worker,
+            t.begin.count() / 1e3, (t.end - t.begin).count() / 1e3);
+    first = false;
+  }
+  println(f, "]}}");
+  return fclose(f) == 0;
+}
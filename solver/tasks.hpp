@@ -0,0 +1,143 @@
+#ifndef TASKS_HPP
+#define TASKS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Kernels of a step and what each has to wait for. Built once per run, a
+// task becomes ready when every task it was added after is done.
+class TaskGraph {
+public:
+  using TaskFn = std::function<void()>;
+
+  // Returns the id later tasks name in after
+  uint32_t add(const char *name, TaskFn fn,
+               std::initializer_list<uint32_t> after = {});
+
+private:
+  friend class TaskScheduler;
+
+  struct Node {
+    const char *name;
+    TaskFn fn;
+    std::vector<uint32_t> next;
+    uint32_t deps = 0;
+    std::atomic<uint32_t> pending;
+  };
+
+  // Nodes hold atomics, a deque never moves them
+  std::deque<Node> nodes;
+};
+
+// One task, or one band of a parallelFor inside it, as it ran
+struct TaskTiming {
+  const char *name;
+  uint32_t worker;
+  bool band;
+  // From the start of the run
+  std::chrono::nanoseconds begin;
+  std::chrono::nanoseconds end;
+};
+
+struct TaskStats {
+  uint64_t runs;
+  uint64_t tasks;
+  uint64_t bands;
+  // Tasks and bands taken from another worker's queue
+  uint64_t steals;
+  // Summed over workers, and the wall time of the runs
+  std::chrono::duration<double, std::nano> busy;
+  std::chrono::duration<double, std::nano> wall;
+};
+
+// Work stealing scheduler for task graphs. Every worker keeps its own queues
+// and takes from their back; a worker out of work steals from the front of
+// the others'. A task calling ThreadPool::parallelFor (the red-black,
+// multigrid and conjugate gradient kernels do) has its rows split in bands
+// queued on its worker, which runs them along with whichever workers are
+// idle. A worker waiting for its bands only takes bands, never whole tasks,
+// so the per thread scratch of the kernel it is in stays its own.
+class TaskScheduler {
+public:
+  using RangeFn = std::function<void(uint64_t, uint64_t)>;
+
+  // The thread calling run is worker 0, threads - 1 more are started
+  explicit TaskScheduler(const uint32_t threads);
+  ~TaskScheduler();
+
+  TaskScheduler(const TaskScheduler &) = delete;
+  TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+  uint32_t size() const { return threads; }
+
+  // Runs every task of graph and returns once all are done
+  void run(TaskGraph &graph);
+
+  // Splits [begin, end) in bands and returns once all are done, only from a
+  // task of this scheduler
+  void parallelFor(const uint64_t begin, const uint64_t end,
+                   const RangeFn &fn);
+
+  // Scheduler of the task the calling thread is running, null outside one
+  static TaskScheduler *current();
+
+  // Totals since the previous call
+  TaskStats collect();
+
+  // Every task and band of the last run, sorted by start
+  std::vector<TaskTiming> timeline() const;
+  // Writes timeline() in the Chrome trace event format, one track per worker
+  bool writeTimeline(const char *path) const;
+
+private:
+  struct Work {
+    // A task, or a band of fn when node is null
+    TaskGraph::Node *node;
+    const RangeFn *fn;
+    uint64_t begin;
+    uint64_t end;
+    std::atomic<uint32_t> *left;
+    const char *name;
+  };
+
+  struct alignas(64) Worker {
+    std::mutex m;
+    std::deque<Work> tasks;
+    std::deque<Work> bands;
+    std::vector<TaskTiming> timings;
+    uint64_t tasksRun = 0;
+    uint64_t bandsRun = 0;
+    uint64_t steals = 0;
+    std::chrono::nanoseconds busy{};
+  };
+
+  void push(Worker &w, const Work &work, const bool band);
+  bool pop(Worker &w, Work &out, const bool bandsOnly);
+  bool steal(const uint32_t self, Work &out, const bool bandsOnly);
+  void execute(const uint32_t self, const Work &work);
+  void loop(const uint32_t self);
+
+  uint32_t threads;
+  std::vector<Worker> workers;
+  std::vector<std::thread> pool;
+
+  // Bumped whenever work is queued or a run ends, idle workers sleep on it
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<bool> stop{false};
+
+  TaskGraph *graph = nullptr;
+  std::atomic<uint32_t> remaining{0};
+  std::chrono::steady_clock::time_point runBegin;
+
+  uint64_t runs = 0;
+  std::chrono::nanoseconds wall{};
+};
+
+#endif
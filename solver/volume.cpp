@@ -0,0 +1,484 @@
+#include "volume.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <vector>
+#if defined(__SSE2__)
+#include <pmmintrin.h>
+#endif
+
+using namespace std;
+
+static constexpr uint64_t B = BrickLayout::BRICK;
+
+// Velocity component negated at the walls normal to its axis, NONE copies
+enum class Mirror { NONE = 0, X = 1, Y = 2, Z = 3 };
+
+VolumeSolver::VolumeSolver(const uint64_t n, const SolverConfig &cfg)
+    : layout(n), cfg(cfg) {
+  const uint64_t cells = layout.cells();
+  arenaBytes = 2 * FIELDS * cells * sizeof(float);
+  arena = mmap(nullptr, arenaBytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED)
+    throw bad_alloc();
+  madvise(arena, arenaBytes, MADV_HUGEPAGE);
+
+  float *next = static_cast<float *>(arena);
+  for (size_t f = 0; f < FIELDS; f++)
+    for (size_t b = 0; b < 2; b++) {
+      buffers[f][b] = next;
+      next += cells;
+    }
+
+  // Slabs are contiguous and split over the threads the same way in every
+  // kernel, so each thread first touches the pages it later steps
+  const uint64_t slab = layout.slab();
+  threadPool(cfg.threads)
+      .parallelFor(0, layout.side, [&](uint64_t bBegin, uint64_t bEnd) {
+        for (size_t f = 0; f < FIELDS; f++)
+          for (size_t b = 0; b < 2; b++)
+            memset(buffers[f][b] + bBegin * slab, 0,
+                   (bEnd - bBegin) * slab * sizeof(float));
+      });
+}
+
+VolumeSolver::~VolumeSolver() { munmap(arena, arenaBytes); }
+
+// Diffusion tails decay into subnormals within a few dozen cells, which
+// x86 cores handle in microcode at a hundred times the cost of a normal
+// operation. The slab kernels flush them to zero while they run.
+class FlushSubnormals {
+public:
+#if defined(__SSE2__)
+  FlushSubnormals() : saved(_mm_getcsr()) {
+    _mm_setcsr(saved | _MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON);
+  }
+  ~FlushSubnormals() { _mm_setcsr(saved); }
+
+private:
+  unsigned saved;
+#endif
+};
+
+// Calls fn(bk) for every slab of bricks, the slabs split over the threads
+template <typename Fn>
+static void forEachSlab(const BrickLayout &g, const SolverConfig &cfg,
+                        Fn &&fn) {
+  threadPool(cfg.threads)
+      .parallelFor(0, g.side, [&](uint64_t bBegin, uint64_t bEnd) {
+        FlushSubnormals flush;
+        for (uint64_t bk = bBegin; bk < bEnd; bk++)
+          fn(bk);
+      });
+}
+
+// Row of a brick: cells i0 + l, l < B, stored from q on, of which lBegin to
+// lEnd are interior, and where the rows next to it along j and k start
+struct BrickRow {
+  uint64_t q;
+  uint64_t i0;
+  uint64_t j;
+  uint64_t k;
+  uint64_t lBegin;
+  uint64_t lEnd;
+  uint64_t down;
+  uint64_t up;
+  uint64_t back;
+  uint64_t front;
+};
+
+// Calls fn(row) for every brick row of slab bk holding interior cells, brick
+// by brick. Rows next to a row are B or B^2 cells away inside a brick and a
+// brick away, less the rows crossed, on its faces.
+template <typename Fn>
+static void forEachRow(const BrickLayout &g, const uint64_t bk, Fn &&fn) {
+  static constexpr uint64_t C = BrickLayout::BRICK_CELLS;
+  const uint64_t n = g.n;
+  const uint64_t nextRow = g.side * C - (B - 1) * B;
+  const uint64_t nextPlane = g.side * g.side * C - (B - 1) * B * B;
+  const uint64_t kBegin = max<uint64_t>(bk * B, 1);
+  const uint64_t kEnd = min(bk * B + B, n + 1);
+  for (uint64_t bj = 0; bj < g.side; bj++) {
+    const uint64_t jBegin = max<uint64_t>(bj * B, 1);
+    const uint64_t jEnd = min(bj * B + B, n + 1);
+    for (uint64_t bi = 0; bi < g.side; bi++) {
+      const uint64_t i0 = bi * B;
+      const uint64_t iBegin = max<uint64_t>(i0, 1);
+      const uint64_t iEnd = min(i0 + B, n + 1);
+      if (iBegin >= iEnd)
+        continue;
+      for (uint64_t k = kBegin; k < kEnd; k++)
+        for (uint64_t j = jBegin; j < jEnd; j++) {
+          const uint64_t q = g.at(i0, j, k);
+          const uint64_t lj = j % B, lk = k % B;
+          fn(BrickRow{q, i0, j, k, iBegin - i0, iEnd - i0,
+                      lj > 0 ? q - B : q - nextRow,
+                      lj < B - 1 ? q + B : q + nextRow,
+                      lk > 0 ? q - B * B : q - nextPlane,
+                      lk < B - 1 ? q + B * B : q + nextPlane});
+        }
+    }
+  }
+}
+
+// The row of x with a cell more on each side, line[l + 1] is cell i0 + l.
+// Cells past the stored grid read as 0.
+static void loadLine(const BrickLayout &g, const float *__restrict x,
+                     const BrickRow &r, float *__restrict line) {
+  static constexpr uint64_t C = BrickLayout::BRICK_CELLS;
+  line[0] = r.i0 > 0 ? x[r.q - C + B - 1] : 0;
+  line[B + 1] = r.i0 + B < g.side * B ? x[r.q + C] : 0;
+  copy(x + r.q, x + r.q + B, line + 1);
+}
+
+// Ghost faces from the interior cell next to them, then the edges and the
+// corners as the average of the ghosts they touch
+static void setBoundary(const BrickLayout &g, const Mirror m,
+                        float *__restrict x, const SolverConfig &cfg) {
+  const uint64_t n = g.n;
+  const float sx = m == Mirror::X ? -1 : 1;
+  const float sy = m == Mirror::Y ? -1 : 1;
+  const float sz = m == Mirror::Z ? -1 : 1;
+  threadPool(cfg.threads)
+      .parallelFor(1, n + 1, [&](uint64_t tBegin, uint64_t tEnd) {
+        for (uint64_t t = tBegin; t < tEnd; t++)
+          for (uint64_t s = 1; s <= n; s++) {
+            x[g.at(0, s, t)] = sx * x[g.at(1, s, t)];
+            x[g.at(n + 1, s, t)] = sx * x[g.at(n, s, t)];
+            x[g.at(s, 0, t)] = sy * x[g.at(s, 1, t)];
+            x[g.at(s, n + 1, t)] = sy * x[g.at(s, n, t)];
+            x[g.at(s, t, 0)] = sz * x[g.at(s, t, 1)];
+            x[g.at(s, t, n + 1)] = sz * x[g.at(s, t, n)];
+          }
+      });
+
+  const uint64_t ghost[2] = {0, n + 1};
+  const uint64_t inner[2] = {1, n};
+  for (uint32_t a = 0; a < 2; a++)
+    for (uint32_t b = 0; b < 2; b++) {
+      const uint64_t ga = ghost[a], ia = inner[a];
+      const uint64_t gb = ghost[b], ib = inner[b];
+      for (uint64_t s = 1; s <= n; s++) {
+        x[g.at(s, ga, gb)] = .5f * (x[g.at(s, ia, gb)] + x[g.at(s, ga, ib)]);
+        x[g.at(ga, s, gb)] = .5f * (x[g.at(ia, s, gb)] + x[g.at(ga, s, ib)]);
+        x[g.at(ga, gb, s)] = .5f * (x[g.at(ia, gb, s)] + x[g.at(ga, ib, s)]);
+      }
+      for (uint32_t c = 0; c < 2; c++) {
+        const uint64_t gc = ghost[c], ic = inner[c];
+        x[g.at(ga, gb, gc)] = (x[g.at(ia, gb, gc)] + x[g.at(ga, ib, gc)] +
+                               x[g.at(ga, gb, ic)]) /
+                              3;
+      }
+    }
+}
+
+// Whole slabs, ghosts included, like the 2D add_source
+static void addSource(const BrickLayout &g, float *__restrict x,
+                      const float *__restrict s, const float dt,
+                      const SolverConfig &cfg) {
+  PROFILE_ZONE("add_source");
+  const uint64_t slab = g.slab();
+  forEachSlab(g, cfg, [&](uint64_t bk) {
+    for (uint64_t q = bk * slab; q < (bk + 1) * slab; q++)
+      x[q] += dt * s[q];
+  });
+}
+
+// Residuals are relative to the right hand side unless it vanishes
+static double relativeScale(const BrickLayout &g, const float *__restrict x,
+                            const SolverConfig &cfg) {
+  vector<double> slabs(g.side);
+  forEachSlab(g, cfg, [&](uint64_t bk) {
+    double s = 0;
+    forEachRow(g, bk, [&](const BrickRow &r) {
+      for (uint64_t l = r.lBegin; l < r.lEnd; l++)
+        s += x[r.q + l] * x[r.q + l];
+    });
+    slabs[bk] = s;
+  });
+  double s = 0;
+  for (const double v : slabs)
+    s += v;
+  return s > 0 ? 1 / sqrt(s) : 1;
+}
+
+// Relaxes the cells of slab bk with (i + j + k) % 2 == color in place and,
+// when track is set, returns the squared norm of c * (new - old). Cells of
+// one color only read the other, so slabs can go in any order. Like the 2D
+// red-black sweeps only the cells of color are visited, so nothing reads
+// the cells the slabs next to bk are writing.
+template <bool track>
+static double relaxSlab(const BrickLayout &g, float *__restrict x,
+                        const float *__restrict x0, const float a,
+                        const float c, const uint32_t color,
+                        const uint64_t bk) {
+  double r2 = 0;
+  forEachRow(g, bk, [&](const BrickRow &r) {
+    float line[B + 2];
+    loadLine(g, x, r, line);
+    const float *down = x + r.down;
+    const float *up = x + r.up;
+    const float *back = x + r.back;
+    const float *front = x + r.front;
+    const float *rhs = x0 + r.q;
+    float *row = x + r.q;
+
+    const uint64_t parity = (r.i0 + r.j + r.k + color) & 1;
+    for (uint64_t l = r.lBegin + ((r.lBegin + parity) & 1); l < r.lEnd;
+         l += 2) {
+      const float v = (rhs[l] + a * (line[l] + line[l + 2] + down[l] + up[l] +
+                                     back[l] + front[l])) /
+                      c;
+      if constexpr (track) {
+        const float d = c * (v - line[l + 1]);
+        r2 += d * d;
+      }
+      row[l] = v;
+    }
+  });
+  return r2;
+}
+
+// Red-black sweeps of c * x - a * (sum of the 6 neighbours) = x0 with the
+// walls of m after each, stopping as sweepSolve does in 2D. The residual is
+// summed per slab in order, so the threads don't change it.
+static SolveStats linearSolve(const BrickLayout &g, const Mirror m,
+                              float *__restrict x, const float *__restrict x0,
+                              const float a, const float c,
+                              const SolverConfig &cfg) {
+  const bool converge = cfg.tolerance > 0;
+  const double scale = relativeScale(g, x0, cfg);
+  vector<double> slabs(g.side);
+
+  SolveStats stats{0, NAN};
+  while (stats.iterations < cfg.maxIterations) {
+    const bool track =
+        converge || stats.iterations + 1 == cfg.maxIterations;
+    double r2 = 0;
+    for (uint32_t color = 0; color < 2; color++) {
+      forEachSlab(g, cfg, [&](uint64_t bk) {
+        slabs[bk] = track ? relaxSlab<true>(g, x, x0, a, c, color, bk)
+                          : relaxSlab<false>(g, x, x0, a, c, color, bk);
+      });
+      for (const double s : slabs)
+        r2 += s;
+    }
+    // A ghost only mirrors the cell reading it, once per sweep is enough
+    setBoundary(g, m, x, cfg);
+    stats.iterations++;
+
+    if (track) {
+      stats.residual = sqrt(r2) * scale;
+      if (converge && stats.residual <= cfg.tolerance)
+        break;
+    }
+  }
+  return stats;
+}
+
+static SolveStats diffuse(const BrickLayout &g, const Mirror m,
+                          float *__restrict x, const float *__restrict x0,
+                          const float diff, const float dt,
+                          const SolverConfig &cfg) {
+  PROFILE_ZONE("diffuse");
+  const float a = dt * diff * g.n * g.n;
+  return linearSolve(g, m, x, x0, a, 1 + 6 * a, cfg);
+}
+
+// Trilinear back trace of every interior cell of d along (vx, vy, vz), then
+// the walls of m. Returns the largest result or 0.
+static float advect(const BrickLayout &g, const Mirror m, float *__restrict d,
+                    const float *__restrict d0, const float *__restrict vx,
+                    const float *__restrict vy, const float *__restrict vz,
+                    const float dt, const SolverConfig &cfg) {
+  PROFILE_ZONE("advect");
+  const uint64_t n = g.n;
+  const float dt0 = dt * n;
+  vector<float> slabs(g.side);
+  forEachSlab(g, cfg, [&](uint64_t bk) {
+    float peak = 0;
+    forEachRow(g, bk, [&](const BrickRow &r) {
+      for (uint64_t l = r.lBegin; l < r.lEnd; l++) {
+        const uint64_t q = r.q + l;
+        const float x = clamp(r.i0 + l - dt0 * vx[q], 0.5f, n + .5f);
+        const float y = clamp(r.j - dt0 * vy[q], 0.5f, n + .5f);
+        const float z = clamp(r.k - dt0 * vz[q], 0.5f, n + .5f);
+
+        const uint32_t i0 = x, j0 = y, k0 = z;
+        const float s1 = x - i0, s0 = 1.f - s1;
+        const float t1 = y - j0, t0 = 1.f - t1;
+        const float u1 = z - k0, u0 = 1.f - u1;
+        const auto plane = [&](const uint64_t k) {
+          return s0 * (t0 * d0[g.at(i0, j0, k)] +
+                       t1 * d0[g.at(i0, j0 + 1, k)]) +
+                 s1 * (t0 * d0[g.at(i0 + 1, j0, k)] +
+                       t1 * d0[g.at(i0 + 1, j0 + 1, k)]);
+        };
+        d[q] = u0 * plane(k0) + u1 * plane(k0 + 1);
+        peak = max(peak, d[q]);
+      }
+    });
+    slabs[bk] = peak;
+  });
+  setBoundary(g, m, d, cfg);
+  return *max_element(slabs.begin(), slabs.end());
+}
+
+// Makes (vx, vy, vz) divergence free with a unit pressure solve, using
+// pressure and divergence as scratch
+static SolveStats project(const BrickLayout &g, float *__restrict vx,
+                          float *__restrict vy, float *__restrict vz,
+                          float *__restrict pressure,
+                          float *__restrict divergence,
+                          const SolverConfig &cfg, float &speed2) {
+  PROFILE_ZONE("project");
+  const float h = .5f / g.n;
+  forEachSlab(g, cfg, [&](uint64_t bk) {
+    forEachRow(g, bk, [&](const BrickRow &r) {
+      float line[B + 2];
+      loadLine(g, vx, r, line);
+      const float *down = vy + r.down;
+      const float *up = vy + r.up;
+      const float *back = vz + r.back;
+      const float *front = vz + r.front;
+      for (uint64_t l = r.lBegin; l < r.lEnd; l++) {
+        divergence[r.q + l] = -h * (line[l + 2] - line[l] + up[l] - down[l] +
+                                    front[l] - back[l]);
+        pressure[r.q + l] = 0;
+      }
+    });
+  });
+  setBoundary(g, Mirror::NONE, divergence, cfg);
+  setBoundary(g, Mirror::NONE, pressure, cfg);
+
+  SolveStats stats;
+  {
+    PROFILE_ZONE("pressure_solve");
+    stats = linearSolve(g, Mirror::NONE, pressure, divergence, 1, 6, cfg);
+  }
+
+  PROFILE_ZONE("subtract_gradient");
+  const float s = .5f * g.n;
+  vector<float> slabs(g.side);
+  forEachSlab(g, cfg, [&](uint64_t bk) {
+    float peak = 0;
+    forEachRow(g, bk, [&](const BrickRow &r) {
+      float line[B + 2];
+      loadLine(g, pressure, r, line);
+      const float *down = pressure + r.down;
+      const float *up = pressure + r.up;
+      const float *back = pressure + r.back;
+      const float *front = pressure + r.front;
+      for (uint64_t l = r.lBegin; l < r.lEnd; l++) {
+        const uint64_t q = r.q + l;
+        vx[q] -= s * (line[l + 2] - line[l]);
+        vy[q] -= s * (up[l] - down[l]);
+        vz[q] -= s * (front[l] - back[l]);
+        peak = max(peak, vx[q] * vx[q] + vy[q] * vy[q] + vz[q] * vz[q]);
+      }
+    });
+    slabs[bk] = peak;
+  });
+  setBoundary(g, Mirror::X, vx, cfg);
+  setBoundary(g, Mirror::Y, vy, cfg);
+  setBoundary(g, Mirror::Z, vz, cfg);
+  speed2 = *max_element(slabs.begin(), slabs.end());
+  return stats;
+}
+
+void VolumeSolver::inject(const span<const VolumeSplat> splats,
+                          const float dt) {
+  PROFILE_ZONE("inject");
+  float *vx = field(VolumeField::VX);
+  float *vy = field(VolumeField::VY);
+  float *vz = field(VolumeField::VZ);
+  float *d = field(VolumeField::DENSITY);
+
+  const int64_t last = layout.n;
+  for (const VolumeSplat &s : splats) {
+    const int64_t iBegin = max<int64_t>(ceil(s.x - s.radius), 1);
+    const int64_t iEnd = min<int64_t>(floor(s.x + s.radius), last);
+    const int64_t jBegin = max<int64_t>(ceil(s.y - s.radius), 1);
+    const int64_t jEnd = min<int64_t>(floor(s.y + s.radius), last);
+    const int64_t kBegin = max<int64_t>(ceil(s.z - s.radius), 1);
+    const int64_t kEnd = min<int64_t>(floor(s.z + s.radius), last);
+    for (int64_t k = kBegin; k <= kEnd; k++)
+      for (int64_t j = jBegin; j <= jEnd; j++)
+        for (int64_t i = iBegin; i <= iEnd; i++) {
+          const float dx = i - s.x;
+          const float dy = j - s.y;
+          const float dz = k - s.z;
+          if (dx * dx + dy * dy + dz * dz > s.radius * s.radius)
+            continue;
+          const uint64_t q = layout.at(i, j, k);
+          vx[q] += dt * s.fx;
+          vy[q] += dt * s.fy;
+          vz[q] += dt * s.fz;
+          d[q] += dt * s.density;
+        }
+  }
+}
+
+void VolumeSolver::velocityStep(const float visc, const float dt,
+                                VolumeStats &stats) {
+  PROFILE_ZONE("velocity_step");
+  static constexpr VolumeField AXES[] = {VolumeField::VX, VolumeField::VY,
+                                         VolumeField::VZ};
+  static constexpr Mirror MIRRORS[] = {Mirror::X, Mirror::Y, Mirror::Z};
+  static constexpr VolumeSolve VISCOSITY[] = {VolumeSolve::VISCOSITY_X,
+                                              VolumeSolve::VISCOSITY_Y,
+                                              VolumeSolve::VISCOSITY_Z};
+
+  for (uint32_t a = 0; a < 3; a++) {
+    if (cfg.sources)
+      addSource(layout, field(AXES[a]), source(AXES[a]), dt, cfg);
+    swap(AXES[a]);
+    stats.solve(VISCOSITY[a]) = diffuse(layout, MIRRORS[a], field(AXES[a]),
+                                        source(AXES[a]), visc, dt, cfg);
+  }
+  // What the diffusion started from is dead, it holds the pressure
+  float speed2;
+  stats.solve(VolumeSolve::PROJECT) =
+      project(layout, field(VolumeField::VX), field(VolumeField::VY),
+              field(VolumeField::VZ), source(VolumeField::VX),
+              source(VolumeField::VY), cfg, speed2);
+
+  for (const VolumeField f : AXES)
+    swap(f);
+  for (uint32_t a = 0; a < 3; a++)
+    advect(layout, MIRRORS[a], field(AXES[a]), source(AXES[a]),
+           source(VolumeField::VX), source(VolumeField::VY),
+           source(VolumeField::VZ), dt, cfg);
+  stats.solve(VolumeSolve::REPROJECT) =
+      project(layout, field(VolumeField::VX), field(VolumeField::VY),
+              field(VolumeField::VZ), source(VolumeField::VX),
+              source(VolumeField::VY), cfg, speed2);
+  maxSpeed = sqrt(speed2);
+  stats.maxSpeed = maxSpeed;
+}
+
+void VolumeSolver::densityStep(const float diff, const float dt,
+                               VolumeStats &stats) {
+  PROFILE_ZONE("density_step");
+  if (cfg.sources)
+    addSource(layout, field(VolumeField::DENSITY),
+              source(VolumeField::DENSITY), dt, cfg);
+
+  swap(VolumeField::DENSITY);
+  stats.solve(VolumeSolve::DENSITY) =
+      diffuse(layout, Mirror::NONE, field(VolumeField::DENSITY),
+              source(VolumeField::DENSITY), diff, dt, cfg);
+
+  swap(VolumeField::DENSITY);
+  maxDensity = advect(layout, Mirror::NONE, field(VolumeField::DENSITY),
+                      source(VolumeField::DENSITY), field(VolumeField::VX),
+                      field(VolumeField::VY), field(VolumeField::VZ), dt,
+                      cfg);
+  stats.maxDensity = maxDensity;
+}
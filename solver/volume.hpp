@@ -0,0 +1,141 @@
+#ifndef VOLUME_HPP
+#define VOLUME_HPP
+
+#include "solver.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Cells of a volume field run from 0 to n + 1 along each axis, ghosts
+// included, kept in bricks of BRICK^3 cells stored one after another. Cells
+// go i fastest inside a brick and bricks the same way across the grid, so
+// the bricks of a slab (the same k / BRICK) are contiguous. A brick is 2 KB:
+// the 7-point stencil over it reads its own cache lines and one face of each
+// neighbour instead of planes (n + 2)^2 floats apart.
+struct BrickLayout {
+  static constexpr uint64_t BRICK = 8;
+  static constexpr uint64_t BRICK_CELLS = BRICK * BRICK * BRICK;
+
+  explicit BrickLayout(const uint64_t n)
+      : n(n), side((n + 2 + BRICK - 1) / BRICK) {}
+
+  // Cells stored, ghosts and the padding of the last bricks included
+  uint64_t cells() const { return side * side * side * BRICK_CELLS; }
+  uint64_t slab() const { return side * side * BRICK_CELLS; }
+
+  uint64_t brick(const uint64_t bi, const uint64_t bj,
+                 const uint64_t bk) const {
+    return ((bk * side + bj) * side + bi) * BRICK_CELLS;
+  }
+  uint64_t at(const uint64_t i, const uint64_t j, const uint64_t k) const {
+    return brick(i / BRICK, j / BRICK, k / BRICK) +
+           (k % BRICK * BRICK + j % BRICK) * BRICK + i % BRICK;
+  }
+
+  uint64_t n;
+  // Bricks per side
+  uint64_t side;
+};
+
+enum class VolumeField { VX = 0, VY = 1, VZ = 2, DENSITY = 3, COUNT = 4 };
+
+enum class VolumeSolve {
+  VISCOSITY_X = 0,
+  VISCOSITY_Y = 1,
+  VISCOSITY_Z = 2,
+  PROJECT = 3,
+  REPROJECT = 4,
+  DENSITY = 5,
+  COUNT = 6
+};
+
+// SolverStats of the volume steps
+struct VolumeStats {
+  SolveStats solves[static_cast<uint32_t>(VolumeSolve::COUNT)];
+  float maxSpeed;
+  float maxDensity;
+
+  SolveStats &solve(const VolumeSolve s) {
+    return solves[static_cast<uint32_t>(s)];
+  }
+};
+
+// Splat with a third coordinate and force component
+struct VolumeSplat {
+  float x;
+  float y;
+  float z;
+  float radius;
+  float fx;
+  float fy;
+  float fz;
+  float density;
+};
+
+// 3D counterpart of FluidSolver on an n^3 grid: 7-point implicit diffusion
+// and projection, trilinear advection, walls on all 6 faces. Solves always
+// relax in red-black order, threads many bricks at a time, and stop as
+// SolverConfig::tolerance and maxIterations say; the other solver choices
+// are 2D only. Results don't depend on the threads. Projection uses the
+// back buffers of vx and vy as pressure and divergence, so the fields are
+// the only storage: 8 bricked buffers.
+class VolumeSolver {
+public:
+  VolumeSolver(const uint64_t n, const SolverConfig &cfg);
+  ~VolumeSolver();
+
+  VolumeSolver(const VolumeSolver &) = delete;
+  VolumeSolver &operator=(const VolumeSolver &) = delete;
+
+  uint64_t resolution() const { return layout.n; }
+  const BrickLayout &bricks() const { return layout; }
+  // Bytes of every buffer together
+  size_t bytes() const { return arenaBytes; }
+
+  SolverConfig &config() { return cfg; }
+  const SolverConfig &config() const { return cfg; }
+
+  // Indexed by BrickLayout::at
+  float *field(const VolumeField f) {
+    return buffers[index(f)][current[index(f)]];
+  }
+  const float *field(const VolumeField f) const {
+    return buffers[index(f)][current[index(f)]];
+  }
+  // Added to the field, scaled by dt, by the next step with
+  // SolverConfig::sources. Steps leave stale values behind.
+  float *source(const VolumeField f) {
+    return buffers[index(f)][1 - current[index(f)]];
+  }
+  void swap(const VolumeField f) { current[index(f)] ^= 1; }
+
+  // Adds dt times the splats to the current fields over the cells they cover
+  void inject(std::span<const VolumeSplat> splats, const float dt);
+
+  // Both leave their result in the current buffers
+  void velocityStep(const float visc, const float dt, VolumeStats &stats);
+  void densityStep(const float diff, const float dt, VolumeStats &stats);
+
+  float lastMaxSpeed() const { return maxSpeed; }
+  float lastMaxDensity() const { return maxDensity; }
+
+private:
+  static constexpr size_t FIELDS = static_cast<size_t>(VolumeField::COUNT);
+
+  static size_t index(const VolumeField f) { return static_cast<size_t>(f); }
+
+  BrickLayout layout;
+  SolverConfig cfg;
+
+  void *arena = nullptr;
+  size_t arenaBytes = 0;
+
+  float *buffers[FIELDS][2];
+  uint8_t current[FIELDS]{};
+
+  float maxSpeed = 0;
+  float maxDensity = 0;
+};
+
+#endif
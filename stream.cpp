@@ -0,0 +1,205 @@
+#include "stream.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <print>
+
+#include "solver/precision.hpp"
+
+using namespace std;
+
+static constexpr Field STREAM_FIELDS[] = {Field::DENSITY, Field::VX,
+                                          Field::VY};
+
+static void putVarint(vector<uint8_t> &out, uint32_t v) {
+  while (v >= 0x80) {
+    out.push_back(uint8_t(v) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(uint8_t(v));
+}
+
+FrameStream::FrameStream(FILE *file, const uint64_t n,
+                         const StreamOptions &opts)
+    : file(file), n(n), opts(opts) {
+  this->opts.downsample = max(opts.downsample, 1u);
+  this->opts.interior = opts.interior || this->opts.downsample > 1;
+  this->opts.ring = max(opts.ring, 1u);
+  const uint32_t f = this->opts.downsample;
+
+  fields = opts.velocity ? 3 : 1;
+  width = this->opts.interior ? (n + f - 1) / f : n + 2;
+  height = width;
+
+  slots.resize(this->opts.ring);
+  for (Slot &s : slots)
+    s.cells.resize(fields * width * height);
+
+  StreamHeader h{};
+  copy(begin(STREAM_MAGIC), end(STREAM_MAGIC), h.magic);
+  h.version = STREAM_VERSION;
+  h.codec = static_cast<uint32_t>(opts.codec);
+  h.fields = fields;
+  h.width = width;
+  h.height = height;
+  h.n = n;
+  h.downsample = f;
+  h.interior = this->opts.interior;
+  if (write(&h, sizeof(h)))
+    offset = sizeof(h);
+
+  writer = thread(&FrameStream::work, this);
+}
+
+FrameStream::~FrameStream() {
+  {
+    lock_guard lk(m);
+    stop = true;
+  }
+  ready.notify_one();
+  writer.join();
+
+  // A stopped stream keeps the frames written before the failure, readable
+  // one by one without the index
+  if (!failed) {
+    StreamTrailer t{offset, index.size(), {}};
+    copy(begin(STREAM_INDEX_MAGIC), end(STREAM_INDEX_MAGIC), t.magic);
+    if (write(index.data(), index.size() * sizeof(StreamIndexEntry)))
+      write(&t, sizeof(t));
+  }
+  if (fclose(file) != 0 && !failed)
+    fail();
+}
+
+bool FrameStream::write(const void *data, const size_t bytes) {
+  if (fwrite(data, 1, bytes, file) == bytes)
+    return true;
+  fail();
+  return false;
+}
+
+void FrameStream::fail() {
+  const int error = errno ? errno : EIO;
+  println(stderr, "stream: {}, stopped", strerror(error));
+  lock_guard lk(m);
+  failed = true;
+  counters.error = error;
+}
+
+void FrameStream::capture(const float *__restrict x,
+                          float *__restrict out) const {
+  if (!opts.interior) {
+    copy_n(x, (n + 2) * (n + 2), out);
+    return;
+  }
+
+  // Blocks on the last row and column may be cut by the grid edge
+  const uint64_t f = opts.downsample;
+  for (uint64_t bj = 0; bj < height; bj++)
+    for (uint64_t bi = 0; bi < width; bi++) {
+      const uint64_t iEnd = min(bi * f + f, n);
+      const uint64_t jEnd = min(bj * f + f, n);
+      float sum = 0;
+      for (uint64_t j = bj * f; j < jEnd; j++)
+        for (uint64_t i = bi * f; i < iEnd; i++)
+          sum += x[(i + 1) + (n + 2) * (j + 1)];
+      out[bi + width * bj] = sum / ((iEnd - bi * f) * (jEnd - bj * f));
+    }
+}
+
+void FrameStream::push(const uint64_t step, const FluidSolver &fluid) {
+  unique_lock lk(m);
+  if (failed)
+    return;
+  if (head - tail == slots.size()) {
+    const auto begin = chrono::steady_clock::now();
+    freed.wait(lk, [&] { return head - tail < slots.size(); });
+    counters.stalls++;
+    counters.stallTime += chrono::steady_clock::now() - begin;
+  }
+  Slot &slot = slots[head % slots.size()];
+  lk.unlock();
+
+  // The writer leaves the slot alone until head moves past it
+  slot.step = step;
+  const uint64_t cells = width * height;
+  for (uint32_t f = 0; f < fields; f++)
+    capture(fluid.values(STREAM_FIELDS[f], widened),
+            slot.cells.data() + f * cells);
+
+  lk.lock();
+  head++;
+  lk.unlock();
+  ready.notify_one();
+}
+
+void FrameStream::encode(const float *__restrict cells) {
+  const uint64_t count = fields * width * height;
+  encoded.clear();
+
+  switch (opts.codec) {
+  case StreamCodec::RAW:
+    encoded.resize(count * sizeof(float));
+    memcpy(encoded.data(), cells, encoded.size());
+    break;
+  case StreamCodec::HALF:
+    encoded.resize(count * sizeof(uint16_t));
+    for (uint64_t k = 0; k < count; k++) {
+      const uint16_t h = toHalf(cells[k]);
+      memcpy(encoded.data() + k * sizeof(h), &h, sizeof(h));
+    }
+    break;
+  case StreamCodec::DELTA:
+    for (uint32_t f = 0; f < fields; f++) {
+      uint16_t prev = 0;
+      for (uint64_t k = f * width * height; k < (f + 1) * width * height;
+           k++) {
+        const uint16_t h = toHalf(cells[k]);
+        const int16_t d = int16_t(uint16_t(h - prev));
+        putVarint(encoded, (uint32_t(d) << 1) ^ uint32_t(d >> 15));
+        prev = h;
+      }
+    }
+    break;
+  }
+}
+
+void FrameStream::work() {
+  unique_lock lk(m);
+  for (;;) {
+    ready.wait(lk, [&] { return stop || head != tail; });
+    if (head == tail)
+      return;
+    // Frames left in the ring of a stopped stream are dropped
+    if (failed) {
+      tail = head;
+      freed.notify_one();
+      continue;
+    }
+    const Slot &slot = slots[tail % slots.size()];
+    lk.unlock();
+
+    encode(slot.cells.data());
+    const FrameHeader h{slot.step, encoded.size()};
+    const bool written =
+        write(&h, sizeof(h)) && write(encoded.data(), encoded.size());
+    if (written) {
+      index.push_back({offset, slot.step});
+      offset += sizeof(h) + encoded.size();
+    }
+
+    lk.lock();
+    tail++;
+    if (written) {
+      counters.frames++;
+      counters.bytes += sizeof(h) + encoded.size();
+    }
+    freed.notify_one();
+  }
+}
+
+StreamStats FrameStream::stats() {
+  lock_guard lk(m);
+  return counters;
+}
@@ -0,0 +1,140 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "solver/solver.hpp"
+
+// How frames are stored
+//   RAW: native floats
+//   HALF: IEEE half floats, rounded to nearest even
+//   DELTA: half floats as the zigzag LEB128 varint of the difference with
+//     the previous value of the field, smooth fields take about a byte a cell
+enum class StreamCodec { RAW = 0, HALF = 1, DELTA = 2 };
+
+struct StreamOptions {
+  StreamCodec codec = StreamCodec::DELTA;
+  bool velocity = false;
+  // Drops the ghost cells, implied by a downsample above 1
+  bool interior = false;
+  // Each output cell averages a downsample x downsample block
+  uint32_t downsample = 1;
+  // Captured frames waiting for the writer before push blocks
+  uint32_t ring = 4;
+};
+
+// A stream file is a StreamHeader, then per frame a FrameHeader and its
+// fields (density, and vx, vy with velocity) of width * height cells each,
+// i fastest, encoded with the codec. Closing appends an index of every frame
+// and a StreamTrailer pointing at it, files cut short can still be read
+// frame by frame.
+struct StreamHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t codec;
+  uint32_t fields;
+  uint32_t width;
+  uint32_t height;
+  uint32_t n;
+  uint32_t downsample;
+  uint32_t interior;
+};
+
+struct FrameHeader {
+  uint64_t step;
+  // Encoded bytes of all fields of the frame
+  uint64_t bytes;
+};
+
+struct StreamIndexEntry {
+  uint64_t offset;
+  uint64_t step;
+};
+
+struct StreamTrailer {
+  uint64_t indexOffset;
+  uint64_t frames;
+  char magic[8];
+};
+
+static constexpr char STREAM_MAGIC[8] = "NSSTRM";
+static constexpr char STREAM_INDEX_MAGIC[8] = "NSINDEX";
+static constexpr uint32_t STREAM_VERSION = 1;
+
+struct StreamStats {
+  uint64_t frames;
+  uint64_t bytes;
+  // Pushes that found the ring full and the time they waited for the writer
+  uint64_t stalls;
+  std::chrono::duration<double, std::milli> stallTime;
+  // errno of the write that stopped the stream, 0 while it runs
+  int error;
+};
+
+// Frames are captured into a ring of preallocated buffers and encoded and
+// appended by a background thread, so the solver only pays for the copy. A
+// failed write is reported once and stops the stream, later pushes are
+// dropped.
+class FrameStream {
+public:
+  FrameStream(std::FILE *file, const uint64_t n, const StreamOptions &opts);
+  // Writes the frames left in the ring and the index, closes the file
+  ~FrameStream();
+
+  FrameStream(const FrameStream &) = delete;
+  FrameStream &operator=(const FrameStream &) = delete;
+
+  // Captures the current fields of fluid as the frame of step
+  void push(const uint64_t step, const FluidSolver &fluid);
+
+  StreamStats stats();
+
+private:
+  struct Slot {
+    uint64_t step;
+    std::vector<float> cells;
+  };
+
+  void capture(const float *__restrict x, float *__restrict out) const;
+  void encode(const float *__restrict cells);
+  // Whether all of data went to the file, stops the stream otherwise
+  bool write(const void *data, const size_t bytes);
+  void fail();
+  void work();
+
+  std::FILE *file;
+  uint64_t n;
+  StreamOptions opts;
+  uint32_t fields;
+  uint64_t width;
+  uint64_t height;
+
+  std::mutex m;
+  std::condition_variable ready;
+  std::condition_variable freed;
+  std::vector<Slot> slots;
+  uint64_t head = 0;
+  uint64_t tail = 0;
+  bool stop = false;
+  // Set by fail, read under m
+  bool failed = false;
+  StreamStats counters{};
+
+  // Fields of 16 bit solvers widened by push, on the solver thread
+  std::vector<float> widened;
+
+  // Only touched by the writer thread
+  std::vector<uint8_t> encoded;
+  std::vector<StreamIndexEntry> index;
+  uint64_t offset = 0;
+
+  std::thread writer;
+};
+
+#endif